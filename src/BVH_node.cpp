@@ -1,8 +1,31 @@
 #include "BVH_node.h"
+#include "flexception.h"
 #include "helper.h"
+#include "paged_bvh.h"
 
 using namespace std;
 
+thread_local uint64_t RaysTraced = 0;
+
+static thread_local std::shared_ptr<Arena> nodeArena;
+
+BVHBuildPhase::BVHBuildPhase() : outermost(!nodeArena) {
+    if (outermost) {
+        nodeArena = std::make_shared<Arena>();
+    }
+}
+
+BVHBuildPhase::~BVHBuildPhase() {
+    if (outermost) {
+        // the nodes keep the arena alive
+        nodeArena.reset();
+    }
+}
+
+const std::shared_ptr<Arena> &bvh_node_arena() {
+    return nodeArena;
+}
+
 BVH_node::BVH_node(shared_ptr<Shape> obj) {
     leafObj = obj;
     box = get_bbox(obj);
@@ -11,6 +34,13 @@ BVH_node::BVH_node(shared_ptr<Shape> obj) {
 
 BVH_node::BVH_node(std::vector<shared_ptr<Shape>>& objects, Scene& scene,
                 pcg32_state &rng) {
+    BVHBuildPhase phase;
+    *this = *merge_mesh_bvhs(build_mesh_bvhs(objects, scene, rng), scene.camera.origin);
+}
+
+
+std::vector<std::shared_ptr<BVH_node>> build_mesh_bvhs(std::vector<shared_ptr<Shape>>& objects,
+        Scene& scene, pcg32_state &rng) {
     // traverse the entire object by index, build BVH_node 
     // for single sphere or TriangleMesh
     std::vector<std::shared_ptr<BVH_node>> meshBVH;
@@ -20,7 +50,7 @@ BVH_node::BVH_node(std::vector<shared_ptr<Shape>>& objects, Scene& scene,
         shapePtr = objects[idx].get();
         if (std::get_if<Sphere>(shapePtr)) {
             // call leaf constructor on single sphere
-            meshBVH.push_back(std::make_shared<BVH_node>(objects[idx]));
+            meshBVH.push_back(make_bvh_node(objects[idx]));
             idx++;
         }
         else if (Triangle* tri = std::get_if<Triangle>(shapePtr)) {
@@ -30,7 +60,7 @@ BVH_node::BVH_node(std::vector<shared_ptr<Shape>>& objects, Scene& scene,
                 meshSize = scene.meshes[tri->mesh_id].indices.size();
             }
             // call ordinary constructor
-            meshBVH.push_back(std::make_shared<BVH_node>(
+            meshBVH.push_back(make_bvh_node(
                 objects,
                 idx, idx + meshSize,
                 rng, false
@@ -39,18 +69,19 @@ BVH_node::BVH_node(std::vector<shared_ptr<Shape>>& objects, Scene& scene,
             idx += meshSize;
         }
     }
+    return meshBVH;
+}
+
 
+std::shared_ptr<BVH_node> merge_mesh_bvhs(std::vector<std::shared_ptr<BVH_node>> meshBVH,
+        const Vector3 &camOrigin) {
+    assert(meshBVH.size() > 0);
     // rare case: single mesh/Sphere
     if (meshBVH.size() == 1) {
-        left = meshBVH[0].get()->left;
-        right = meshBVH[0].get()->right;
-        leafObj = meshBVH[0].get()->leafObj;
-        box = AABB(meshBVH[0].get()->box);
-        return;
+        return meshBVH[0];
     }
 
     // sort these BVH_node using their bbox center
-    Vector3 camOrigin = scene.camera.origin;
     std::sort(meshBVH.begin(), meshBVH.end(),
               [&camOrigin](const std::shared_ptr<BVH_node> a, const std::shared_ptr<BVH_node> b) {
                   double dist_a = distance_squared(a.get()->box.center(), camOrigin);
@@ -65,16 +96,14 @@ BVH_node::BVH_node(std::vector<shared_ptr<Shape>>& objects, Scene& scene,
     std::shared_ptr<BVH_node> rightPtr = meshBVH[tail];
     // left and right at the same time to keep the tree more balanced
     while (tail - head >= 3) {  // when both can merge
-        leftPtr = std::make_shared<BVH_node>(leftPtr, meshBVH[++head]);
-        rightPtr = std::make_shared<BVH_node>(meshBVH[--tail], rightPtr);    
+        leftPtr = make_bvh_node(leftPtr, meshBVH[++head]);
+        rightPtr = make_bvh_node(meshBVH[--tail], rightPtr);    
     }
     if (tail-head == 2) {
-        leftPtr = std::make_shared<BVH_node>(leftPtr, meshBVH[++head]);
+        leftPtr = make_bvh_node(leftPtr, meshBVH[++head]);
     }
-    // Now left and right cover all nodes, construct self
-    left = leftPtr;
-    right = rightPtr;
-    box = surrounding_box(leftPtr.get()->box, rightPtr.get()->box);
+    // Now left and right cover all nodes
+    return make_bvh_node(leftPtr, rightPtr);
 }
 
 
@@ -102,24 +131,24 @@ BVH_node::BVH_node(std::vector<std::shared_ptr<Shape>>& objects,
     size_t object_span = end - start;
 
     if (object_span == 1) {
-        left = right = make_shared<BVH_node>(objects[start]);
+        left = right = make_bvh_node(objects[start]);
         // std::cout << left.get()->leafObj << "\t" << 
         //     bool(left.get()->leafObj == nullptr) << std::endl;
     } else if (object_span == 2) {
         if (comparator(objects[start], objects[start+1])) {
-            left = make_shared<BVH_node>(objects[start]);
-            right = make_shared<BVH_node>(objects[start+1]);
+            left = make_bvh_node(objects[start]);
+            right = make_bvh_node(objects[start+1]);
         } else {
-            left = make_shared<BVH_node>(objects[start+1]);
-            right = make_shared<BVH_node>(objects[start]);
+            left = make_bvh_node(objects[start+1]);
+            right = make_bvh_node(objects[start]);
         }
     } else {
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
         // tick(timer);
         auto mid = SAH_split(objects, start, end, axis);
         // auto mid = start + object_span/2;
-        left = make_shared<BVH_node>(objects, start, mid, rng, randomAxis);
-        right = make_shared<BVH_node>(objects, mid, end, rng, randomAxis);
+        left = make_bvh_node(objects, start, mid, rng, randomAxis);
+        right = make_bvh_node(objects, mid, end, rng, randomAxis);
         /* if (object_span >= 10000){
             std::cout << "Recursion left and right from " << start << " to " << end << 
                 "\n\t took another " << tick(timer) << " seconds." << std::endl;
@@ -164,6 +193,15 @@ bool BVH_node::hit(const ray& r, Real t_min, Real t_max,
     }
 
     // std::cout << "Not always miss top-level box \n";
+    // out-of-core subtree: traverse it inside its page
+    if (pages) {
+        return pages->hit(page_id, r, t_min, t_max, rec, hitObj);
+    }
+    // flattened subtree, e.g. of a mapped snapshot
+    if (flat) {
+        return hit_flat_bvh(flat->nodes, flat->shapes, 0, r, t_min, t_max, rec, hitObj);
+    }
+
     // leaf node
     if (leafObj) {
         checkRayShapeHit(r, *leafObj, rec, hitObj);
@@ -191,6 +229,75 @@ bool BVH_node::hit(const ray& r, Real t_min, Real t_max,
     return hit_left || hit_right;
 }
 
+bool hit_flat_bvh(const FlatBVHNode *nodes, Shape *shapes, int node_id,
+                  const ray& r, Real t_min, Real t_max, Hit_Record& rec, Shape*& hitObj) {
+    const FlatBVHNode &node = nodes[node_id];
+    if (!node.box.hit(r, t_min, t_max)) {
+        return false;
+    }
+    if (node.shape >= 0) {
+        checkRayShapeHit(r, shapes[node.shape], rec, hitObj);
+        return bool(t_min <= rec.dist && rec.dist <= t_max);
+    }
+    const AABB &left_box = nodes[node.left].box;
+    const AABB &right_box = nodes[node.right].box;
+    bool hit_left, hit_right;
+    if (distance_squared(0.5 * (left_box.minimum + left_box.maximum), r.orig) <
+            distance_squared(0.5 * (right_box.minimum + right_box.maximum), r.orig)) {
+        hit_left = hit_flat_bvh(nodes, shapes, node.left, r, t_min, t_max, rec, hitObj);
+        hit_right = hit_flat_bvh(nodes, shapes, node.right, r, t_min,
+            hit_left ? rec.dist : t_max, rec, hitObj);
+    } else {
+        hit_right = hit_flat_bvh(nodes, shapes, node.right, r, t_min, t_max, rec, hitObj);
+        hit_left = hit_flat_bvh(nodes, shapes, node.left, r, t_min,
+            hit_right ? rec.dist : t_max, rec, hitObj);
+    }
+    return hit_left || hit_right;
+}
+
+int flatten_bvh(const BVH_node &node, const Shape *shapes, size_t num_shapes,
+                std::vector<FlatBVHNode> &nodes) {
+    int id = nodes.size();
+    if (node.pages) {
+        Error("Out-of-core BVH nodes cannot be flattened.");
+    } else if (node.flat) {
+        // Already flat: copy it, shifting the child indices.
+        const FlatBVH &flat = *node.flat;
+        if (flat.shapes < shapes || flat.shapes > shapes + num_shapes) {
+            Error("BVH leaves must point into the flattened shapes.");
+        }
+        int32_t shape_offset = (int32_t)(flat.shapes - shapes);
+        for (size_t i = 0; i < flat.num_nodes; i++) {
+            FlatBVHNode copy = flat.nodes[i];
+            if (copy.shape >= 0) {
+                copy.shape += shape_offset;
+                if (copy.shape >= (int32_t)num_shapes) {
+                    Error("BVH leaves must point into the flattened shapes.");
+                }
+            } else {
+                copy.left += id;
+                copy.right += id;
+            }
+            nodes.push_back(copy);
+        }
+        return id;
+    }
+    nodes.push_back(FlatBVHNode{node.box, -1, -1, -1, 0});
+    if (node.leafObj) {
+        ptrdiff_t shape = node.leafObj.get() - shapes;
+        if (shape < 0 || shape >= (ptrdiff_t)num_shapes) {
+            Error("BVH leaves must point into the flattened shapes.");
+        }
+        nodes[id].shape = (int32_t)shape;
+    } else {
+        int left = flatten_bvh(*node.left, shapes, num_shapes, nodes);
+        int right = flatten_bvh(*node.right, shapes, num_shapes, nodes);
+        nodes[id].left = left;
+        nodes[id].right = right;
+    }
+    return id;
+}
+
 size_t SAH_split(std::vector<std::shared_ptr<Shape>>& objects,
         size_t start, size_t end, int axis) 
 {
@@ -199,16 +306,18 @@ size_t SAH_split(std::vector<std::shared_ptr<Shape>>& objects,
     // std::cout << "Step 1 Done: " << std::endl;
 
     // Step 2: create bbox for each division
-    std::vector<AABB> divBoxes;
+    // (scratch arrays come from the thread's arena and are released on return)
+    Arena &arena = thread_arena();
+    ArenaScope scratch(arena);
+    AABB *divBoxes = arena.allocate_array<AABB>(nDiv);
     size_t jump = (end-start) / nDiv;
     size_t localStart = start;
     for (size_t i=0; i<nDiv-1; ++i) {
-        divBoxes.push_back(rangeAABB(objects, localStart, localStart+jump));
+        divBoxes[i] = rangeAABB(objects, localStart, localStart+jump);
         localStart += jump;
     }
     // deal with the last entry, which have a larger jump
-    divBoxes.push_back(rangeAABB(objects, localStart, end));
-    assert(divBoxes.size() == nDiv && "divBoxes caculation is wrong");
+    divBoxes[nDiv-1] = rangeAABB(objects, localStart, end);
     // std::cout << "Step 2 Done: " << std::endl;
 
     // Step 3: calculate SAH at each division choice
@@ -217,8 +326,7 @@ size_t SAH_split(std::vector<std::shared_ptr<Shape>>& objects,
     //   surface area of outside AABB (of current node)
     //   cost of each primitive, since we assume they (for Tri and Sphere) be the same.
     // *We use accumulation trick to merge from left to right once and right to left once.
-    std::vector<Real> choices;
-    choices.resize(nDiv - 1);   // 16 divisions give you 15 choices of split position
+    Real *choices = arena.allocate_array<Real>(nDiv - 1);   // 16 divisions give you 15 choices of split position
     // sweep forward to get SAH of left in linear time
     AABB currAABB = divBoxes[0];
     choices[0] = currAABB.surfaceA() * jump * (0+1);
@@ -245,8 +353,8 @@ size_t SAH_split(std::vector<std::shared_ptr<Shape>>& objects,
 
 
     // Step 4: get the choice index of smallest SAH
-    auto smallest_it = std::min_element(choices.begin(), choices.end());
-    int smallest_index = std::distance(choices.begin(), smallest_it);
+    Real *smallest_it = std::min_element(choices, choices + nDiv - 1);
+    int smallest_index = std::distance(choices, smallest_it);
 
     // Step 5: convert choice index into object index
     // index == 0 means left has 1 chunk
@@ -284,5 +392,5 @@ bool isVisible(const Vector3& shadingPt, Vector3& lightPos, Scene& scene, BVH_no
     Hit_Record rec;
     Shape* hitObj = nullptr;
     // hit => not visible (shadow)
-    return !root.hit(lightRay, EPSILON, (1-EPSILON) * d, scene, rec, hitObj);
+    return !root.trace(lightRay, EPSILON, (1-EPSILON) * d, scene, rec, hitObj);
 }
@@ -1,19 +1,56 @@
 #pragma once
 
 #include "Scene.h"
+#include "parallel.h"
 
 #include <memory>
 
 using namespace std;
 
+class PagedGeometry;
+
+/// One node of a flattened BVH, stored in pre-order (the root is node 0, children
+/// always come after their parent). Internal nodes have two children, leaves the
+/// index of their shape.
+struct FlatBVHNode {
+    AABB box;
+    int32_t left, right;
+    int32_t shape;  // -1 for internal nodes
+    int32_t reserved;
+};
+
+/// A BVH traversed straight from an array of FlatBVHNode, e.g. inside a mapped scene
+/// snapshot. nodes and shapes are not owned, unless nodes points into owned_nodes.
+struct FlatBVH {
+    const FlatBVHNode *nodes = nullptr;
+    size_t num_nodes = 0;
+    Shape *shapes = nullptr;
+    std::vector<FlatBVHNode> owned_nodes;
+};
+
+/// Number of rays the calling thread has traced through BVH_node::trace, for the
+/// throughput statistics of the progress report.
+extern thread_local uint64_t RaysTraced;
+
 struct BVH_node {
     // member variables
     shared_ptr<BVH_node> left, right;
     AABB box;
     shared_ptr<Shape> leafObj;  // nullptr if non-leaf node
+    // out-of-core subtree: the node stands for page page_id of pages (see paged_bvh.h)
+    PagedGeometry *pages = nullptr;
+    int page_id = -1;
+    // flattened subtree: the node stands for node 0 of flat
+    shared_ptr<const FlatBVH> flat;
 
     // leaf constructor
     BVH_node(shared_ptr<Shape> obj);
+    // paged subtree constructor
+    BVH_node(PagedGeometry *pagedGeometry, int page, const AABB &pageBox) :
+    box(pageBox), pages(pagedGeometry), page_id(page) {}
+    // flattened subtree constructor
+    BVH_node(shared_ptr<const FlatBVH> flatBVH) :
+    box(flatBVH->nodes[0].box), flat(flatBVH) {}
     // quick merge constructor
     BVH_node(shared_ptr<BVH_node> leftBVH, shared_ptr<BVH_node> rightBVH) :
     left(leftBVH), right(rightBVH)
@@ -37,6 +74,12 @@ struct BVH_node {
     // member functions
     bool hit(const ray& r, Real t_min, Real t_max,
             const Scene& scene, Hit_Record& rec, Shape*& hitObj);
+    // hit() on the root: the same, but counted in RaysTraced
+    bool trace(const ray& r, Real t_min, Real t_max,
+            const Scene& scene, Hit_Record& rec, Shape*& hitObj) {
+        RaysTraced++;
+        return hit(r, t_min, t_max, scene, rec, hitObj);
+    }
     
     bool write_bounding_box(AABB& output_box) const {
         output_box = box;
@@ -50,6 +93,34 @@ struct BVH_node {
     
 };
 
+/// While alive, the BVH nodes created by make_bvh_node on the calling thread come
+/// from one arena instead of one heap allocation each. The arena lives on until the
+/// last of its nodes is destroyed. Nested phases share the outermost phase's arena.
+class BVHBuildPhase {
+public:
+    BVHBuildPhase();
+    ~BVHBuildPhase();
+
+    BVHBuildPhase(const BVHBuildPhase &) = delete;
+    BVHBuildPhase &operator=(const BVHBuildPhase &) = delete;
+
+private:
+    bool outermost;
+};
+
+/// The node arena of the calling thread's build phase; nullptr outside of one.
+const std::shared_ptr<Arena> &bvh_node_arena();
+
+template <typename... Args>
+std::shared_ptr<BVH_node> make_bvh_node(Args &&...args) {
+    const std::shared_ptr<Arena> &arena = bvh_node_arena();
+    if (!arena) {
+        return std::make_shared<BVH_node>(std::forward<Args>(args)...);
+    }
+    return std::allocate_shared<BVH_node>(ArenaAllocator<BVH_node>(arena),
+                                          std::forward<Args>(args)...);
+}
+
 inline int random_int(int min, int max, pcg32_state &rng) {
     // Returns a random integer in [min,max].
     return static_cast<int>(
@@ -76,6 +147,27 @@ inline bool box_z_compare (const shared_ptr<Shape> a, const shared_ptr<Shape> b)
     return box_compare(a, b, 2);
 }
 
+/// Same traversal as BVH_node::hit, over the flattened subtree rooted at nodes[node_id]
+/// whose leaves index shapes.
+bool hit_flat_bvh(const FlatBVHNode *nodes, Shape *shapes, int node_id,
+                  const ray& r, Real t_min, Real t_max, Hit_Record& rec, Shape*& hitObj);
+
+/// Append node and its subtree to nodes in pre-order and return the index of node.
+/// The leaves must point into shapes[0, num_shapes); subtrees reachable through
+/// several parents are stored once per parent.
+int flatten_bvh(const BVH_node &node, const Shape *shapes, size_t num_shapes,
+                std::vector<FlatBVHNode> &nodes);
+
+// Build one BVH_node for every single sphere or TriangleMesh in objects
+// (objects holds the Triangles of a mesh consecutively).
+std::vector<std::shared_ptr<BVH_node>> build_mesh_bvhs(vector<shared_ptr<Shape>>& objects,
+        Scene& scene, pcg32_state &rng);
+
+// Merge per-mesh BVH_nodes into a single tree; the ones closer to camOrigin end up
+// closer to the root.
+std::shared_ptr<BVH_node> merge_mesh_bvhs(std::vector<std::shared_ptr<BVH_node>> meshBVH,
+        const Vector3 &camOrigin);
+
 // Helper for picking axis with largest range
 Vector3 axisRange(const vector<shared_ptr<Shape>>& src_objects, size_t start, size_t end);
 
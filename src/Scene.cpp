@@ -3,8 +3,9 @@
 using namespace std;
 
 // constructor
-Scene::Scene(const ParsedScene &scene) :
+Scene::Scene(const ParsedScene &scene, bool page_meshes) :
         camera(scene.camera),
+        cameras(scene.cameras.begin(), scene.cameras.end()),
         width(scene.camera.width),
         height(scene.camera.height),
         background_color(scene.background_color),
@@ -43,6 +44,17 @@ Scene::Scene(const ParsedScene &scene) :
             shape_id_map.push_back(currIdx);
             currIdx++;
         } else if (auto *parsed_mesh = get_if<ParsedTriangleMesh>(&parsed_shape)) {
+            if (page_meshes && parsed_mesh->area_light_id < 0) {
+                // Out-of-core: no light refers to it, so it takes no slot in shapes.
+                TriangleMesh &mesh = meshes[tri_mesh_count];
+                mesh.material_id = parsed_mesh->material_id;
+                mesh.area_light_id = parsed_mesh->area_light_id;
+                mesh.size = (int)parsed_mesh->indices.size();
+                mesh.totalArea = 0;
+                tri_mesh_count++;
+                shape_id_map.push_back(currIdx);
+                continue;
+            }
             meshes[tri_mesh_count] = TriangleMesh(*parsed_mesh);
             // Extract all the individual triangles
             int nTri = meshes[tri_mesh_count].size;
@@ -6,6 +6,8 @@
 #include "Hit_Record.h"
 #include "parse_scene.h"
 #include "material.h"
+#include "vertex_attributes.h"
+#include "scene_array.h"
 
 using namespace std;
 
@@ -18,6 +20,7 @@ struct Camera
     Vector3 horizontal, vertical;
     Vector3 lower_left_corner;
 
+    Camera() {}
     Camera(
         Vector3 lookfrom,
         Vector3 lookat,
@@ -136,20 +139,21 @@ struct Sphere : public ShapeBase {
 };
 
 struct TriangleMesh : public ShapeBase {
-    std::vector<Vector3> positions;
-    std::vector<Vector3i> indices;
-    std::vector<Vector3> normals;
-    std::vector<Vector2> uvs;
+    // full precision unless built with TORREY_COMPACT_ATTRIBUTES (see vertex_attributes.h)
+    SceneArray<PackedPosition> positions;
+    SceneArray<Vector3i> indices;
+    SceneArray<PackedNormal> normals;
+    SceneArray<PackedUV> uvs;
     int size;
     Real totalArea;
-    std::vector<Real> areaCDF;
+    SceneArray<Real> areaCDF;
 
     // Give it a constructor in order to sample area light
     TriangleMesh() {};
     TriangleMesh(const ParsedTriangleMesh& pMesh) :
         ShapeBase{pMesh.material_id, pMesh.area_light_id},
-        positions(pMesh.positions), indices(pMesh.indices), 
-        normals(pMesh.normals), uvs(pMesh.uvs),
+        positions(pack_positions(pMesh.positions)), indices(pMesh.indices), 
+        normals(pack_normals(pMesh.normals)), uvs(pack_uvs(pMesh.uvs)),
         size((int)pMesh.indices.size()),
         areaCDF(pMesh.indices.size() + 1, 0.0)
     {
@@ -168,15 +172,16 @@ struct TriangleMesh : public ShapeBase {
 };
 
 struct Triangle : public ShapeBase{
+    // Intersection geometry, full precision in either build (see vertex_attributes.h).
     Vector3 p0, p1, p2;  // vertices position
-    Vector3 n0, n1, n2;
+    PackedNormal n0, n1, n2;  // decoded by shading_normal()
     Vector3 normal;  // may need triangle normal
     Vector3 e1, e2;  // p1-p0, p2-p0; not normalized
     double area;
     int face_id = -1;
     int mesh_id = -1;   // in order to retrieve material and light id
     AABB box;   // has default constructor
-    Vector2 uv0, uv1, uv2;  // uv coordinates; possibly null
+    PackedUV uv0, uv1, uv2;  // uv coordinates; possibly null; decoded by get_tri_uv()
     bool hasUV = false;
 
     // naive constructor; used in hw_2_1 and hw_2_2
@@ -191,9 +196,9 @@ struct Triangle : public ShapeBase{
         // get indices
         Vector3i id3 = mesh->indices[face_index];
         // "repeat" naive constructor
-        p0 = mesh->positions[id3[0]];
-        p1 = mesh->positions[id3[1]];
-        p2 = mesh->positions[id3[2]];
+        p0 = unpack_position(mesh->positions[id3[0]]);
+        p1 = unpack_position(mesh->positions[id3[1]]);
+        p2 = unpack_position(mesh->positions[id3[2]]);
         e1 = p1 - p0;  e2 = p2 - p0;
         area = 0.5 * length(cross(e1, e2));
         // write normals
@@ -204,7 +209,7 @@ struct Triangle : public ShapeBase{
             n2 = mesh->normals[id3[2]];
         } else {
             // just use Triangle normal
-            n0 = normal; n1 = normal; n2 = normal;
+            n0 = pack_normal(normal); n1 = n0; n2 = n0;
         }
         // material id
         material_id = mesh->material_id;
@@ -228,16 +233,19 @@ struct Triangle : public ShapeBase{
     void get_tri_uv(Real b1, Real b2, double& rec_u, double& rec_v) {
         assert(hasUV && "Calling get_tri_uv() on Triangle without uv");
 
-        rec_u = (1.0 - b1 - b2) * uv0.x + b1 * uv1.x + b2 * uv2.x;
-        rec_v = (1.0 - b1 - b2) * uv0.y + b1 * uv1.y + b2 * uv2.y;
+        const Vector2 &t0 = unpack_uv(uv0);
+        const Vector2 &t1 = unpack_uv(uv1);
+        const Vector2 &t2 = unpack_uv(uv2);
+        rec_u = (1.0 - b1 - b2) * t0.x + b1 * t1.x + b2 * t2.x;
+        rec_v = (1.0 - b1 - b2) * t0.y + b1 * t1.y + b2 * t2.y;
     }
 
     // interpolate 3 vertex normals with baryC
     inline Vector3 shading_normal(double b1, double b2) {
         return normalize(
-            (1.0-b1-b2) * n0 +
-            b1 * n1 +
-            b2 * n2
+            (1.0-b1-b2) * unpack_normal(n0) +
+            b1 * unpack_normal(n1) +
+            b2 * unpack_normal(n2)
         );
     }
 };
@@ -273,11 +281,18 @@ inline bool is_light(const Shape &shape) {
 
 // A scene encapsulating everything above
 struct Scene {
-    Scene(const ParsedScene &scene);
+    // An empty scene, filled in by read_scene_snapshot.
+    Scene() {}
+    // With page_meshes, meshes that are not area lights are not expanded into shapes:
+    // their Triangles are built page by page by build_paged_render_scene and only
+    // the mesh record (ids and size) stays in meshes.
+    Scene(const ParsedScene &scene, bool page_meshes = false);
 
     Camera camera;
+    // All the cameras of the scene file (camera is the last); see "-hw batch".
+    std::vector<Camera> cameras;
     int width, height;
-    std::vector<Shape> shapes;
+    SceneArray<Shape> shapes;
     std::vector<Material> materials;
     std::vector<Light> lights;
     Vector3 background_color;
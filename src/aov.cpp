@@ -0,0 +1,144 @@
+#include "aov.h"
+#include "flexception.h"
+
+#include <sstream>
+
+namespace {
+
+const char *c_aov_names[num_aovs] = {
+    "depth", "normal", "albedo", "material_id", "direct", "indirect", "samples", "variance"
+};
+
+} // namespace
+
+const char *aov_name(Aov aov) {
+    return c_aov_names[int(aov)];
+}
+
+AovSet parse_aovs(const std::string &list) {
+    AovSet aovs;
+    std::istringstream iss(list);
+    std::string name;
+    while (std::getline(iss, name, ',')) {
+        int a = 0;
+        while (a < num_aovs && name != c_aov_names[a]) {
+            a++;
+        }
+        if (a == num_aovs) {
+            Error("Unknown AOV " + name + " (depth, normal, albedo, material_id, direct, "
+                  "indirect, samples or variance).");
+        }
+        aovs.set(a);
+    }
+    if (aovs.none()) {
+        Error("No AOVs given.");
+    }
+    return aovs;
+}
+
+AovFilm::AovFilm(const AovSet &aovs, size_t num_pixels) : aovs(aovs) {
+    if (aov_needs_first_hit(aovs) || aov_needs_direct(aovs)) {
+        samples.assign(num_pixels, 0);
+    }
+    if (has(Aov::Depth) || has(Aov::Normal)) {
+        hits.assign(num_pixels, 0);
+    }
+    if (has(Aov::Depth)) {
+        depth.assign(num_pixels, Real(0));
+    }
+    if (has(Aov::Normal)) {
+        normal.assign(num_pixels, Vector3{0, 0, 0});
+    }
+    if (has(Aov::Albedo)) {
+        albedo.assign(num_pixels, Vector3{0, 0, 0});
+    }
+    if (aov_needs_direct(aovs)) {
+        direct.assign(num_pixels, Vector3{0, 0, 0});
+    }
+    if (has(Aov::MaterialId)) {
+        material_id.assign(num_pixels, -1);
+    }
+}
+
+void AovFilm::add(size_t p, const AovPixel &pixel) {
+    if (samples.empty() || pixel.samples == 0) {
+        return;
+    }
+    if (!material_id.empty() && samples[p] == 0) {
+        material_id[p] = pixel.material_id;
+    }
+    samples[p] += pixel.samples;
+    if (!hits.empty()) {
+        hits[p] += pixel.hits;
+    }
+    if (!depth.empty()) {
+        depth[p] += pixel.depth;
+    }
+    if (!normal.empty()) {
+        normal[p] += pixel.normal;
+    }
+    if (!albedo.empty()) {
+        albedo[p] += pixel.albedo;
+    }
+    if (!direct.empty()) {
+        direct[p] += pixel.direct;
+    }
+}
+
+ImageLayer aov_layer(Aov aov, const AovFilm &aov_film, const PartialRender &film) {
+    if (!aov_film.has(aov)) {
+        Error(std::string("The AOV ") + aov_name(aov) + " was not collected.");
+    }
+    bool gray = aov == Aov::Depth || aov == Aov::MaterialId || aov == Aov::SampleCount;
+    Image1f gray_img = gray ? Image1f(film.width, film.height) : Image1f(0, 0);
+    Image3f rgb_img = gray ? Image3f(0, 0) : Image3f(film.width, film.height);
+    for (int y = film.crop.y0; y < film.crop.y1; y++) {
+        for (int x = film.crop.x0; x < film.crop.x1; x++) {
+            size_t p = film.index(x, y);
+            Real w = film.weight[p];
+            Real n = aov_film.samples.empty() ? 0 : aov_film.samples[p];
+            Real hits = aov_film.hits.empty() ? 0 : aov_film.hits[p];
+            switch (aov) {
+                case Aov::Depth:
+                    gray_img(x, y) = hits > 0 ? aov_film.depth[p] / hits : infinity<float>();
+                    break;
+                case Aov::Normal:
+                    rgb_img(x, y) = hits > 0 ? aov_film.normal[p] / hits : Vector3{0, 0, 0};
+                    break;
+                case Aov::Albedo:
+                    rgb_img(x, y) = n > 0 ? aov_film.albedo[p] / n : Vector3{0, 0, 0};
+                    break;
+                case Aov::MaterialId:
+                    gray_img(x, y) = aov_film.material_id[p];
+                    break;
+                case Aov::Direct:
+                    rgb_img(x, y) = n > 0 ? aov_film.direct[p] / n : Vector3{0, 0, 0};
+                    break;
+                case Aov::Indirect:
+                    // so that direct + indirect adds up to the color (in double, before rounding)
+                    rgb_img(x, y) = n > 0 && w > 0 ? film.sum[p] / w - aov_film.direct[p] / n : Vector3{0, 0, 0};
+                    break;
+                case Aov::SampleCount:
+                    gray_img(x, y) = w;
+                    break;
+                case Aov::Variance:
+                    if (w >= 2) {
+                        // of the mean: the sample variance over the number of samples
+                        Vector3 mean = film.sum[p] / w;
+                        Vector3 sample_variance = (film.sum_sq[p] / w - mean * mean) * (w / (w - 1));
+                        rgb_img(x, y) = max(sample_variance, Vector3{0, 0, 0}) / w;
+                    }
+                    break;
+                case Aov::Count:
+                    break;
+            }
+        }
+    }
+    ImageLayer layer{aov_name(aov), {}};
+    if (gray) {
+        layer.image = std::move(gray_img);
+    } else {
+        layer.image = std::move(rgb_img);
+    }
+    return layer;
+}
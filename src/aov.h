@@ -0,0 +1,79 @@
+#pragma once
+
+#include "image.h"
+#include "partial_render.h"
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+/// Arbitrary output variables: per-pixel quantities a render collects next to the
+/// color, for diagnostics and compositing.
+enum class Aov {
+    Depth,        // distance to the first hit, averaged over the samples that hit
+    Normal,       // shading normal at the first hit, likewise
+    Albedo,       // reflectance at the first hit (the background color on a miss)
+    MaterialId,   // material of the first hit of the pixel's first sample (-1: none)
+    Direct,       // light that reached the camera after at most one bounce
+    Indirect,     // the rest of the color
+    SampleCount,  // number of samples of the pixel
+    Variance,     // variance of the pixel's color estimate
+    Count
+};
+constexpr int num_aovs = int(Aov::Count);
+using AovSet = std::bitset<num_aovs>;
+
+/// The name of an AOV on the command line and in the EXR file ("depth", "normal", ...).
+const char *aov_name(Aov aov);
+/// Parse a comma-separated list of AOV names, e.g. "depth,normal,direct".
+AovSet parse_aovs(const std::string &list);
+
+/// Whether the AOVs need the first hit of every camera ray.
+inline bool aov_needs_first_hit(const AovSet &aovs) {
+    return aovs[int(Aov::Depth)] || aovs[int(Aov::Normal)] || aovs[int(Aov::Albedo)] ||
+        aovs[int(Aov::MaterialId)];
+}
+
+/// Whether the AOVs need the direct lighting of every sample.
+inline bool aov_needs_direct(const AovSet &aovs) {
+    return aovs[int(Aov::Direct)] || aovs[int(Aov::Indirect)];
+}
+
+/// The AOV sums of one pixel over some of its samples.
+struct AovPixel {
+    int samples = 0;
+    int hits = 0;
+    Real depth = 0;
+    Vector3 normal = Vector3{0, 0, 0};
+    Vector3 albedo = Vector3{0, 0, 0};
+    Vector3 direct = Vector3{0, 0, 0};
+    int material_id = -1;
+};
+
+/// The AOV sums of the pixels of a film, indexed like it. Only the AOVs of the set
+/// have buffers, and only those that are sums: indirect, the sample count and the
+/// variance come from the film. An empty set costs nothing.
+struct AovFilm {
+    AovSet aovs;
+    // samples that contributed (a resumed render has film samples without AOVs);
+    // empty if only AOVs of the film are collected
+    std::vector<int> samples;
+    // samples whose camera ray hit something (for depth and normal)
+    std::vector<int> hits;
+    std::vector<Real> depth;
+    std::vector<Vector3> normal, albedo, direct;
+    std::vector<int> material_id;
+
+    AovFilm() {}
+    AovFilm(const AovSet &aovs, size_t num_pixels);
+
+    bool has(Aov aov) const {
+        return aovs[int(aov)];
+    }
+    /// Add the sums of a pixel. The first sample to arrive sets its material id.
+    void add(size_t p, const AovPixel &pixel);
+};
+
+/// An AOV as a whole-image layer named after it, from the sums and the film (indexed
+/// alike). Pixels outside the film's crop window are zero.
+ImageLayer aov_layer(Aov aov, const AovFilm &aov_film, const PartialRender &film);
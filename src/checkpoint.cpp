@@ -0,0 +1,61 @@
+#include "checkpoint.h"
+#include "timer.h"
+
+Checkpointer::Checkpointer(const fs::path &filename, Real interval_seconds,
+                           const PartialRender &film, std::shared_mutex &film_mutex) :
+        filename(filename), interval_seconds(interval_seconds),
+        film(film), film_mutex(film_mutex) {
+    thread = std::thread([this] { run(); });
+}
+
+Checkpointer::~Checkpointer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_condition.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Checkpointer::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_condition.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    save();
+}
+
+void Checkpointer::run() {
+    auto interval = std::chrono::duration<double>(interval_seconds);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop_condition.wait_for(lock, interval, [this] { return stopping; })) {
+        lock.unlock();
+        try {
+            save();
+        } catch (const std::exception &e) {
+            // a failed checkpoint must not end the render; the next one may succeed
+            std::cerr << "Checkpoint failed: " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+void Checkpointer::save() {
+    Timer timer;
+    tick(timer);
+    PartialRender copy;
+    {
+        std::unique_lock<std::shared_mutex> lock(film_mutex);
+        copy = film;
+    }
+    Real copy_time = tick(timer);
+    write_partial_render(filename, copy);
+    std::cout << "\nCheckpoint written to " << filename.string() << " (copy " <<
+        copy_time << " s, write " << tick(timer) << " s)." << std::endl;
+}
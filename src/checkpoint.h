@@ -0,0 +1,42 @@
+#pragma once
+
+#include "partial_render.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+/// Saves the film of a running render to a partial render file every interval,
+/// so that a render that is killed can be resumed (see -resume). The film is
+/// copied while holding film_mutex exclusively -- the renderer holds it shared
+/// while storing finished tiles, so every checkpoint holds whole pixels -- and
+/// the copy is written from the checkpoint thread, so the render only waits
+/// for the copy, not for the disk.
+class Checkpointer {
+public:
+    Checkpointer(const fs::path &filename, Real interval_seconds,
+                 const PartialRender &film, std::shared_mutex &film_mutex);
+    /// Stops the thread without writing a last checkpoint.
+    ~Checkpointer();
+
+    Checkpointer(const Checkpointer &) = delete;
+    Checkpointer &operator=(const Checkpointer &) = delete;
+
+    /// Stop the thread and write a last checkpoint of the film as it is now.
+    void finish();
+
+private:
+    void run();
+    void save();
+
+    fs::path filename;
+    Real interval_seconds;
+    const PartialRender &film;
+    std::shared_mutex &film_mutex;
+
+    std::mutex mutex;
+    std::condition_variable stop_condition;
+    bool stopping = false;
+    std::thread thread;
+};
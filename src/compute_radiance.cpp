@@ -70,7 +70,7 @@ Vector3 BVH_PixelColor(Scene& scene, ray& localRay, BVH_node& root,
     // Step 1 BVH UPDATE: detect hit. 
     Hit_Record rec;
     Shape* hitObj = nullptr;
-    root.hit(localRay, EPSILON, infinity<Real>(), scene, rec, hitObj);
+    root.trace(localRay, EPSILON, infinity<Real>(), scene, rec, hitObj);
     if (rec.dist > 1e9) {  // no hit
         return scene.background_color;
     }
@@ -268,9 +268,14 @@ Vector3 meshLight_total_contribution(Scene& scene, Hit_Record& rec, BVH_node& ro
     bool all = sampleAll || meshCt < maxSample;  // what really should be done
     // sample some (64) lights only if flag set and > 64 lights present
     int n_sample = all? meshCt : maxSample;
-    // stratas to look at
-    vector<int> stratas;
-    stratified? stratas.assign({0,1,2,3}): stratas.assign({-1});
+    // stratas to look at, in scratch memory from the thread's arena
+    Arena &arena = thread_arena();
+    ArenaScope scratch(arena);
+    int n_stratas = stratified? 4 : 1;
+    int *stratas = arena.allocate_array<int>(n_stratas);
+    for (int i=0; i<n_stratas; ++i) {
+        stratas[i] = stratified? i : -1;
+    }
     for (int local_i=0; local_i<n_sample; ++local_i) {
         // 1. pick a triangle
         if (all) {
@@ -284,7 +289,8 @@ Vector3 meshLight_total_contribution(Scene& scene, Hit_Record& rec, BVH_node& ro
         tri = get_if<Triangle>(light_tri);
         assert(tri && "Some shape is not a Traingle in an area-lighted mesh");
 
-        for (int which_part : stratas) {
+        for (int strata_i=0; strata_i<n_stratas; ++strata_i) {
+            int which_part = stratas[strata_i];
             // 2. pick a point from the triangle
             light_pos = Triangle_sample(tri, rng, which_part);
             // 3. visibility check        
@@ -299,7 +305,7 @@ Vector3 meshLight_total_contribution(Scene& scene, Hit_Record& rec, BVH_node& ro
             nx = (dot(nx, light_pos - rec.pos) < 0.0)? nx : -nx;
             // 5. accumulate
             total_contribution += (all? tri->area : meshArea) *  // p(x)
-                1.0 / stratas.size() *   // average over stratas
+                1.0 / n_stratas *   // average over stratas
                 areaLight_contribution(light_tri, rec, light_pos, Kd, I, nx);
         }
             
@@ -358,7 +364,7 @@ Vector3 radiance(Scene& scene, ray& localRay, BVH_node& root,
     // Step 1: detect hit. 
     Hit_Record rec;
     Shape* hitObj = nullptr;
-    root.hit(localRay, EPSILON, infinity<Real>(), scene, rec, hitObj);
+    root.trace(localRay, EPSILON, infinity<Real>(), scene, rec, hitObj);
     if (!hitObj) {  // no hit
         return scene.background_color;
     }
@@ -718,7 +724,7 @@ Real alternative_light_pdf(ray& outRay, Scene& scene, BVH_node& root,  // determ
     // detect hit. 
     Hit_Record rec;
     Shape* lightObj = nullptr;
-    root.hit(outRay, EPSILON, infinity<Real>(), scene, rec, lightObj);
+    root.trace(outRay, EPSILON, infinity<Real>(), scene, rec, lightObj);
     if (!lightObj || !is_light(*lightObj)) {  // no hit OR hitObj is not Area Light
         return 0.0;
     }
@@ -765,7 +771,7 @@ Vector3 radiance_iterative(Scene& scene, ray& localRay, BVH_node& root,
 // Step 1. Intersect ray with scene and store intersection in rec
 Hit_Record rec;
 Shape* hitObj = nullptr;
-root.hit(localRay, EPSILON, infinity<Real>(), scene, rec, hitObj);
+root.trace(localRay, EPSILON, infinity<Real>(), scene, rec, hitObj);
 
 // Step 2. <<Terminate path if ray escaped or maxDepth was reached>>= 
 if (hitObj == nullptr) {
@@ -882,7 +888,7 @@ Vector3 sample_oneLight_contribution(Scene& scene, Hit_Record& rec,
         Hit_Record rec_light;
         Shape* lightObj = nullptr;
         ray lightRay(rec.pos, out_dir);
-        root.hit(lightRay, EPSILON, infinity<Real>(), scene, rec_light, lightObj);
+        root.trace(lightRay, EPSILON, infinity<Real>(), scene, rec_light, lightObj);
         if (lightObj != nullptr) {
             // cout << rec_light.normal << length(rec_light.normal) << endl;
             dsq = distance_squared(rec.pos, rec_light.pos);
@@ -920,7 +926,7 @@ Vector3 sample_oneLight_contribution(Scene& scene, Hit_Record& rec,
         Hit_Record rec_brdf;
         Shape* brdfObj = nullptr;
         ray brdfRay(rec.pos, out_dir);
-        root.hit(brdfRay, EPSILON, infinity<Real>(), scene, rec_brdf, brdfObj);
+        root.trace(brdfRay, EPSILON, infinity<Real>(), scene, rec_brdf, brdfObj);
         if (brdfObj != nullptr) {
             Triangle* tri = get_if<Triangle>(brdfObj);
             Sphere* sph = get_if<Sphere>(brdfObj);
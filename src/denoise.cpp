@@ -0,0 +1,69 @@
+#include "denoise.h"
+#include "flexception.h"
+#include "parallel.h"
+
+namespace {
+
+// Keeps black albedos from dividing by zero.
+constexpr Real c_albedo_epsilon = 1e-2;
+
+} // namespace
+
+Image3f denoise(const Image3f &color, const Image1f &variance,
+                const Image3f &albedo, const Image3f &normal,
+                const DenoiseOptions &options) {
+    int width = color.width, height = color.height;
+    if (variance.width != width || albedo.width != width || normal.width != width ||
+            variance.height != height || albedo.height != height || normal.height != height) {
+        Error("denoise: the color, variance and feature buffers differ in size.");
+    }
+    // Work on the irradiance: the color with the albedo divided out.
+    // stored in float like the images, computed in double
+    Image3f irradiance(width, height);
+    Image1f irradiance_variance(width, height);
+    for (int i = 0; i < width * height; i++) {
+        Vector3 a = Vector3(albedo(i)) + c_albedo_epsilon;
+        irradiance(i) = Vector3f(Vector3(color(i)) / a);
+        Real mean_a = average(a);
+        irradiance_variance(i) = float(variance(i) / (mean_a * mean_a));
+    }
+
+    Real inv_spatial = 1 / (2 * options.sigma_spatial * options.sigma_spatial);
+    Real inv_normal = 1 / (2 * options.sigma_normal * options.sigma_normal);
+    Real inv_albedo = 1 / (2 * options.sigma_albedo * options.sigma_albedo);
+    Real k_sq = options.k_color * options.k_color;
+    int r = options.radius;
+    Image3f result(width, height);
+    parallel_for([&](int64_t row) {
+        int y = int(row);
+        for (int x = 0; x < width; x++) {
+            Vector3 c_p = irradiance(x, y);
+            Vector3 n_p = normal(x, y);
+            Vector3 a_p = albedo(x, y);
+            Real var_p = irradiance_variance(x, y);
+            Vector3 sum{0, 0, 0};
+            Real weight_sum = 0;
+            for (int qy = std::max(y - r, 0); qy <= std::min(y + r, height - 1); qy++) {
+                for (int qx = std::max(x - r, 0); qx <= std::min(x + r, width - 1); qx++) {
+                    Real d_spatial = Real((qx - x) * (qx - x) + (qy - y) * (qy - y));
+                    Real d_normal = distance_squared(n_p, Vector3(normal(qx, qy)));
+                    Real d_albedo = distance_squared(a_p, Vector3(albedo(qx, qy)));
+                    // The color distance of Rousselle et al. 2012: the squared
+                    // difference less the part noise explains, relative to the noise.
+                    Real var_q = irradiance_variance(qx, qy);
+                    Vector3 c_q = irradiance(qx, qy);
+                    Vector3 diff = c_p - c_q;
+                    Real d_color = (average(diff * diff) - (var_p + std::min(var_p, var_q))) /
+                        (Real(1e-10) + k_sq * (var_p + var_q));
+                    Real w = exp(-d_spatial * inv_spatial - d_normal * inv_normal -
+                                 d_albedo * inv_albedo - std::max(d_color, Real(0)));
+                    sum += w * c_q;
+                    weight_sum += w;
+                }
+            }
+            // weight_sum >= 1: the pixel itself has weight 1
+            result(x, y) = Vector3f(sum / weight_sum * (a_p + c_albedo_epsilon));
+        }
+    }, height);
+    return result;
+}
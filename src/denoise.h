@@ -0,0 +1,29 @@
+#pragma once
+
+#include "image.h"
+
+/// Settings of the feature-guided denoiser.
+struct DenoiseOptions {
+    // The filter window is (2 radius + 1)^2 pixels.
+    int radius = 7;
+    // Falloff of the weights with the distance in pixels and the differences of
+    // the normals and of the albedos.
+    Real sigma_spatial = 3;
+    Real sigma_normal = 0.3;
+    Real sigma_albedo = 0.2;
+    // How many standard deviations of noise two pixels may differ by and still be
+    // averaged. Lower keeps more detail and more noise.
+    Real k_color = 1.5;
+};
+
+/// Denoise a rendered image with a joint bilateral filter. color is the pixel
+/// estimates and variance their variances (of the estimate, not of the samples);
+/// albedo and normal are the mean first-hit reflectance and shading normal.
+/// The albedo is divided out first, so that textures are not blurred, and
+/// multiplied back afterwards. A neighbour's weight falls with its distance,
+/// with the differences of the features and with the difference of the
+/// colors relative to their noise, so edges that the features or the colors
+/// show clearly are kept. Rows are filtered in parallel on the thread pool.
+Image3f denoise(const Image3f &color, const Image1f &variance,
+                const Image3f &albedo, const Image3f &normal,
+               const DenoiseOptions &options = DenoiseOptions());
@@ -601,8 +601,6 @@ Image3 hw_1_8(const std::vector<std::string> &params) {
         Real u, v;
         // cannot directly store color now
         Vector3 pixel_color;
-        // setup random geneator; give it unique stream_id
-        pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
         // start and stop indices for each tile
         int x0 = tile[0] * tile_size;
         int x1 = std::min(x0 + tile_size, img.width);
@@ -613,6 +611,8 @@ Image3 hw_1_8(const std::vector<std::string> &params) {
                 // for each pixel, shoot may random rays thru
                 pixel_color = {0.0, 0.0, 0.0};
                 for (int s=0; s<spp; ++s) {    
+                    // the random stream of this sample, whatever the tiling
+                    pcg32_state rng = init_sample_pcg32(uint64_t(y) * img.width + x, s);
                     // shoot a ray
                     u = Real(x + next_pcg32_real<double>(rng)) / (img.width - 1);
                     v = Real(y + next_pcg32_real<double>(rng)) / (img.height - 1);
@@ -814,8 +814,6 @@ Image3 hw_1_11(const std::vector<std::string> &params) {
         Real u, v;
         // cannot directly store color now
         Vector3 pixel_color;
-        // setup random geneator; give it unique stream_id
-        pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
         // start and stop indices for each tile
         int x0 = tile[0] * tile_size;
         int x1 = std::min(x0 + tile_size, img.width);
@@ -826,6 +824,8 @@ Image3 hw_1_11(const std::vector<std::string> &params) {
                 // for each pixel, shoot may random rays thru
                 pixel_color = {0.0, 0.0, 0.0};
                 for (int s=0; s<spp; ++s) {    
+                    // the random stream of this sample, whatever the tiling
+                    pcg32_state rng = init_sample_pcg32(uint64_t(y) * img.width + x, s);
                     // shoot a ray
                     u = Real(x + next_pcg32_real<double>(rng)) / (img.width - 1);
                     v = Real(y + next_pcg32_real<double>(rng)) / (img.height - 1);
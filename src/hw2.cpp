@@ -197,8 +197,6 @@ Image3 hw_2_3(const std::vector<std::string> &params) {
         Real u, v;
         // cannot directly store color now
         Vector3 pixel_color;
-        // setup random geneator; give it unique stream_id
-        pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
         // start and stop indices for each tile
         int x0 = tile[0] * tile_size;
         int x1 = std::min(x0 + tile_size, img.width);
@@ -209,6 +207,8 @@ Image3 hw_2_3(const std::vector<std::string> &params) {
                 // for each pixel, shoot may random rays thru
                 pixel_color = {0.0, 0.0, 0.0};
                 for (int s=0; s<spp; ++s) {    
+                    // the random stream of this sample, whatever the tiling
+                    pcg32_state rng = init_sample_pcg32(uint64_t(y) * img.width + x, s);
                     // shoot a ray
                     u = Real(x + next_pcg32_real<double>(rng)) / (img.width - 1);
                     v = Real(y + next_pcg32_real<double>(rng)) / (img.height - 1);
@@ -264,8 +264,6 @@ Image3 hw_2_4(const std::vector<std::string> &params) {
         Real u, v;
         // cannot directly store color now
         Vector3 pixel_color;
-        // setup random geneator; give it unique stream_id
-        pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
         // start and stop indices for each tile
         int x0 = tile[0] * tile_size;
         int x1 = std::min(x0 + tile_size, img.width);
@@ -275,6 +273,8 @@ Image3 hw_2_4(const std::vector<std::string> &params) {
             for (int x = x0; x < x1; x++) {
                 pixel_color = {0.0, 0.0, 0.0};
                 for (int s=0; s<spp; ++s) {    
+                    // the random stream of this sample, whatever the tiling
+                    pcg32_state rng = init_sample_pcg32(uint64_t(y) * img.width + x, s);
                     // shoot a ray
                     u = Real(x + next_pcg32_real<double>(rng)) / (img.width - 1);
                     v = Real(y + next_pcg32_real<double>(rng)) / (img.height - 1);
@@ -312,7 +312,7 @@ Image3 hw_2_5(const std::vector<std::string> &params) {
     // construct BVH tree
     pcg32_state rng_BVH = init_pcg32();
     // DEBUG NOTE: see BVH_node.h
-    std::vector<Shape>& shapes = myScene.shapes;
+    auto &shapes = myScene.shapes;
     std::vector<std::shared_ptr<Shape>> shape_ptrs;
     for (size_t i = 0; i < shapes.size(); ++i) {
         std::shared_ptr<Shape> shape_ptr = std::make_shared<Shape>(shapes[i]);
@@ -342,8 +342,6 @@ Image3 hw_2_5(const std::vector<std::string> &params) {
         Real u, v;
         // cannot directly store color now
         Vector3 pixel_color;
-        // setup random geneator; give it unique stream_id
-        pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
         // start and stop indices for each tile
         int x0 = tile[0] * tile_size;
         int x1 = std::min(x0 + tile_size, img.width);
@@ -354,6 +352,8 @@ Image3 hw_2_5(const std::vector<std::string> &params) {
                 // for each pixel, shoot may random rays thru
                 pixel_color = {0.0, 0.0, 0.0};
                 for (int s=0; s<spp; ++s) {    
+                    // the random stream of this sample, whatever the tiling
+                    pcg32_state rng = init_sample_pcg32(uint64_t(y) * img.width + x, s);
                     // shoot a ray
                     u = Real(x + next_pcg32_real<double>(rng)) / (img.width - 1);
                     v = Real(y + next_pcg32_real<double>(rng)) / (img.height - 1);
@@ -2,7 +2,7 @@
 
 #include "compute_radiance.h"
 
-Image3 hw_4_1(const std::vector<std::string> &params);
-Image3 hw_4_2(const std::vector<std::string> &params);
-Image3 hw_4_3(const std::vector<std::string> &params);
-Image3 hw_4_4(const std::vector<std::string> &params);
+Image3f hw_4_1(const std::vector<std::string> &params);
+Image3f hw_4_2(const std::vector<std::string> &params);
+Image3f hw_4_3(const std::vector<std::string> &params);
+Image3f hw_4_4(const std::vector<std::string> &params);
@@ -5,8 +5,10 @@
 #define TINYEXR_IMPLEMENTATION
 #include "3rdparty/tinyexr.h"
 #include "flexception.h"
+#include "parallel.h"
 #include <algorithm>
 #include <fstream>
+#include <type_traits>
 
 using std::string;
 using std::vector;
@@ -132,46 +134,281 @@ Image3 imread3(const fs::path &filename) {
     return img;
 }
 
-void imwrite(const fs::path &filename, const Image3 &image) {
+namespace {
+
+// Scanlines per block of a ZIP-compressed EXR file.
+constexpr int c_exr_block_lines = 16;
+// Blocks (or PFM scanlines) converted in parallel and then written, in order,
+// before the next batch. This bounds the memory beyond the image itself.
+constexpr int c_write_batch_blocks = 64;
+constexpr int c_write_batch_lines = c_exr_block_lines * c_write_batch_blocks;
+
+/// One block of an EXR file: its first scanline and data size, then the scanlines,
+/// each channel by channel (B, G, R) in fp16, ZIP-compressed unless that would not
+/// make them smaller.
+template <typename T>
+vector<unsigned char> encode_exr_block(const Image<TVector3<T>> &image, int y0) {
+    int lines = std::min(c_exr_block_lines, image.height - y0);
+    size_t line_size = size_t(image.width) * 3 * sizeof(unsigned short);
+    vector<unsigned char> raw(lines * line_size);
+    for (int l = 0; l < lines; l++) {
+        const TVector3<T> *row = &image(0, y0 + l);
+        for (int c = 0; c < 3; c++) {
+            unsigned short *dst = reinterpret_cast<unsigned short *>(
+                &raw[l * line_size + c * image.width * sizeof(unsigned short)]);
+            for (int x = 0; x < image.width; x++) {
+                tinyexr::FP32 f32;
+                f32.f = float(row[x][2 - c]);
+                tinyexr::FP16 h16 = tinyexr::float_to_half_full(f32);
+                tinyexr::swap2(&h16.u);
+                tinyexr::cpy2(dst + x, &h16.u);
+            }
+        }
+    }
+    vector<unsigned char> block(2 * sizeof(int) + mz_compressBound(mz_ulong(raw.size())));
+    tinyexr::tinyexr_uint64 size = block.size() - 2 * sizeof(int);
+    tinyexr::CompressZip(&block[2 * sizeof(int)], size, raw.data(), (unsigned long)raw.size());
+    int block_header[2] = {y0, int(size)};
+    tinyexr::swap4(&block_header[0]);
+    tinyexr::swap4(&block_header[1]);
+    memcpy(block.data(), block_header, sizeof(block_header));
+    block.resize(2 * sizeof(int) + size);
+    return block;
+}
+
+/// The same file SaveEXR writes (fp16, ZIP), but the blocks are converted and
+/// compressed in parallel straight from the image, be it float or double.
+template <typename T>
+void write_exr(std::ofstream &ofs, const Image<TVector3<T>> &image) {
+    vector<tinyexr::ChannelInfo> channels(3);
+    const char *names[3] = {"B", "G", "R"};
+    for (int c = 0; c < 3; c++) {
+        channels[c].name = names[c];
+        channels[c].pixel_type = TINYEXR_PIXELTYPE_HALF;
+        channels[c].requested_pixel_type = TINYEXR_PIXELTYPE_HALF;
+        channels[c].x_sampling = channels[c].y_sampling = 1;
+        channels[c].p_linear = 0;
+    }
+    // magic number and version 2, single-part scanline file
+    vector<unsigned char> header = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+    vector<unsigned char> channel_list;
+    tinyexr::WriteChannelInfo(channel_list, channels);
+    tinyexr::WriteAttributeToMemory(&header, "channels", "chlist",
+                                    channel_list.data(), int(channel_list.size()));
+    unsigned char compression = TINYEXR_COMPRESSIONTYPE_ZIP;
+    tinyexr::WriteAttributeToMemory(&header, "compression", "compression", &compression, 1);
+    int window[4] = {0, 0, image.width - 1, image.height - 1};
+    for (int &w : window) {
+        tinyexr::swap4(&w);
+    }
+    tinyexr::WriteAttributeToMemory(&header, "dataWindow", "box2i",
+                                    reinterpret_cast<const unsigned char *>(window), sizeof(window));
+    tinyexr::WriteAttributeToMemory(&header, "displayWindow", "box2i",
+                                    reinterpret_cast<const unsigned char *>(window), sizeof(window));
+    unsigned char line_order = 0;  // increasing y
+    tinyexr::WriteAttributeToMemory(&header, "lineOrder", "lineOrder", &line_order, 1);
+    float aspect_ratio = 1, center[2] = {0, 0}, window_width = 1;
+    tinyexr::swap4(&aspect_ratio);
+    tinyexr::WriteAttributeToMemory(&header, "pixelAspectRatio", "float",
+                                    reinterpret_cast<const unsigned char *>(&aspect_ratio), sizeof(float));
+    tinyexr::WriteAttributeToMemory(&header, "screenWindowCenter", "v2f",
+                                    reinterpret_cast<const unsigned char *>(center), sizeof(center));
+    tinyexr::swap4(&window_width);
+    tinyexr::WriteAttributeToMemory(&header, "screenWindowWidth", "float",
+                                    reinterpret_cast<const unsigned char *>(&window_width), sizeof(float));
+    header.push_back(0);
+    ofs.write((const char *)header.data(), header.size());
+
+    // The offset table comes first but is only known once the blocks are written.
+    int num_blocks = (image.height + c_exr_block_lines - 1) / c_exr_block_lines;
+    std::streampos table_pos = ofs.tellp();
+    vector<tinyexr::tinyexr_uint64> offsets(num_blocks);
+    ofs.write((const char *)offsets.data(), offsets.size() * sizeof(offsets[0]));
+    vector<vector<unsigned char>> blocks(c_write_batch_blocks);
+    for (int b0 = 0; b0 < num_blocks; b0 += c_write_batch_blocks) {
+        int n = std::min(c_write_batch_blocks, num_blocks - b0);
+        parallel_for([&](int64_t i) {
+            blocks[i] = encode_exr_block(image, int(b0 + i) * c_exr_block_lines);
+        }, n);
+        for (int i = 0; i < n; i++) {
+            offsets[b0 + i] = tinyexr::tinyexr_uint64(ofs.tellp());
+            tinyexr::swap8(&offsets[b0 + i]);
+            ofs.write((const char *)blocks[i].data(), blocks[i].size());
+        }
+    }
+    ofs.seekp(table_pos);
+    ofs.write((const char *)offsets.data(), offsets.size() * sizeof(offsets[0]));
+}
+
+/// PFM, rows in memory order like before. A float image is written as it is; a
+/// double one is converted a batch of scanlines at a time, in parallel.
+template <typename T>
+void write_pfm(std::ofstream &ofs, const Image<TVector3<T>> &image) {
+    ofs << "PF" << std::endl;
+    ofs << image.width << " " << image.height << std::endl;
+    ofs << "-1" << std::endl;
+    if constexpr (std::is_same_v<T, float>) {
+        ofs.write((const char *)image.data.data(), image.data.size() * sizeof(Vector3f));
+    } else {
+        vector<Vector3f> lines(size_t(std::min(c_write_batch_lines, image.height)) * image.width);
+        for (int y0 = 0; y0 < image.height; y0 += c_write_batch_lines) {
+            int n = std::min(c_write_batch_lines, image.height - y0);
+            parallel_for([&](int64_t l) {
+                const TVector3<T> *row = &image(0, y0 + int(l));
+                std::transform(row, row + image.width, &lines[l * image.width],
+                    [] (const TVector3<T> &v) {return Vector3f(v);});
+            }, n);
+            ofs.write((const char *)lines.data(), size_t(n) * image.width * sizeof(Vector3f));
+        }
+    }
+}
+
+template <typename T>
+void write_image(const fs::path &filename, const Image<TVector3<T>> &image) {
     if (image.data.empty()) {
         return;
     }
+    bool pfm = ends_with(filename.string(), ".pfm");
+    if (!pfm && !ends_with(filename.string(), ".exr")) {
+        return;
+    }
+    std::ofstream ofs(filename, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) {
+        Error(std::string("Unable to write ") + filename.string());
+    }
+    if (pfm) {
+        write_pfm(ofs, image);
+    } else {
+        write_exr(ofs, image);
+    }
+    ofs.close();
+    if (!ofs.good()) {
+        Error(std::string("Failure when writing image: ") + filename.string());
+    }
+}
 
-#ifdef _WINDOWS
-    if (ends_with(filename.string(), ".pfm")) {
-#else
-    if (ends_with(filename, ".pfm")) {
-#endif
-        std::ofstream ofs(filename.c_str(), std::ios::binary);
-        ofs << "PF" << std::endl;
-        ofs << image.width << " " << image.height << std::endl;
-        ofs << "-1" << std::endl;
-        // Convert image to float
-        vector<Vector3f> data(image.data.size());
-        std::transform(image.data.cbegin(), image.data.cend(), data.begin(),
-            [] (const Vector3 &v) {return Vector3f(v.x, v.y, v.z);});
-        ofs.write((const char *)data.data(), data.size() * sizeof(Vector3f));
-#ifdef _WINDOWS
-    } else if (ends_with(filename.string(), ".exr")) {
-#else
-    } else if (ends_with(filename, ".exr")) {
-#endif
-        // Convert image to float
-        vector<Vector3f> data(image.data.size());
-        std::transform(image.data.cbegin(), image.data.cend(), data.begin(),
-            [] (const Vector3 &v) {return Vector3f(v.x, v.y, v.z);});
-        const char* err = nullptr;
-#ifdef _WINDOWS
-        int ret = SaveEXR((float*)data.data(),
-            image.width, image.height, 3, 1 /* write as fp16 */, filename.string().c_str(), &err);
-#else
-        int ret = SaveEXR((float*)data.data(),
-            image.width, image.height, 3, 1 /* write as fp16 */, filename.c_str(), &err);
-#endif
-        if (ret != TINYEXR_SUCCESS) {
+} // namespace
+
+void imwrite(const fs::path &filename, const Image3 &image) {
+    write_image(filename, image);
+}
+
+void imwrite(const fs::path &filename, const Image3f &image) {
+    write_image(filename, image);
+}
+
+void imwrite_layers(const fs::path &filename, const std::vector<ImageLayer> &layers) {
+    if (layers.empty()) {
+        Error("imwrite_layers: no layers to write.");
+    }
+    auto layer_size = [](const ImageLayer &layer) {
+        return std::visit([](const auto &img) { return std::make_pair(img.width, img.height); },
+                          layer.image);
+    };
+    auto [width, height] = layer_size(layers[0]);
+    size_t num_pixels = size_t(width) * height;
+    // tinyexr takes planar channels: colors are split, B G R as viewers expect.
+    vector<vector<vector<float>>> channels(layers.size());
+    vector<vector<float *>> channel_pointers(layers.size());
+    vector<vector<EXRChannelInfo>> channel_infos(layers.size());
+    vector<vector<int>> pixel_types(layers.size());
+    vector<EXRHeader> headers(layers.size());
+    vector<const EXRHeader *> header_pointers(layers.size());
+    vector<EXRImage> images(layers.size());
+    for (size_t l = 0; l < layers.size(); l++) {
+        const ImageLayer &layer = layers[l];
+        if (layer_size(layer) != std::make_pair(width, height)) {
+            Error("imwrite_layers: layer " + layer.name + " differs in size from the others.");
+        }
+        vector<const char *> names;
+        if (const Image3f *rgb = std::get_if<Image3f>(&layer.image)) {
+            names = {"B", "G", "R"};
+            channels[l].assign(3, vector<float>(num_pixels));
+            for (size_t i = 0; i < num_pixels; i++) {
+                for (int c = 0; c < 3; c++) {
+                    channels[l][2 - c][i] = rgb->data[i][c];
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                channel_pointers[l].push_back(channels[l][c].data());
+            }
+        } else {
+            // already planar
+            names = {"Y"};
+            channel_pointers[l].push_back(
+                const_cast<float *>(std::get<Image1f>(layer.image).data.data()));
+        }
+        int num_channels = int(names.size());
+        channel_infos[l].resize(num_channels);
+        for (int c = 0; c < num_channels; c++) {
+            EXRChannelInfo &info = channel_infos[l][c];
+            memset(&info, 0, sizeof(info));
+            strncpy(info.name, names[c], 255);
+        }
+        pixel_types[l].assign(num_channels, TINYEXR_PIXELTYPE_FLOAT);
+
+        EXRHeader &header = headers[l];
+        InitEXRHeader(&header);
+        header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+        header.num_channels = num_channels;
+        header.channels = channel_infos[l].data();
+        header.pixel_types = pixel_types[l].data();
+        header.requested_pixel_types = pixel_types[l].data();
+        EXRSetNameAttr(&header, layer.name.c_str());
+        header_pointers[l] = &header;
+
+        EXRImage &image = images[l];
+        InitEXRImage(&image);
+        image.num_channels = num_channels;
+        image.images = reinterpret_cast<unsigned char **>(channel_pointers[l].data());
+        image.width = width;
+        image.height = height;
+    }
+    const char* err = nullptr;
+    int ret = layers.size() == 1 ?
+        SaveEXRImageToFile(&images[0], &headers[0], filename.string().c_str(), &err) :
+        SaveEXRMultipartImageToFile(images.data(), header_pointers.data(),
+                                    (unsigned int)layers.size(), filename.string().c_str(), &err);
+    if (ret != TINYEXR_SUCCESS) {
+        if (err) {
             std::cerr << "OpenEXR error: " << err << std::endl;
             FreeEXRErrorMessage(err);
-            Error(std::string("Failure when writing image: ") + filename.string());
         }
+        Error(std::string("Failure when writing image: ") + filename.string());
+    }
+}
+
+ImageDiff image_diff(const Image3 &image, const Image3 &reference) {
+    if (image.width != reference.width || image.height != reference.height) {
+        Error("image_diff: image sizes differ.");
+    }
+    ImageDiff diff{0, 0, 0, 0, reference.data.size()};
+    Real squared_error = 0;
+    Real peak = 0;
+    for (size_t i = 0; i < reference.data.size(); i++) {
+        bool differs = false;
+        for (int c = 0; c < 3; c++) {
+            Real d = image.data[i][c] - reference.data[i][c];
+            squared_error += d * d;
+            diff.max_abs_error = std::max(diff.max_abs_error, std::abs(d));
+            peak = std::max(peak, reference.data[i][c]);
+            differs |= d != 0;
+        }
+        diff.differing_pixels += differs;
+    }
+    Real mse = diff.num_pixels > 0 ? squared_error / (3 * diff.num_pixels) : 0;
+    diff.rmse = std::sqrt(mse);
+    diff.psnr = mse > 0 ? 10 * std::log10(peak * peak / mse) : infinity<Real>();
+    return diff;
+}
+
+void print_image_diff(const std::vector<std::string> &params) {
+    if (params.size() < 2) {
+        Error("Usage: -hw imgdiff <image> <reference image>");
     }
+    ImageDiff diff = image_diff(imread3(params[0]), imread3(params[1]));
+    std::cout << params[0] << " vs. " << params[1] << ":" << std::endl;
+    std::cout << "  RMSE " << diff.rmse << ", max abs error " << diff.max_abs_error <<
+        ", PSNR " << diff.psnr << " dB, " << diff.differing_pixels << " / " <<
+        diff.num_pixels << " pixels differ" << std::endl;
 }
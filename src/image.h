@@ -4,6 +4,7 @@
 
 #include <string>
 #include <cstring>
+#include <variant>
 #include <vector>
 
 /// A N-channel image stored in a contiguous vector
@@ -35,13 +36,17 @@ struct Image {
         return data[y * width + x];
     }
 
-    int width;
-    int height;
+    int width = 0;
+    int height = 0;
     std::vector<T> data;
 };
 
 using Image1 = Image<Real>;
 using Image3 = Image<Vector3>;
+// Single precision, for rendered images: half the memory, and written without
+// conversion.
+using Image1f = Image<float>;
+using Image3f = Image<Vector3f>;
 
 /// Read from an 1 channel image. If the image is not actually
 /// single channel, the first channel is used.
@@ -55,5 +60,33 @@ Image1 imread1(const fs::path &filename);
 Image3 imread3(const fs::path &filename);
 
 /// Save an image to a file.
-/// Supported formats: PFM & exr
+/// Supported formats: PFM & exr (fp16, ZIP)
+/// The image is converted and compressed a batch of scanlines at a time, in
+/// parallel, with no full-size copy.
 void imwrite(const fs::path &filename, const Image3 &image);
+void imwrite(const fs::path &filename, const Image3f &image);
+
+/// One part of a multi-part EXR file: a named image of 1 or 3 channels.
+struct ImageLayer {
+    std::string name;
+    std::variant<Image1f, Image3f> image;
+};
+
+/// Save images of the same size to one EXR file, each as a part named after its
+/// layer, in 32-bit float (AOVs such as depth or ids do not survive fp16).
+/// 3-channel parts have channels R, G and B, 1-channel parts Y.
+void imwrite_layers(const fs::path &filename, const std::vector<ImageLayer> &layers);
+
+/// Error statistics of an image against a reference of the same size.
+struct ImageDiff {
+    Real rmse;
+    Real max_abs_error;
+    Real psnr;  // peak is the largest reference value; infinite if the images match
+    uint64_t differing_pixels;
+    uint64_t num_pixels;
+};
+
+ImageDiff image_diff(const Image3 &image, const Image3 &reference);
+
+/// Command line entry: "-hw imgdiff <image> <reference image>" prints the ImageDiff.
+void print_image_diff(const std::vector<std::string> &params);
@@ -3,7 +3,14 @@
 #include "hw3.h"
 #include "hw4.h"
 #include "image.h"
+#include "mesh_cache.h"
+#include "numa.h"
 #include "parallel.h"
+#include "partial_render.h"
+#include "progressreporter.h"
+#include "render.h"
+#include "render_server.h"
+#include "scene_snapshot.h"
 #include <vector>
 #include <string>
 #include <thread>
@@ -12,17 +19,52 @@ int main(int argc, char *argv[]) {
     std::vector<std::string> parameters;
     std::string hw_num;
     int num_threads = std::thread::hardware_concurrency();
+    NumaPlacement numa = NumaPlacement::None;
+    int numa_fake_nodes = 0;
+    ProgressFormat progress_format = ProgressFormat::Text;
+    Real progress_interval = 0.5;
     for (int i = 1; i < argc; ++i) {
         if (std::string(argv[i]) == "-t") {
             num_threads = std::stoi(std::string(argv[++i]));
         } else if (std::string(argv[i]) == "-hw") {
             hw_num = std::string(argv[++i]);
+        } else if (std::string(argv[i]) == "-mesh_cache") {
+            set_mesh_cache_enabled(true);
+        } else if (std::string(argv[i]) == "-numa") {
+            std::string placement = std::string(argv[++i]);
+            if (placement == "replicate") {
+                numa = NumaPlacement::Replicate;
+            } else if (placement == "interleave") {
+                numa = NumaPlacement::Interleave;
+            } else {
+                Error("Unknown -numa placement " + placement + " (replicate or interleave).");
+            }
+        } else if (std::string(argv[i]) == "-progress") {
+            std::string format = std::string(argv[++i]);
+            if (format == "text") {
+                progress_format = ProgressFormat::Text;
+            } else if (format == "json") {
+                progress_format = ProgressFormat::Json;
+            } else if (format == "none") {
+                progress_format = ProgressFormat::None;
+            } else {
+                Error("Unknown -progress format " + format + " (text, json or none).");
+            }
+        } else if (std::string(argv[i]) == "-progress_interval") {
+            progress_interval = std::stod(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-numa_fake") {
+            numa_fake_nodes = std::stoi(std::string(argv[++i]));
         } else {
             parameters.push_back(std::string(argv[i]));
         }
     }
 
-    parallel_init(num_threads);
+    set_progress_format(progress_format, progress_interval);
+    if (numa != NumaPlacement::None) {
+        numa_init(numa, numa_fake_nodes > 0 ?
+            fake_numa_topology(numa_fake_nodes) : detect_numa_topology());
+    }
+    parallel_init(num_threads, numa_pin_thread);
 
     if (hw_num == "1_1") {
         Image3 img = hw_1_1(parameters);
@@ -82,17 +124,29 @@ int main(int argc, char *argv[]) {
         Image3 img = hw_3_4(parameters);
         imwrite("hw_3_4.exr", img);
     } else if (hw_num == "4_1") {
-        Image3 img = hw_4_1(parameters);
+        Image3f img = hw_4_1(parameters);
         imwrite("hw_4_1.exr", img);
     } else if (hw_num == "4_2") {
-        Image3 img = hw_4_2(parameters);
+        Image3f img = hw_4_2(parameters);
         imwrite("hw_4_2.exr", img);
     } else if (hw_num == "4_3") {
-        Image3 img = hw_4_3(parameters);
+        Image3f img = hw_4_3(parameters);
         imwrite("hw_4_3.exr", img);
     } else if (hw_num == "4_4") {
-        Image3 img = hw_4_4(parameters);
+        Image3f img = hw_4_4(parameters);
         imwrite("hw_4_4.exr", img);
+    } else if (hw_num == "snapshot") {
+        make_scene_snapshot(parameters);
+    } else if (hw_num == "imgdiff") {
+        print_image_diff(parameters);
+    } else if (hw_num == "merge") {
+        merge_partial_render_files(parameters);
+    } else if (hw_num == "serve") {
+        serve_renders(parameters);
+    } else if (hw_num == "batch") {
+        render_batch(parameters);
+    } else if (hw_num == "interactive") {
+        render_interactive(parameters);
     }
 
     parallel_cleanup();
@@ -17,7 +17,7 @@ struct ImageTexture {
     Real uoffset = 0, voffset = 0;
 
     ImageTexture(const ParsedImageTexture& pImgTex) :
-        img3(imread3(pImgTex.filename)), 
+        img3(pImgTex.image ? *pImgTex.image : imread3(pImgTex.filename)),
         uscale(pImgTex.uscale), vscale(pImgTex.vscale),
         uoffset(pImgTex.uoffset), voffset(pImgTex.voffset) 
         {}
@@ -280,4 +280,10 @@ using Material = std::variant<Diffuse,
                                     BlinnPhong,
                                     Microfacet>;
 
+/// The reflectance of a material at a hit, e.g. the first-hit albedo of the denoiser.
+inline Vector3 material_albedo(const Material &material, const Hit_Record &rec) {
+    return std::visit([&](const auto &m) { return eval_RGB(m.reflectance, rec.u, rec.v); },
+                      material);
+}
+
 
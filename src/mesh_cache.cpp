@@ -0,0 +1,230 @@
+#include "mesh_cache.h"
+#include "flexception.h"
+#include "mmap_file.h"
+#include "parallel.h"
+#include "transform.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+namespace {
+
+const char c_tmesh_magic[4] = {'T', 'M', 'S', 'H'};
+// Bump this whenever the layout below changes; old caches are then rebuilt.
+const uint32_t c_tmesh_version = 1;
+const uint64_t c_tmesh_alignment = 64;
+// Number of vertices transformed by one parallel task.
+const int64_t c_tmesh_block_size = 16384;
+
+struct TMeshHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t real_size;
+    uint32_t reserved;
+    uint64_t num_positions;
+    uint64_t num_indices;
+    uint64_t num_normals;
+    uint64_t num_uvs;
+    uint64_t positions_offset;
+    uint64_t indices_offset;
+    uint64_t normals_offset;
+    uint64_t uvs_offset;
+};
+
+static_assert(std::is_trivially_copyable_v<TMeshHeader>);
+static_assert(sizeof(Vector3) == 3 * sizeof(Real));
+static_assert(sizeof(Vector2) == 2 * sizeof(Real));
+static_assert(sizeof(Vector3i) == 3 * sizeof(int32_t));
+
+bool is_little_endian() {
+    const uint32_t one = 1;
+    char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+uint64_t align_up(uint64_t offset) {
+    return (offset + c_tmesh_alignment - 1) / c_tmesh_alignment * c_tmesh_alignment;
+}
+
+bool enabled = false;
+
+} // namespace
+
+void set_mesh_cache_enabled(bool e) {
+    enabled = e;
+}
+
+bool mesh_cache_enabled() {
+    return enabled;
+}
+
+void write_tmesh(const fs::path &filename, const ParsedTriangleMesh &mesh) {
+    if (!is_little_endian()) {
+        Error("write_tmesh: .tmesh files are little-endian only.");
+    }
+    TMeshHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, c_tmesh_magic, sizeof(c_tmesh_magic));
+    header.version = c_tmesh_version;
+    header.real_size = sizeof(Real);
+    header.num_positions = mesh.positions.size();
+    header.num_indices = mesh.indices.size();
+    header.num_normals = mesh.normals.size();
+    header.num_uvs = mesh.uvs.size();
+    header.positions_offset = align_up(sizeof(TMeshHeader));
+    header.indices_offset =
+        align_up(header.positions_offset + header.num_positions * sizeof(Vector3));
+    header.normals_offset =
+        align_up(header.indices_offset + header.num_indices * sizeof(Vector3i));
+    header.uvs_offset =
+        align_up(header.normals_offset + header.num_normals * sizeof(Vector3));
+
+    fs::path tmp_filename = filename;
+    tmp_filename += ".tmp";
+    {
+        std::ofstream ofs(tmp_filename, std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open()) {
+            Error(std::string("Unable to write ") + tmp_filename.string());
+        }
+        uint64_t written = 0;
+        auto write_at = [&](uint64_t offset, const void *data, uint64_t size) {
+            static const char zeros[c_tmesh_alignment] = {};
+            assert(offset >= written && offset - written < c_tmesh_alignment);
+            ofs.write(zeros, offset - written);
+            ofs.write((const char *)data, size);
+            written = offset + size;
+        };
+        write_at(0, &header, sizeof(header));
+        write_at(header.positions_offset,
+                 mesh.positions.data(), header.num_positions * sizeof(Vector3));
+        write_at(header.indices_offset,
+                 mesh.indices.data(), header.num_indices * sizeof(Vector3i));
+        write_at(header.normals_offset,
+                 mesh.normals.data(), header.num_normals * sizeof(Vector3));
+        write_at(header.uvs_offset,
+                 mesh.uvs.data(), header.num_uvs * sizeof(Vector2));
+        if (!ofs.good()) {
+            Error(std::string("Failed writing ") + tmp_filename.string());
+        }
+    }
+    fs::rename(tmp_filename, filename);
+}
+
+ParsedTriangleMesh parse_tmesh(const fs::path &filename, const Matrix4x4 &to_world) {
+    if (!is_little_endian()) {
+        Error("parse_tmesh: .tmesh files are little-endian only.");
+    }
+    MappedFile file(filename);
+    if (file.size() < sizeof(TMeshHeader)) {
+        Error(std::string("parse_tmesh: truncated file ") + filename.string());
+    }
+    TMeshHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, c_tmesh_magic, sizeof(c_tmesh_magic)) != 0) {
+        Error(std::string("parse_tmesh: not a .tmesh file ") + filename.string());
+    }
+    if (header.version != c_tmesh_version || header.real_size != sizeof(Real)) {
+        Error(std::string("parse_tmesh: incompatible .tmesh file ") + filename.string());
+    }
+    auto check_range = [&](uint64_t offset, uint64_t count, uint64_t elem_size) {
+        if (offset % c_tmesh_alignment != 0 ||
+                offset > file.size() || count > (file.size() - offset) / elem_size) {
+            Error(std::string("parse_tmesh: corrupted file ") + filename.string());
+        }
+    };
+    check_range(header.positions_offset, header.num_positions, sizeof(Vector3));
+    check_range(header.indices_offset, header.num_indices, sizeof(Vector3i));
+    check_range(header.normals_offset, header.num_normals, sizeof(Vector3));
+    check_range(header.uvs_offset, header.num_uvs, sizeof(Vector2));
+
+    ParsedTriangleMesh mesh;
+    mesh.positions.resize(header.num_positions);
+    mesh.indices.resize(header.num_indices);
+    mesh.normals.resize(header.num_normals);
+    mesh.uvs.resize(header.num_uvs);
+
+    // Indices and uvs do not depend on the transformation: copy the pages as they are.
+    if (header.num_indices > 0) {
+        std::memcpy(mesh.indices.data(), file.data() + header.indices_offset,
+                    header.num_indices * sizeof(Vector3i));
+    }
+    // Every index has to hit a position, and a normal and uv as far as there are any:
+    // a bad cache fails here (and load_mesh_cached reparses the source) instead of
+    // sending the Triangle constructor out of bounds.
+    for (const Vector3i &face : mesh.indices) {
+        for (int k = 0; k < 3; k++) {
+            uint64_t index = uint64_t(uint32_t(face[k]));
+            if (face[k] < 0 || index >= header.num_positions ||
+                    (header.num_normals > 0 && index >= header.num_normals) ||
+                    (header.num_uvs > 0 && index >= header.num_uvs)) {
+                Error(std::string("parse_tmesh: out of range vertex index in ") +
+                      filename.string());
+            }
+        }
+    }
+    if (header.num_uvs > 0) {
+        std::memcpy(mesh.uvs.data(), file.data() + header.uvs_offset,
+                    header.num_uvs * sizeof(Vector2));
+    }
+
+    // Positions and normals are transformed in one pass straight out of the mapping.
+    const Vector3 *src_positions = (const Vector3 *)(file.data() + header.positions_offset);
+    const Vector3 *src_normals = (const Vector3 *)(file.data() + header.normals_offset);
+    Matrix4x4 inv_to_world = inverse(to_world);
+    int64_t num_vertices = (int64_t)std::max(header.num_positions, header.num_normals);
+    int64_t num_blocks = (num_vertices + c_tmesh_block_size - 1) / c_tmesh_block_size;
+    parallel_for([&](int64_t block) {
+        int64_t begin = block * c_tmesh_block_size;
+        int64_t end = std::min(begin + c_tmesh_block_size, num_vertices);
+        for (int64_t i = begin; i < std::min(end, (int64_t)header.num_positions); i++) {
+            mesh.positions[i] = xform_point(to_world, src_positions[i]);
+        }
+        for (int64_t i = begin; i < std::min(end, (int64_t)header.num_normals); i++) {
+            mesh.normals[i] = xform_normal(inv_to_world, src_normals[i]);
+        }
+    }, num_blocks);
+    return mesh;
+}
+
+ParsedTriangleMesh load_mesh_cached(const fs::path &filename,
+                                    int shape_index,
+                                    const Matrix4x4 &to_world,
+                                    const std::function<ParsedTriangleMesh(const Matrix4x4 &)> &parse) {
+    if (!enabled || !is_little_endian()) {
+        return parse(to_world);
+    }
+    fs::path cache_filename = filename;
+    if (shape_index >= 0) {
+        cache_filename += "." + std::to_string(shape_index);
+    }
+    cache_filename += ".tmesh";
+
+    std::error_code ec;
+    if (fs::exists(cache_filename, ec) &&
+            fs::last_write_time(cache_filename, ec) >= fs::last_write_time(filename, ec)) {
+        try {
+            return parse_tmesh(cache_filename, to_world);
+        } catch (std::exception &e) {
+            std::cerr << "Ignoring mesh cache " << cache_filename.string() << ": " << e.what() << std::endl;
+        }
+    }
+
+    // Cache miss: parse the source in object space, write the cache, then place the mesh.
+    ParsedTriangleMesh mesh = parse(Matrix4x4::identity());
+    try {
+        write_tmesh(cache_filename, mesh);
+    } catch (std::exception &e) {
+        std::cerr << "Unable to write mesh cache " << cache_filename.string() << ": " << e.what() << std::endl;
+    }
+    Matrix4x4 inv_to_world = inverse(to_world);
+    for (auto &p : mesh.positions) {
+        p = xform_point(to_world, p);
+    }
+    for (auto &n : mesh.normals) {
+        n = xform_normal(inv_to_world, n);
+    }
+    return mesh;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "torrey.h"
+#include "matrix.h"
+#include "parse_scene.h"
+#include <filesystem>
+#include <functional>
+
+/// .tmesh is our binary triangle mesh cache. A small header is followed by
+/// the positions, indices, normals and uvs as flat little-endian arrays with the
+/// same layout as ParsedTriangleMesh, each starting on a 64-byte boundary.
+/// Geometry is stored in object space so that every instance of a mesh can share one file.
+
+/// Write an object space mesh to a .tmesh file.
+/// The file is written to a temporary path first and renamed, so readers never see a partial file.
+void write_tmesh(const fs::path &filename, const ParsedTriangleMesh &mesh);
+
+/// Map a .tmesh file and transform its content to world space.
+ParsedTriangleMesh parse_tmesh(const fs::path &filename, const Matrix4x4 &to_world);
+
+/// Converter mode: when enabled, the first load of an obj/ply/serialized file
+/// writes a .tmesh next to it and later loads read the cache instead.
+void set_mesh_cache_enabled(bool enabled);
+bool mesh_cache_enabled();
+
+/// Load a mesh through the .tmesh cache. "parse" is the regular loader of the source file.
+/// shape_index selects the cache file for formats with several meshes per file (-1 otherwise).
+ParsedTriangleMesh load_mesh_cached(const fs::path &filename,
+                                    int shape_index,
+                                    const Matrix4x4 &to_world,
+                                    const std::function<ParsedTriangleMesh(const Matrix4x4 &)> &parse);
@@ -0,0 +1,62 @@
+#include "mmap_file.h"
+#include "flexception.h"
+
+#ifdef _WINDOWS
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WINDOWS
+MappedFile::MappedFile(const fs::path &filename, MapMode mode) : mode(mode) {
+    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open()) {
+        Error(std::string("Unable to open ") + filename.string());
+    }
+    buffer.resize((size_t)ifs.tellg());
+    ifs.seekg(0, ifs.beg);
+    ifs.read(buffer.data(), buffer.size());
+    ptr = buffer.data();
+    length = buffer.size();
+}
+
+MappedFile::~MappedFile() {}
+#else
+MappedFile::MappedFile(const fs::path &filename, MapMode mode) : mode(mode) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Error(std::string("Unable to open ") + filename.string());
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        Error(std::string("Unable to stat ") + filename.string());
+    }
+    length = (size_t)st.st_size;
+    if (length > 0) {
+        void *addr = mode == MapMode::InPlace ?
+            mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) :
+            mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            Error(std::string("Unable to mmap ") + filename.string());
+        }
+        if (mode == MapMode::Sequential) {
+            // The loaders walk the file front to back.
+            madvise(addr, length, MADV_SEQUENTIAL);
+        }
+        ptr = (char *)addr;
+    }
+    // The mapping keeps its own reference to the file.
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (ptr != nullptr) {
+        munmap(ptr, length);
+    }
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "torrey.h"
+
+#include <cstddef>
+#include <vector>
+
+/// How a MappedFile is going to be used.
+enum class MapMode {
+    /// Read-only, walked front to back by a loader.
+    Sequential,
+    /// Used in place with random access. The mapping is private: its pages stay shared
+    /// with the page cache until written to, and writes never reach the file.
+    InPlace
+};
+
+/// A memory mapping of a whole file.
+/// The mapping stays valid for the lifetime of the object, so callers can
+/// keep raw pointers into data() as long as they also keep the MappedFile around.
+/// On platforms without mmap we fall back to reading the file into memory.
+class MappedFile {
+public:
+    MappedFile(const fs::path &filename, MapMode mode = MapMode::Sequential);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const {
+        return ptr;
+    }
+    /// Only for MapMode::InPlace.
+    char *mutable_data() {
+        assert(mode == MapMode::InPlace);
+        return ptr;
+    }
+    size_t size() const {
+        return length;
+    }
+
+private:
+    char *ptr = nullptr;
+    size_t length = 0;
+    MapMode mode;
+#ifdef _WINDOWS
+    std::vector<char> buffer;
+#endif
+};
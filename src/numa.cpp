@@ -0,0 +1,291 @@
+#include "numa.h"
+#include "flexception.h"
+#include "parallel.h"
+#include "timer.h"
+
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// From linux/mempolicy.h; the syscall is used directly so that libnuma is not needed.
+constexpr int mpol_default = 0;
+constexpr int mpol_interleave = 3;
+
+NumaPlacement placement = NumaPlacement::None;
+NumaTopology topology;
+
+/// Parse a kernel cpu list such as "0-3,8-11".
+std::vector<int> parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> read_cpu_list(const std::string &filename) {
+    std::ifstream file(filename);
+    std::string list;
+    if (!file || !std::getline(file, list)) {
+        return {};
+    }
+    return parse_cpu_list(list);
+}
+
+std::vector<int> online_cpus() {
+    std::vector<int> cpus = read_cpu_list("/sys/devices/system/cpu/online");
+    if (cpus.empty()) {
+        int n = std::max(int(std::thread::hardware_concurrency()), 1);
+        for (int cpu = 0; cpu < n; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/// Copy the BVH rooted at node, pointing its leaves into scene->shapes instead of
+/// into shapes_of_node. Subtrees shared within the BVH stay shared in the copy.
+/// Flattened subtrees get a copy of their nodes; out-of-core pages stay shared.
+std::shared_ptr<BVH_node> clone_bvh(
+        const std::shared_ptr<BVH_node> &node,
+        const SceneArray<Shape> &shapes_of_node,
+        Scene &scene,
+        std::unordered_map<const BVH_node *, std::shared_ptr<BVH_node>> &memo) {
+    if (!node) {
+        return nullptr;
+    }
+    auto it = memo.find(node.get());
+    if (it != memo.end()) {
+        return it->second;
+    }
+    std::shared_ptr<BVH_node> copy = make_bvh_node(*node);
+    copy->left = clone_bvh(node->left, shapes_of_node, scene, memo);
+    copy->right = clone_bvh(node->right, shapes_of_node, scene, memo);
+    if (node->flat) {
+        auto flat = std::make_shared<FlatBVH>();
+        flat->owned_nodes.assign(node->flat->nodes, node->flat->nodes + node->flat->num_nodes);
+        flat->nodes = flat->owned_nodes.data();
+        flat->num_nodes = flat->owned_nodes.size();
+        flat->shapes = node->flat->shapes;
+        if (flat->shapes >= shapes_of_node.begin() && flat->shapes <= shapes_of_node.end()) {
+            flat->shapes = scene.shapes.data() + (node->flat->shapes - shapes_of_node.data());
+        }
+        copy->flat = flat;
+    }
+    if (node->leafObj) {
+        const Shape *shape = node->leafObj.get();
+        if (!shapes_of_node.empty() && shape >= shapes_of_node.data() &&
+                shape < shapes_of_node.data() + shapes_of_node.size()) {
+            // non-owning, like the leaves built from scene.shapes
+            copy->leafObj = std::shared_ptr<Shape>(
+                std::shared_ptr<Shape>(), &scene.shapes[shape - shapes_of_node.data()]);
+        } else {
+            copy->leafObj = std::make_shared<Shape>(*shape);
+        }
+    }
+    memo[node.get()] = copy;
+    return copy;
+}
+
+} // namespace
+
+NumaTopology detect_numa_topology() {
+    NumaTopology result;
+    // Node numbers can have gaps, so probe a generous range.
+    for (int node = 0; node < 1024; node++) {
+        std::string dir = "/sys/devices/system/node/node" + std::to_string(node);
+        std::vector<int> cpus = read_cpu_list(dir + "/cpulist");
+        if (!cpus.empty()) {
+            result.node_ids.push_back(node);
+            result.node_cpus.push_back(cpus);
+        }
+    }
+    if (result.node_cpus.empty()) {
+        result.node_ids.push_back(0);
+        result.node_cpus.push_back(online_cpus());
+    }
+    return result;
+}
+
+NumaTopology fake_numa_topology(int num_nodes) {
+    if (num_nodes < 1) {
+        Error("The fake NUMA topology needs at least one node.");
+    }
+    std::vector<int> cpus = online_cpus();
+    NumaTopology result;
+    result.fake = true;
+    for (int node = 0; node < num_nodes; node++) {
+        result.node_ids.push_back(node);
+        std::vector<int> node_cpus;
+        size_t first = cpus.size() * node / num_nodes;
+        size_t last = cpus.size() * (node + 1) / num_nodes;
+        for (size_t i = first; i < last; i++) {
+            node_cpus.push_back(cpus[i]);
+        }
+        if (node_cpus.empty()) {
+            // more nodes than cpus: the nodes share cpus
+            node_cpus.push_back(cpus[node % cpus.size()]);
+        }
+        result.node_cpus.push_back(node_cpus);
+    }
+    return result;
+}
+
+void numa_init(NumaPlacement numa_placement, const NumaTopology &numa_topology) {
+    placement = numa_placement;
+    topology = numa_topology;
+    if (placement == NumaPlacement::None) {
+        return;
+    }
+    std::cout << "NUMA: " << topology.num_nodes() << (topology.fake ? " fake" : "") <<
+        " node(s), scene " <<
+        (placement == NumaPlacement::Replicate ? "replicated per node" : "interleaved") <<
+        "." << std::endl;
+    for (int i = 0; i < topology.num_nodes(); i++) {
+        std::cout << "  node " << topology.node_ids[i] << ": " <<
+            topology.node_cpus[i].size() << " cpu(s)" << std::endl;
+    }
+}
+
+NumaPlacement numa_placement() {
+    return placement;
+}
+
+int numa_thread_node(int thread_index) {
+    if (placement == NumaPlacement::None || topology.num_nodes() == 0) {
+        return 0;
+    }
+    return thread_index % topology.num_nodes();
+}
+
+void numa_pin_thread(int thread_index) {
+    if (placement == NumaPlacement::None || topology.num_nodes() == 0) {
+        return;
+    }
+#ifdef __linux__
+    const std::vector<int> &cpus = topology.node_cpus[numa_thread_node(thread_index)];
+    int cpu = cpus[(thread_index / topology.num_nodes()) % cpus.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        std::cerr << "Warning: could not pin thread " << thread_index <<
+            " to cpu " << cpu << "." << std::endl;
+    }
+#endif
+}
+
+NumaInterleaveScope::NumaInterleaveScope() {
+    if (placement != NumaPlacement::Interleave || topology.fake ||
+            topology.num_nodes() < 2) {
+        return;
+    }
+#ifdef __linux__
+    int max_node = 0;
+    for (int node : topology.node_ids) {
+        max_node = std::max(max_node, node);
+    }
+    const int bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(max_node / bits + 1, 0);
+    for (int node : topology.node_ids) {
+        mask[node / bits] |= 1UL << (node % bits);
+    }
+    // The scene is loaded by the pool threads as well, and a memory policy belongs
+    // to a single thread: set it on all of them.
+    std::atomic<bool> failed{false};
+    parallel_for_each_thread([&](int) {
+        if (syscall(SYS_set_mempolicy, mpol_interleave, mask.data(),
+                    (unsigned long)(max_node + 2)) != 0) {
+            failed = true;
+        }
+    });
+    active = true;
+    if (failed) {
+        std::cerr << "Warning: could not interleave the scene memory." << std::endl;
+    }
+#endif
+}
+
+NumaInterleaveScope::~NumaInterleaveScope() {
+#ifdef __linux__
+    if (active) {
+        parallel_for_each_thread([](int) {
+            syscall(SYS_set_mempolicy, mpol_default, nullptr, 0UL);
+        });
+    }
+#endif
+}
+
+std::vector<RenderScene> replicate_render_scene(const RenderScene &render_scene) {
+    std::vector<RenderScene> replicas;
+    if (placement != NumaPlacement::Replicate || topology.num_nodes() < 2) {
+        return replicas;
+    }
+    Timer timer;
+    tick(timer);
+    replicas.resize(topology.num_nodes() - 1);
+    std::vector<std::exception_ptr> errors(replicas.size());
+    std::vector<std::thread> builders;
+    for (int node = 1; node < topology.num_nodes(); node++) {
+        // The copy is made by a thread running on the node, so that its pages are
+        // first touched (and therefore allocated) there.
+        builders.emplace_back([&, node] {
+            try {
+                // Thread index node lands on node node, see numa_thread_node.
+                numa_pin_thread(node);
+                RenderScene &replica = replicas[node - 1];
+                replica.scene = std::make_unique<Scene>(*render_scene.scene);
+                replica.pages = render_scene.pages;
+                std::unordered_map<const BVH_node *, std::shared_ptr<BVH_node>> memo;
+                BVHBuildPhase phase;
+                replica.bvh = clone_bvh(render_scene.bvh, render_scene.scene->shapes,
+                                        *replica.scene, memo);
+            } catch (...) {
+                errors[node - 1] = std::current_exception();
+            }
+        });
+    }
+    for (std::thread &builder : builders) {
+        builder.join();
+    }
+    for (const std::exception_ptr &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    std::cout << "Scene replicated to " << replicas.size() << " more NUMA node(s). Took " <<
+        tick(timer) << " seconds." << std::endl;
+    return replicas;
+}
+
+const RenderScene &local_render_scene(const RenderScene &render_scene,
+                                      const std::vector<RenderScene> &replicas) {
+    int node = numa_thread_node(ThreadIndex);
+    if (node == 0 || node > (int)replicas.size()) {
+        return render_scene;
+    }
+    return replicas[node - 1];
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "scene_snapshot.h"
+
+#include <vector>
+
+/// Optional NUMA mode for multi-socket machines (Linux only; a no-op elsewhere).
+/// Render threads are pinned to cpus, dealt out over the nodes round-robin, and the
+/// read-only scene is either
+///   - replicated: every node renders from its own copy of the Scene and BVH, or
+///   - interleaved: the pages of the Scene and BVH are spread over all nodes.
+/// Per-thread buffers are allocated by the pinned threads themselves, so the kernel's
+/// first-touch policy places them on the thread's node.
+enum class NumaPlacement {
+    None,
+    Replicate,
+    Interleave
+};
+
+struct NumaTopology {
+    std::vector<int> node_ids;  // as numbered by the kernel
+    std::vector<std::vector<int>> node_cpus;
+    // A fake topology partitions the cpus of one real node: threads are pinned and
+    // scenes replicated as usual, but no memory policy is applied.
+    bool fake = false;
+
+    int num_nodes() const {
+        return (int)node_cpus.size();
+    }
+};
+
+/// The nodes with cpus from /sys/devices/system/node, or one node with every
+/// online cpu if that is not available.
+NumaTopology detect_numa_topology();
+
+/// Split the online cpus into num_nodes consecutive groups, so that the NUMA code
+/// paths can be exercised on a single-socket machine.
+NumaTopology fake_numa_topology(int num_nodes);
+
+/// Select the NUMA mode. Call before parallel_init and pass numa_pin_thread to it.
+void numa_init(NumaPlacement placement, const NumaTopology &topology);
+NumaPlacement numa_placement();
+
+/// Thread setup hook for parallel_init: pin the calling thread to its cpu.
+void numa_pin_thread(int thread_index);
+/// The node thread_index runs on; 0 when the NUMA mode is off.
+int numa_thread_node(int thread_index);
+
+/// While alive, pages first touched by the calling thread or the pool threads are
+/// interleaved over all nodes (Interleave placement on a real topology only;
+/// otherwise this does nothing). Create it outside the pool's tasks.
+class NumaInterleaveScope {
+public:
+    NumaInterleaveScope();
+    ~NumaInterleaveScope();
+
+    NumaInterleaveScope(const NumaInterleaveScope &) = delete;
+    NumaInterleaveScope &operator=(const NumaInterleaveScope &) = delete;
+
+private:
+    bool active = false;
+};
+
+/// Replicate placement: deep copies of render_scene for nodes 1, 2, ... (node 0 keeps
+/// using render_scene). Each copy is made by a thread pinned to its node.
+/// Returns nothing for the other placements or a single node.
+std::vector<RenderScene> replicate_render_scene(const RenderScene &render_scene);
+
+/// The copy of the scene the calling render thread should use.
+const RenderScene &local_render_scene(const RenderScene &render_scene,
+                                      const std::vector<RenderScene> &replicas);
@@ -0,0 +1,345 @@
+#include "paged_bvh.h"
+#include "flexception.h"
+#include "helper.h"
+#include "parallel.h"
+#include "parse_scene.h"
+
+#include <cstring>
+#include <deque>
+#include <numeric>
+#include <type_traits>
+
+namespace {
+
+// Pages are copied to and from the page file as raw bytes.
+static_assert(std::is_trivially_copyable_v<FlatBVHNode>);
+static_assert(std::is_trivially_copyable_v<Shape>);
+
+const uint64_t c_page_alignment = 64;
+// Upper bound on the triangles in one page: small enough that a handful of pages
+// per thread fit any sensible budget, large enough to keep the top level shallow.
+const size_t c_page_triangles = 16384;
+// Number of pages every thread keeps pinned, direct-mapped by page id.
+const int c_thread_pins = 8;
+
+std::atomic<uint64_t> next_paged_geometry_id{0};
+
+/// The pages a thread traversed last and pinned, so that repeated visits skip the
+/// cache lock. The pointers stay valid while the pins hold.
+struct ThreadPins {
+    ThreadPins() {
+        std::fill(page_ids, page_ids + c_thread_pins, -1);
+    }
+
+    uint64_t owner = uint64_t(-1);
+    int page_ids[c_thread_pins];
+    void *pages[c_thread_pins] = {};
+};
+thread_local ThreadPins thread_pins;
+
+/// Copies of shapes hit in a page, see PagedGeometry::hit.
+/// A deque never moves its elements when growing.
+thread_local std::deque<Shape> thread_hit_shapes;
+
+uint64_t align_up(uint64_t offset) {
+    return (offset + c_page_alignment - 1) / c_page_alignment * c_page_alignment;
+}
+
+Vector3 face_centroid(const TriangleMesh &mesh, int face) {
+    Vector3i f = mesh.indices[face];
+    return (unpack_position(mesh.positions[f[0]]) + unpack_position(mesh.positions[f[1]]) +
+            unpack_position(mesh.positions[f[2]])) / Real(3);
+}
+
+/// Split faces[begin, end) at the centroid median of the widest axis until each part
+/// fits in a page, build the subtree of every part and write it to pages.
+/// Returns the resident nodes above the pages.
+std::shared_ptr<BVH_node> page_faces(TriangleMesh &mesh, int mesh_id,
+                                     std::vector<int> &faces, size_t begin, size_t end,
+                                     PagedGeometry &pages, pcg32_state &rng) {
+    if (end - begin > c_page_triangles) {
+        Vector3 lo = face_centroid(mesh, faces[begin]);
+        Vector3 hi = lo;
+        for (size_t i = begin + 1; i < end; i++) {
+            Vector3 c = face_centroid(mesh, faces[i]);
+            lo = min(lo, c);
+            hi = max(hi, c);
+        }
+        int axis = maxRangeIndex(hi - lo);
+        size_t mid = begin + (end - begin) / 2;
+        std::nth_element(faces.begin() + begin, faces.begin() + mid, faces.begin() + end,
+            [&](int a, int b) {
+                return face_centroid(mesh, a)[axis] < face_centroid(mesh, b)[axis];
+            });
+        std::shared_ptr<BVH_node> left = page_faces(mesh, mesh_id, faces, begin, mid, pages, rng);
+        std::shared_ptr<BVH_node> right = page_faces(mesh, mesh_id, faces, mid, end, pages, rng);
+        return make_bvh_node(left, right);
+    }
+
+    std::vector<Shape> shapes;
+    shapes.reserve(end - begin);
+    for (size_t i = begin; i < end; i++) {
+        shapes.push_back(Triangle(faces[i], &mesh, mesh_id));
+    }
+    std::vector<std::shared_ptr<Shape>> shape_ptrs;
+    for (Shape &shape : shapes) {
+        shape_ptrs.push_back(std::shared_ptr<Shape>(std::shared_ptr<Shape>(), &shape));
+    }
+    std::vector<FlatBVHNode> nodes;
+    AABB box;
+    {
+        // The subtree is only needed until it is flattened: its nodes go to an
+        // arena of their own that is released as a whole.
+        BVHBuildPhase phase;
+        BVH_node subtree(shape_ptrs, 0, shape_ptrs.size(), rng, false);
+        flatten_bvh(subtree, shapes.data(), shapes.size(), nodes);
+        box = subtree.box;
+    }
+    int page_id = pages.add_page(nodes, shapes);
+    return make_bvh_node(&pages, page_id, box);
+}
+
+} // namespace
+
+PagedGeometry::PagedGeometry(const fs::path &filename, size_t budget) :
+        filename(filename), budget(budget), id(next_paged_geometry_id++),
+        writer(filename, std::ios::binary | std::ios::trunc) {
+    if (!writer.is_open()) {
+        Error(std::string("Unable to write page file ") + filename.string());
+    }
+}
+
+PagedGeometry::~PagedGeometry() {
+    file.reset();
+    if (writer.is_open()) {
+        writer.close();
+    }
+    std::error_code ec;
+    fs::remove(filename, ec);
+}
+
+int PagedGeometry::add_page(const std::vector<FlatBVHNode> &nodes, const std::vector<Shape> &shapes) {
+    assert(writer.is_open());
+    static const char zeros[c_page_alignment] = {};
+    PageInfo info;
+    info.offset = align_up(written);
+    info.num_nodes = nodes.size();
+    info.num_shapes = shapes.size();
+    writer.write(zeros, info.offset - written);
+    writer.write((const char *)nodes.data(), nodes.size() * sizeof(FlatBVHNode));
+    writer.write((const char *)shapes.data(), shapes.size() * sizeof(Shape));
+    if (!writer.good()) {
+        Error(std::string("Failed writing page file ") + filename.string());
+    }
+    written = info.offset + nodes.size() * sizeof(FlatBVHNode) + shapes.size() * sizeof(Shape);
+    page_infos.push_back(info);
+    return (int)page_infos.size() - 1;
+}
+
+void PagedGeometry::finish_build() {
+    writer.close();
+    if (written > 0) {
+        file = std::make_unique<MappedFile>(filename);
+    }
+    cache.resize(page_infos.size());
+}
+
+std::unique_ptr<PagedGeometry::Page> PagedGeometry::load(int page_id) const {
+    const PageInfo &info = page_infos[page_id];
+    auto page = std::make_unique<Page>();
+    const char *data = file->data() + info.offset;
+    page->nodes.resize(info.num_nodes);
+    std::memcpy(page->nodes.data(), data, info.num_nodes * sizeof(FlatBVHNode));
+    data += info.num_nodes * sizeof(FlatBVHNode);
+    page->shapes.resize(info.num_shapes, Sphere{-1, -1, Vector3{0, 0, 0}, 0});
+    std::memcpy((void *)page->shapes.data(), data, info.num_shapes * sizeof(Shape));
+    page->bytes = info.num_nodes * sizeof(FlatBVHNode) + info.num_shapes * sizeof(Shape);
+    return page;
+}
+
+void PagedGeometry::pin(int page_id) {
+    CacheEntry &entry = cache[page_id];
+    if (entry.pins++ == 0) {
+        lru.erase(entry.lru_pos);
+    }
+}
+
+void PagedGeometry::unpin(int page_id) {
+    CacheEntry &entry = cache[page_id];
+    if (--entry.pins == 0) {
+        lru.push_front(page_id);
+        entry.lru_pos = lru.begin();
+    }
+}
+
+void PagedGeometry::evict() {
+    while (resident_bytes > budget && !lru.empty()) {
+        CacheEntry &victim = cache[lru.back()];
+        resident_bytes -= victim.page->bytes;
+        victim.page.reset();
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+PagedGeometry::Page &PagedGeometry::acquire(int page_id) {
+    lookups.fetch_add(1, std::memory_order_relaxed);
+    ThreadPins &pins = thread_pins;
+    if (pins.owner != id) {
+        // Left over from an earlier scene, whose render released its pins.
+        pins = ThreadPins();
+        pins.owner = id;
+    }
+    int slot = page_id % c_thread_pins;
+    if (pins.page_ids[slot] == page_id) {
+        return *static_cast<Page *>(pins.pages[slot]);
+    }
+
+    Page *page = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pins.page_ids[slot] >= 0) {
+            unpin(pins.page_ids[slot]);
+            pins.page_ids[slot] = -1;
+        }
+        CacheEntry &entry = cache[page_id];
+        if (entry.page) {
+            // resident, possibly pinned by other threads
+            pin(page_id);
+            page = entry.page.get();
+        }
+        evict();
+    }
+    if (!page) {
+        // Read outside of the lock so that other threads keep going.
+        std::unique_ptr<Page> loaded = load(page_id);
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes_paged_in += loaded->bytes;
+        CacheEntry &entry = cache[page_id];
+        if (entry.page) {
+            // Another thread paged it in meanwhile.
+            pin(page_id);
+        } else {
+            page_ins++;
+            entry.page = std::move(loaded);
+            entry.pins = 1;
+            resident_bytes += entry.page->bytes;
+            peak_resident_bytes = std::max(peak_resident_bytes, resident_bytes);
+            evict();
+        }
+        page = entry.page.get();
+    }
+    pins.page_ids[slot] = page_id;
+    pins.pages[slot] = page;
+    return *page;
+}
+
+void PagedGeometry::release_pins() {
+    parallel_for_each_thread([this](int) {
+        ThreadPins &pins = thread_pins;
+        if (pins.owner != id) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int &page_id : pins.page_ids) {
+            if (page_id >= 0) {
+                unpin(page_id);
+                page_id = -1;
+            }
+        }
+        evict();
+    });
+}
+
+bool PagedGeometry::hit(int page_id, const ray& r, Real t_min, Real t_max,
+                        Hit_Record& rec, Shape*& hitObj) {
+    Page &page = acquire(page_id);
+    Shape *prevObj = hitObj;
+    bool hit = hit_flat_bvh(page.nodes.data(), page.shapes.data(), 0,
+                            r, t_min, t_max, rec, hitObj);
+    if (hitObj != prevObj) {
+        thread_hit_shapes.push_back(*hitObj);
+        hitObj = &thread_hit_shapes.back();
+    }
+    return hit;
+}
+
+void PagedGeometry::release_hits() {
+    thread_hit_shapes.clear();
+}
+
+void PagedGeometry::print_stats(std::ostream &os) const {
+    const Real mb = 1024 * 1024;
+    uint64_t total_lookups = lookups.load();
+    os << "Out-of-core geometry: " << page_infos.size() << " pages, " <<
+        written / mb << " MB page file, " << budget / mb << " MB cache budget." << std::endl;
+    os << "  " << total_lookups << " page lookups, " << page_ins << " page-ins (" <<
+        bytes_paged_in / mb << " MB read), " << evictions << " evictions, hit rate " <<
+        (total_lookups > 0 ? Real(100) * (1 - Real(page_ins) / total_lookups) : Real(0)) <<
+        "%, peak resident " << peak_resident_bytes / mb << " MB (pinned pages included)." <<
+        std::endl;
+}
+
+RenderScene build_paged_render_scene(const fs::path &filename,
+                                     const fs::path &page_file,
+                                     size_t budget) {
+    Timer timer;
+    tick(timer);
+    ParsedScene parsed_scene = parse_scene(filename);
+    std::cout << "Scene parsing done. Took " << tick(timer) << " seconds." << std::endl;
+
+    RenderScene render_scene;
+    render_scene.scene = std::make_unique<Scene>(parsed_scene, true);
+    Scene &myScene = *render_scene.scene;
+    std::cout << "ParsedScene Copied to myScene. Took " <<
+            tick(timer) << " seconds." << std::endl;
+
+    // Spheres and emissive meshes: the usual per-mesh BVHs.
+    pcg32_state rng_BVH = init_pcg32();
+    std::vector<std::shared_ptr<Shape>> shape_ptrs;
+    for (size_t i = 0; i < myScene.shapes.size(); ++i) {
+        shape_ptrs.push_back(std::shared_ptr<Shape>(std::shared_ptr<Shape>(), &myScene.shapes[i]));
+    }
+    std::vector<std::shared_ptr<BVH_node>> meshBVH;
+    {
+        BVHBuildPhase phase;
+        meshBVH = build_mesh_bvhs(shape_ptrs, myScene, rng_BVH);
+    }
+
+    // Everything else goes to the page file, releasing each parsed mesh once it is written.
+    render_scene.pages = std::make_shared<PagedGeometry>(page_file, budget);
+    PagedGeometry &pages = *render_scene.pages;
+    int mesh_id = 0;
+    for (ParsedShape &parsed_shape : parsed_scene.shapes) {
+        auto *parsed_mesh = get_if<ParsedTriangleMesh>(&parsed_shape);
+        if (!parsed_mesh) {
+            continue;
+        }
+        if (parsed_mesh->area_light_id < 0 && parsed_mesh->indices.size() > 0) {
+            TriangleMesh mesh;
+            mesh.material_id = parsed_mesh->material_id;
+            mesh.area_light_id = parsed_mesh->area_light_id;
+            mesh.positions = pack_positions(std::move(parsed_mesh->positions));
+            mesh.indices = std::move(parsed_mesh->indices);
+            mesh.normals = pack_normals(std::move(parsed_mesh->normals));
+            mesh.uvs = pack_uvs(std::move(parsed_mesh->uvs));
+            mesh.size = (int)mesh.indices.size();
+            std::vector<int> faces(mesh.size);
+            std::iota(faces.begin(), faces.end(), 0);
+            meshBVH.push_back(page_faces(mesh, mesh_id, faces, 0, faces.size(), pages, rng_BVH));
+        }
+        mesh_id++;
+    }
+    pages.finish_build();
+    if (meshBVH.empty()) {
+        Error("Scene has no shapes.");
+    }
+    {
+        BVHBuildPhase phase;
+        render_scene.bvh = merge_mesh_bvhs(meshBVH, myScene.camera.origin);
+    }
+    std::cout << "Paged BVH built: " << pages.num_pages() << " pages (" <<
+            pages.file_size() / Real(1024 * 1024) << " MB) in " << page_file.string() <<
+            ". Took " << tick(timer) << " seconds." << std::endl;
+    return render_scene;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "BVH_node.h"
+#include "mmap_file.h"
+#include "scene_snapshot.h"
+
+#include <atomic>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+/// Out-of-core storage for bottom-level BVH subtrees.
+/// Each page holds one flattened subtree and the primitives its leaves refer to. Pages are
+/// appended to a scratch page file while the scene is built, then mapped and copied
+/// into a cache on demand, each page at most once. Every render thread pins the few
+/// pages it traversed last, which keeps them resident; the other pages are evicted
+/// least recently used first while the resident pages, pinned ones included, take
+/// more than budget bytes. release_pins() unpins them all after a render.
+class PagedGeometry {
+public:
+    PagedGeometry(const fs::path &filename, size_t budget);
+    /// Removes the page file.
+    ~PagedGeometry();
+
+    PagedGeometry(const PagedGeometry &) = delete;
+    PagedGeometry &operator=(const PagedGeometry &) = delete;
+
+    /// Append a page and return its id. Only valid before finish_build().
+    int add_page(const std::vector<FlatBVHNode> &nodes, const std::vector<Shape> &shapes);
+    /// Close the page file and map it for reading.
+    void finish_build();
+
+    int num_pages() const {
+        return (int)page_infos.size();
+    }
+    uint64_t file_size() const {
+        return written;
+    }
+
+    /// Intersect r with the subtree of page page_id; same contract as BVH_node::hit.
+    /// The page may be evicted once we return, so if the closest hit is in it, hitObj is
+    /// redirected to a per-thread copy of the shape that stays valid until release_hits().
+    bool hit(int page_id, const ray& r, Real t_min, Real t_max,
+             Hit_Record& rec, Shape*& hitObj);
+
+    /// Unpin the pages pinned by the pool threads, so that they can be evicted. Call it
+    /// once the render is done, from outside the pool's tasks (see PinnedPagesScope).
+    void release_pins();
+
+    /// Drop the shape copies made by hit() on this thread. Call it once no Shape* of
+    /// earlier hits is used anymore, e.g. after each pixel.
+    static void release_hits();
+
+    /// Page-in statistics of the render so far.
+    void print_stats(std::ostream &os) const;
+
+private:
+    struct PageInfo {
+        uint64_t offset;
+        uint64_t num_nodes;
+        uint64_t num_shapes;
+    };
+    struct Page {
+        std::vector<FlatBVHNode> nodes;
+        std::vector<Shape> shapes;
+        size_t bytes;
+    };
+    struct CacheEntry {
+        std::unique_ptr<Page> page;  // null unless resident
+        int pins = 0;  // threads pinning the page; it is in lru only while there are none
+        std::list<int>::iterator lru_pos;
+    };
+
+    /// The page, either from this thread's pins, the cache, or the page file, pinned by
+    /// this thread. The reference stays valid until this thread acquires another page
+    /// or release_pins() runs.
+    Page &acquire(int page_id);
+    std::unique_ptr<Page> load(int page_id) const;
+    /// Pin a resident page. Called with mutex held, as are the two below.
+    void pin(int page_id);
+    void unpin(int page_id);
+    /// Evict unpinned pages until the resident ones fit the budget, if they can.
+    void evict();
+
+    fs::path filename;
+    const size_t budget;
+    // Distinguishes the per-thread pins of different PagedGeometry objects.
+    const uint64_t id;
+
+    std::ofstream writer;
+    uint64_t written = 0;
+    std::vector<PageInfo> page_infos;
+    std::unique_ptr<MappedFile> file;
+
+    std::mutex mutex;
+    std::vector<CacheEntry> cache;  // indexed by page id
+    std::list<int> lru;  // unpinned resident page ids, most recently used first
+    size_t resident_bytes = 0;  // of all resident pages, pinned or not
+    size_t peak_resident_bytes = 0;
+    uint64_t page_ins = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes_paged_in = 0;
+    std::atomic<uint64_t> lookups{0};
+};
+
+/// Releases the page pins of a render (PagedGeometry::release_pins) when it goes out of
+/// scope, also if the render throws. pages may be null for scenes kept in memory.
+class PinnedPagesScope {
+public:
+    explicit PinnedPagesScope(PagedGeometry *pages) : pages(pages) {}
+    ~PinnedPagesScope() {
+        if (pages) {
+            pages->release_pins();
+        }
+    }
+
+    PinnedPagesScope(const PinnedPagesScope &) = delete;
+    PinnedPagesScope &operator=(const PinnedPagesScope &) = delete;
+
+private:
+    PagedGeometry *pages;
+};
+
+/// Out-of-core variant of build_render_scene: spheres and emissive meshes stay resident
+/// as usual, every other mesh is split spatially into pages of at most a few thousand
+/// triangles whose subtrees go to page_file. Only the top-level BVH above the pages
+/// stays in memory; budget bounds the bytes of pages cached while rendering.
+RenderScene build_paged_render_scene(const fs::path &filename,
+                                     const fs::path &page_file,
+                                     size_t budget);
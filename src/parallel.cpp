@@ -1,11 +1,22 @@
 #include "parallel.h"
+#include <deque>
 #include <list>
+#include <memory>
 #include <thread>
 #include <condition_variable>
 #include <vector>
 #include <cassert>
 
-// From https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.cpp
+// Thread pool setup from https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.cpp
+// The scheduler is work-stealing: every thread owns a deque of tasks. A task is
+// a range of loop iterations, run one chunk at a time. Before each chunk the thread
+// splits off the upper half of what is left onto its own deque, but only if that
+// deque is empty or a thread is asleep waiting for work (lazy binary splitting):
+// with nobody to take them, ranges are not split at all. Owners pop from the back
+// of their deque, idle threads steal from the front, so thieves take the largest
+// ranges and owners walk through their range in order.
+// Threads waiting for a loop or task group run other tasks meanwhile, which makes
+// nested parallel_for safe.
 
 class Barrier {
   public:
@@ -19,35 +30,6 @@ class Barrier {
     int count;
 };
 
-static std::vector<std::thread> threads;
-static bool shutdownThreads = false;
-struct ParallelForLoop;
-static ParallelForLoop *workList = nullptr;
-static std::mutex workListMutex;
-
-struct ParallelForLoop {
-    ParallelForLoop(std::function<void(int)> func1D, int64_t maxIndex, int64_t chunkSize)
-        : func1D(std::move(func1D)), maxIndex(maxIndex), chunkSize(chunkSize) {
-    }
-    ParallelForLoop(const std::function<void(Vector2i)> &f, const Vector2i count)
-        : func2D(f), maxIndex(count[0] * count[1]), chunkSize(1) {
-        nX = count[0];
-    }
-
-    std::function<void(int)> func1D;
-    std::function<void(Vector2i)> func2D;
-    const int64_t maxIndex;
-    const int64_t chunkSize;
-    int64_t nextIndex = 0;
-    int activeWorkers = 0;
-    ParallelForLoop *next = nullptr;
-    int nX = -1;
-
-    bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
-    }
-};
-
 void Barrier::Wait() {
     std::unique_lock<std::mutex> lock(mutex);
     assert(count > 0);
@@ -62,10 +44,239 @@ void Barrier::Wait() {
     }
 }
 
-static std::condition_variable workListCondition;
+/// One parallel_for call or task group.
+struct Job {
+    std::function<void(int64_t)> func;  // loop body; empty for task groups
+    int64_t chunkSize = 1;
+    // Loop iterations (or group tasks) that have not finished yet.
+    std::atomic<int64_t> pending{0};
+    // Once a task throws, the remaining iterations are skipped.
+    std::atomic<bool> failed{false};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
+
+struct Task {
+    Job *job = nullptr;
+    int64_t begin = 0, end = 0;
+    const std::function<void()> *single = nullptr;  // task group entry
+};
+
+struct alignas(64) WorkQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    // tasks.size(), readable without the lock
+    std::atomic<size_t> size{0};
+};
+
+static std::vector<std::thread> threads;
+static std::vector<std::unique_ptr<Arena>> arenas;
+static std::vector<std::unique_ptr<WorkQueue>> queues;
+static std::atomic<bool> shutdownThreads{false};
+
+// Sleeping: workEpoch changes whenever a task is pushed or a job completes.
+// A thread that found no work sleeps until the epoch it saw before looking changes.
+static std::mutex sleepMutex;
+static std::condition_variable sleepCondition;
+static std::atomic<uint64_t> workEpoch{0};
+static std::atomic<int> sleepers{0};
+
+/// A task was pushed: one sleeping thread is enough to pick it up.
+static void notify_task() {
+    workEpoch++;
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCondition.notify_one();
+    }
+}
+
+/// A job completed or the pool shuts down: the thread waiting for it may be any sleeper.
+static void notify_all_threads() {
+    workEpoch++;
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCondition.notify_all();
+    }
+}
+
+static WorkQueue &local_queue() {
+    // Threads outside of the pool share the main thread's queue.
+    return *queues[ThreadIndex < (int)queues.size() ? ThreadIndex : 0];
+}
+
+static void push_task(const Task &task) {
+    WorkQueue &queue = local_queue();
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+        queue.size = queue.tasks.size();
+    }
+    notify_task();
+}
+
+/// Pop from the back of our own deque, or steal from the front of another one.
+static bool find_task(Task &task) {
+    int n = (int)queues.size();
+    int self = ThreadIndex < n ? ThreadIndex : 0;
+    {
+        WorkQueue &queue = *queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            queue.size = queue.tasks.size();
+            return true;
+        }
+    }
+    for (int i = 1; i < n; i++) {
+        WorkQueue &victim = *queues[(self + i) % n];
+        std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            // Busy; come back to it in the next round instead of queueing up.
+            continue;
+        }
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            victim.size = victim.tasks.size();
+            return true;
+        }
+    }
+    // try_to_lock may have skipped a victim: one blocking pass before giving up.
+    for (int i = 1; i < n; i++) {
+        WorkQueue &victim = *queues[(self + i) % n];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            victim.size = victim.tasks.size();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void record_error(Job &job) {
+    std::lock_guard<std::mutex> lock(job.errorMutex);
+    if (!job.error) {
+        job.error = std::current_exception();
+    }
+    job.failed = true;
+}
+
+static void finish(Job &job, int64_t count) {
+    // The job may be gone as soon as pending reaches zero: do not touch it afterwards.
+    if (job.pending.fetch_sub(count) == count) {
+        notify_all_threads();
+    }
+}
+
+static void run_task(Task task) {
+    Job &job = *task.job;
+    if (task.single) {
+        if (!job.failed) {
+            try {
+                (*task.single)();
+            } catch (...) {
+                record_error(job);
+            }
+        }
+        finish(job, 1);
+        return;
+    }
+    WorkQueue &queue = local_queue();
+    while (task.begin < task.end) {
+        // Offer the upper half only when there is somebody to take it.
+        if (task.end - task.begin > job.chunkSize &&
+                (queue.size.load(std::memory_order_relaxed) == 0 || sleepers.load() > 0)) {
+            int64_t mid = task.begin + (task.end - task.begin) / 2;
+            push_task(Task{&job, mid, task.end, nullptr});
+            task.end = mid;
+            continue;
+        }
+        int64_t chunkEnd = std::min(task.begin + job.chunkSize, task.end);
+        if (job.failed) {
+            // Skip the rest of the range.
+            chunkEnd = task.end;
+        } else {
+            try {
+                for (int64_t index = task.begin; index < chunkEnd; ++index) {
+                    job.func(index);
+                }
+            } catch (...) {
+                record_error(job);
+            }
+        }
+        // The job may be gone once the last chunk is finished.
+        int64_t count = chunkEnd - task.begin;
+        task.begin = chunkEnd;
+        finish(job, count);
+    }
+}
+
+/// Run tasks (from any job) until done() holds, sleeping when there is nothing to do.
+template <typename Done>
+static void run_until(const Done &done) {
+    while (!done()) {
+        uint64_t epoch = workEpoch.load();
+        Task task;
+        if (find_task(task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers++;
+        sleepCondition.wait(lock, [&] { return done() || workEpoch.load() != epoch; });
+        sleepers--;
+    }
+}
+
+static void wait_for(Job &job) {
+    run_until([&] { return job.pending.load() == 0; });
+}
+
+void *Arena::allocate(size_t size, size_t align) {
+    assert(align <= alignof(std::max_align_t) && (align & (align - 1)) == 0);
+    for (;;) {
+        if (current == blocks.size()) {
+            // new[] aligns for any fundamental type, so aligned offsets suffice
+            size_t bytes = std::max(block_size, size);
+            blocks.push_back(Block{std::unique_ptr<char[]>(new char[bytes]), bytes});
+            offset = 0;
+        }
+        size_t start = (offset + align - 1) & ~(align - 1);
+        if (start + size <= blocks[current].size) {
+            offset = start + size;
+            return blocks[current].data.get() + start;
+        }
+        // Does not fit: move on to the next block (reused after a rewind) or a new one.
+        current++;
+        offset = 0;
+    }
+}
+
+size_t Arena::bytes_reserved() const {
+    size_t bytes = 0;
+    for (const Block &block : blocks) {
+        bytes += block.size;
+    }
+    return bytes;
+}
 
-static void worker_thread_func(const int tIndex, std::shared_ptr<Barrier> barrier) {
+Arena &thread_arena() {
+    if (arenas.empty()) {
+        // parallel_init has not run: there is only the calling thread
+        arenas.push_back(std::make_unique<Arena>());
+    }
+    return *arenas[ThreadIndex < (int)arenas.size() ? ThreadIndex : 0];
+}
+
+static void worker_thread_func(const int tIndex, std::shared_ptr<Barrier> barrier,
+                               std::function<void(int)> threadInit) {
     ThreadIndex = tIndex;
+    if (threadInit) {
+        threadInit(tIndex);
+    }
 
     // The main thread sets up a barrier so that it can be sure that all
     // workers have called ProfilerWorkerThreadInit() before it continues
@@ -76,169 +287,111 @@ static void worker_thread_func(const int tIndex, std::shared_ptr<Barrier> barrie
     // the threads have cleared it.
     barrier.reset();
 
-    std::unique_lock<std::mutex> lock(workListMutex);
-    while (!shutdownThreads) {
-        if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
-        } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
-
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex)
-                workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                if (loop.func1D) {
-                    loop.func1D((int)index);
-                }
-                // Handle other types of loops
-                else {
-                    assert(loop.func2D != nullptr);
-                    loop.func2D(Vector2i{int(index % loop.nX),
-                                         int(index / loop.nX)});
-                }
-            }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished()) {
-                workListCondition.notify_all();
-            }
-        }
-    }
+    run_until([] { return shutdownThreads.load(); });
 }
 
-void parallel_for(const std::function<void(int)> &func,
+void parallel_for(const std::function<void(int64_t)> &func,
                   int64_t count,
                   int64_t chunkSize) {
     // Run iterations immediately if not using threads or if _count_ is small
-    if (threads.empty() || count < chunkSize) {
-        for (int i = 0; i < (int)count; i++) {
+    if (threads.empty() || count <= chunkSize) {
+        for (int64_t i = 0; i < count; i++) {
             func(i);
         }
         return;
     }
 
-    // Create and enqueue _ParallelForLoop_ for this loop
-    ParallelForLoop loop(func, count, chunkSize);
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) {
-            workList = loop.next;
-        }
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            if (loop.func1D) {
-                loop.func1D((int)index);
-            }
-            // Handle other types of loops
-            else {
-                assert(loop.func2D != nullptr);
-                loop.func2D(Vector2i{int(index % loop.nX),
-                                     int(index / loop.nX)});
-            }
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
+    Job job;
+    job.func = func;
+    job.chunkSize = std::max(chunkSize, int64_t(1));
+    job.pending = count;
+    // Our deque is empty, so the first half goes to the other threads at once;
+    // then help out until every iteration is done.
+    run_task(Task{&job, 0, count, nullptr});
+    wait_for(job);
+    if (job.error) {
+        std::rethrow_exception(job.error);
     }
 }
 
 thread_local int ThreadIndex;
 
 void parallel_for(std::function<void(Vector2i)> func, const Vector2i count) {
-    // Launch worker threads if needed
-    if (threads.empty() || count.x * count.y <= 1) {
-        for (int y = 0; y < count.y; ++y) {
-            for (int x = 0; x < count.x; ++x) {
-                func(Vector2i{x, y});
-            }
-        }
-        return;
-    }
-
-    ParallelForLoop loop(std::move(func), count);
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        loop.next = workList;
-        workList = &loop;
-    }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
+    int64_t nX = count.x;
+    parallel_for([&](int64_t index) {
+        func(Vector2i{int(index % nX), int(index / nX)});
+    }, int64_t(count.x) * count.y);
+}
 
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
+struct TaskGroup::State {
+    Job job;
+    // Appended by the owner only; a list never moves its elements.
+    std::list<std::function<void()>> funcs;
+};
 
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+TaskGroup::TaskGroup() : state(std::make_unique<State>()) {
+}
 
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) {
-            workList = loop.next;
-        }
-        loop.activeWorkers++;
+TaskGroup::~TaskGroup() {
+    wait_for(state->job);
+}
 
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            if (loop.func1D) {
-                loop.func1D((int)index);
-            }
-            // Handle other types of loops
-            else {
-                assert(loop.func2D != nullptr);
-                loop.func2D(Vector2i{int(index % loop.nX),
-                                     int(index / loop.nX)});
+void TaskGroup::run(std::function<void()> func) {
+    if (threads.empty()) {
+        if (!state->job.failed) {
+            try {
+                func();
+            } catch (...) {
+                record_error(state->job);
             }
         }
-        lock.lock();
+        return;
+    }
+    state->funcs.push_back(std::move(func));
+    state->job.pending++;
+    push_task(Task{&state->job, 0, 1, &state->funcs.back()});
+}
+
+void TaskGroup::wait() {
+    wait_for(state->job);
+    state->funcs.clear();
+    if (state->job.error) {
+        std::exception_ptr error = state->job.error;
+        state->job.error = nullptr;
+        state->job.failed = false;
+        std::rethrow_exception(error);
+    }
+}
 
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
+void parallel_for_each_thread(const std::function<void(int)> &func) {
+    if (threads.empty()) {
+        func(ThreadIndex);
+        return;
     }
+    // One task per thread. A thread that took one waits at the barrier until every
+    // other thread has taken one too, so none of them can run two.
+    Barrier barrier(int(threads.size()) + 1);
+    TaskGroup group;
+    for (size_t i = 0; i <= threads.size(); i++) {
+        group.run([&] {
+            barrier.Wait();
+            func(ThreadIndex);
+        });
+    }
+    group.wait();
 }
 
-void parallel_init(int num_threads) {
+void parallel_init(int num_threads, const std::function<void(int)> &thread_init) {
     assert(threads.size() == 0);
     ThreadIndex = 0;
+    if (thread_init) {
+        thread_init(0);
+    }
+    num_threads = std::max(num_threads, 1);
+    for (int i = 0; i < num_threads; ++i) {
+        queues.push_back(std::make_unique<WorkQueue>());
+        arenas.push_back(std::make_unique<Arena>());
+    }
 
     // Create a barrier so that we can be sure all worker threads get past
     // their call to ProfilerWorkerThreadInit() before we return from this
@@ -249,26 +402,22 @@ void parallel_init(int num_threads) {
     // Launch one fewer worker thread than the total number we want doing
     // work, since the main thread helps out, too.
     for (int i = 0; i < num_threads - 1; ++i) {
-        threads.push_back(std::thread(worker_thread_func, i + 1, barrier));
+        threads.push_back(std::thread(worker_thread_func, i + 1, barrier, thread_init));
     }
 
     barrier->Wait();
 }
 
 void parallel_cleanup() {
-    if (threads.empty()) {
-        return;
-    }
-
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
+    if (!threads.empty()) {
         shutdownThreads = true;
-        workListCondition.notify_all();
-    }
-
-    for (std::thread &thread : threads) {
-        thread.join();
+        notify_all_threads();
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        threads.erase(threads.begin(), threads.end());
+        shutdownThreads = false;
     }
-    threads.erase(threads.begin(), threads.end());
-    shutdownThreads = false;
+    queues.clear();
+    arenas.clear();
 }
@@ -5,12 +5,157 @@
 #include <mutex>
 #include <functional>
 #include <atomic>
+#include <memory>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
 
 // From https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.h
 extern thread_local int ThreadIndex;
 
+/// Run func(i) for i in [0, count) on the thread pool. Iterations are handed out in
+/// chunks of at most chunk_size. May be called from inside a parallel_for or a task:
+/// the waiting thread runs other work meanwhile. The first exception thrown by func
+/// is rethrown here once all running iterations have finished; the rest are skipped.
 void parallel_for(const std::function<void(int64_t)> &func, int64_t count, int64_t chunk_size = 1);
 void parallel_for(std::function<void(Vector2i)> func, const Vector2i count);
 
-void parallel_init(int num_threads);
+/// A set of independent tasks run on the thread pool.
+/// wait() runs tasks until all of the group's tasks are done and rethrows the first
+/// exception one of them threw. The destructor waits as well, but does not throw.
+class TaskGroup {
+public:
+    TaskGroup();
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void run(std::function<void()> func);
+    void wait();
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+/// Run func(ThreadIndex) once on every pool thread, the calling one included, e.g. to
+/// change per-thread OS state. Every thread is held until all of them have arrived,
+/// so call it from outside the pool's tasks only.
+void parallel_for_each_thread(const std::function<void(int)> &func);
+
+/// A bump allocator for scratch memory. Allocation moves a cursor through a list of
+/// blocks; nothing is freed individually. rewind() and reset() move the cursor back
+/// but keep the blocks, so once an arena has grown to its working size, later
+/// rounds of allocations do not touch the heap at all. Not thread-safe.
+class Arena {
+public:
+    explicit Arena(size_t block_size = 64 * 1024) : block_size(block_size) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    /// size bytes, aligned to align (at most alignof(std::max_align_t)).
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    /// n value-initialized objects. They are never destroyed, hence the trivial
+    /// destructor requirement.
+    template <typename T>
+    T *allocate_array(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "Arena objects are never destroyed");
+        T *array = static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < n; i++) {
+            new (&array[i]) T();
+        }
+        return array;
+    }
+
+    /// The cursor position, to rewind to later.
+    struct Mark {
+        size_t block, offset;
+    };
+    Mark mark() const {
+        return {current, offset};
+    }
+    /// Release everything allocated after m was taken.
+    void rewind(const Mark &m) {
+        current = m.block;
+        offset = m.offset;
+    }
+    /// Release everything.
+    void reset() {
+        rewind({0, 0});
+    }
+
+    /// Bytes held in blocks, used or not.
+    size_t bytes_reserved() const;
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t current = 0, offset = 0;
+    size_t block_size;
+};
+
+/// Releases the arena allocations made during its lifetime.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena &arena) : arena(arena), start(arena.mark()) {}
+    ~ArenaScope() {
+        arena.rewind(start);
+    }
+
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+private:
+    Arena &arena;
+    Arena::Mark start;
+};
+
+/// The scratch arena of the calling pool thread (one per ThreadIndex, created by
+/// parallel_init). Use it for data that dies before the current task does, inside
+/// an ArenaScope or between reset() calls of the code owning the task.
+/// Threads not started by the pool share arena 0 with the main thread and must not use it.
+Arena &thread_arena();
+
+/// Standard allocator drawing from a shared arena. Deallocation does nothing; the
+/// memory goes away with the arena once the last allocator copy is gone, so
+/// allocate_shared objects keep their arena alive by themselves.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(std::shared_ptr<Arena> arena) : arena(std::move(arena)) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const {
+        return arena == other.arena;
+    }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const {
+        return arena != other.arena;
+    }
+
+private:
+    template <typename U> friend class ArenaAllocator;
+    std::shared_ptr<Arena> arena;
+};
+
+/// Start the thread pool. thread_init(ThreadIndex), if given, runs on every thread
+/// (the calling one included) before the first task.
+void parallel_init(int num_threads, const std::function<void(int)> &thread_init = nullptr);
 void parallel_cleanup();
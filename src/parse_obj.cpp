@@ -1,203 +1,342 @@
 #include "parse_obj.h"
 #include "flexception.h"
+#include "mmap_file.h"
+#include "parallel.h"
 #include "transform.h"
 
-#include <fstream>
-#include <functional>
-#include <map>
-#include <regex>
+#include <cctype>
+#include <charconv>
 #include <string>
+#include <string_view>
 
-// https://stackoverflow.com/questions/216823/how-to-trim-a-stdstring
-// trim from start
-static inline std::string& ltrim(std::string &s) {
-    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-        return !std::isspace(ch);
-    }));
-    return s;
-}
-// trim from end
-static inline std::string& rtrim(std::string &s) {
-    s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
-        return !std::isspace(ch);
-    }).base(), s.end());
-    return s;
-}
-// trim from both ends
-static inline std::string &trim(std::string &s) {
-    return ltrim(rtrim(s));
-}
+// The parser maps the file, splits it into chunks at line boundaries and parses the
+// chunks in parallel. Each chunk deduplicates its own face vertices; the chunks are then
+// merged in file order, so vertex ids are assigned exactly as a sequential parser would.
 
-static std::vector<int> split_face_str(const std::string &s) {
-    std::regex rgx("/");
-    std::sregex_token_iterator first{begin(s), end(s), rgx, -1}, last;
-    std::vector<std::string> list{first, last};
-    std::vector<int> result;
-    for (auto &i : list) {
-        if (i != "")
-            result.push_back(std::stoi(i));
-        else
-            result.push_back(0);
-    }
-    while (result.size() < 3)
-        result.push_back(0);
-
-    return result;
-}
+// Size of the chunks of the file parsed by one task.
+static const size_t c_obj_chunk_size = size_t(1) << 20;
 
 struct ObjVertex {
-    ObjVertex(const std::vector<int> &id) : v(id[0]), vt(id[1]), vn(id[2]) {}
+    bool operator==(const ObjVertex &vertex) const {
+        return v == vertex.v && vt == vertex.vt && vn == vertex.vn;
+    }
 
-    bool operator<(const ObjVertex &vertex) const {
-        if (v != vertex.v) {
-            return v < vertex.v;
-        }
-        if (vt != vertex.vt) {
-            return vt < vertex.vt;
+    int v = 0, vt = 0, vn = 0;
+};
+
+/// Open addressing hash map from ObjVertex to a vertex id.
+/// Ids are assigned in insertion order, so they can index a flat array of the keys.
+class ObjVertexMap {
+public:
+    ObjVertexMap() : slots(16, c_empty) {}
+
+    /// Return the id of vertex, inserting it with id "size()" if it is not present.
+    int find_or_insert(const ObjVertex &vertex) {
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash(vertex) & mask;; slot = (slot + 1) & mask) {
+            int id = slots[slot];
+            if (id == c_empty) {
+                id = (int)keys.size();
+                slots[slot] = id;
+                keys.push_back(vertex);
+                if (keys.size() * 2 > slots.size()) {
+                    grow();
+                }
+                return id;
+            }
+            if (keys[id] == vertex) {
+                return id;
+            }
         }
-        if (vn != vertex.vn) {
-            return vn < vertex.vn;
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+    const ObjVertex &key(int id) const {
+        return keys[id];
+    }
+
+private:
+    static constexpr int c_empty = -1;
+
+    static size_t hash(const ObjVertex &vertex) {
+        uint64_t h = uint64_t(uint32_t(vertex.v));
+        h = h * 0x9E3779B97F4A7C15ull ^ uint64_t(uint32_t(vertex.vt));
+        h = h * 0x9E3779B97F4A7C15ull ^ uint64_t(uint32_t(vertex.vn));
+        h *= 0x9E3779B97F4A7C15ull;
+        return size_t(h ^ (h >> 32));
+    }
+
+    void grow() {
+        slots.assign(slots.size() * 2, c_empty);
+        size_t mask = slots.size() - 1;
+        for (int id = 0; id < (int)keys.size(); id++) {
+            size_t slot = hash(keys[id]) & mask;
+            while (slots[slot] != c_empty) {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = id;
         }
-        return false;
     }
 
-    int v, vt, vn;
+    std::vector<int> slots;
+    std::vector<ObjVertex> keys;
 };
 
-size_t get_vertex_id(const ObjVertex &vertex,
-                     const std::vector<Vector3> &pos_pool,
-                     const std::vector<Vector2> &st_pool,
-                     const std::vector<Vector3> &nor_pool,
-                     const Matrix4x4 &to_world,
-                     std::vector<Vector3> &pos,
-                     std::vector<Vector2> &st,
-                     std::vector<Vector3> &nor,
-                     std::map<ObjVertex, size_t> &vertex_map) {
-    auto it = vertex_map.find(vertex);
-    if (it != vertex_map.end()) {
-        return it->second;
-    }
-    size_t id = pos.size();
-    if (vertex.v > 0) {
-        // 1-based indexing to 0-based
-        pos.push_back(xform_point(to_world, pos_pool[vertex.v - 1]));
-    } else {
-        // From Wikipedia (https://en.wikipedia.org/wiki/Wavefront_.obj_file):
-        // "If an index is negative then it relatively refers to the end of the vertex list, -1 referring to the last element."
-        int v = pos_pool.size() + vertex.v;
-        pos.push_back(xform_point(to_world, pos_pool[v]));
-    }
-    
-    if (vertex.vt > 0) {
-        st.push_back(st_pool[vertex.vt - 1]);
-    } else if (vertex.vt < 0) {
-        int vt = st_pool.size() + vertex.vt;
-        st.push_back(st_pool[vt - 1]);
-    }
-    if (vertex.vn > 0) {
-        nor.push_back(xform_normal(
-            inverse(to_world), nor_pool[vertex.vn - 1]));
-    } else if (vertex.vn < 0) {
-        int vn = nor_pool.size() + vertex.vn;
-        nor.push_back(xform_normal(
-            inverse(to_world), nor_pool[vn]));
-    }
-    vertex_map[vertex] = id;
-    return id;
-}
-
-ParsedTriangleMesh parse_obj(const fs::path &filename, const Matrix4x4 &to_world) {
+/// Everything we collect from one chunk of the file.
+/// Indices point to the chunk-local vertex list (the keys of vertex_map).
+struct ObjChunk {
     std::vector<Vector3> pos_pool;
     std::vector<Vector3> nor_pool;
     std::vector<Vector2> st_pool;
-    std::map<ObjVertex, size_t> vertex_map;
-    ParsedTriangleMesh mesh;
+    ObjVertexMap vertex_map;
+    // Sizes of the chunk-local pools when each vertex first appeared.
+    // Negative (relative) indices are resolved against them.
+    std::vector<Vector3i> pool_sizes;
+    std::vector<Vector3i> indices;
+    std::string error;
+};
+
+static bool is_space(char c) {
+    return std::isspace((unsigned char)c);
+}
 
-    std::ifstream ifs(filename.c_str(), std::ifstream::in);
-    if (!ifs.is_open()) {
-        Error("Unable to open the obj file");
+/// Return the next whitespace separated token of [p, end) and advance p past it.
+/// Return an empty token at the end of the line.
+static std::string_view next_token(const char *&p, const char *end) {
+    while (p < end && is_space(*p)) {
+        p++;
     }
-    while (ifs.good()) {
-        std::string line;
-        std::getline(ifs, line);
-        line = trim(line);
-        if (line.size() == 0 || line[0] == '#') { // comment
-            continue;
+    const char *begin = p;
+    while (p < end && !is_space(*p)) {
+        p++;
+    }
+    return std::string_view(begin, p - begin);
+}
+
+/// Parse a real number the way iostream extraction does for well-formed input.
+/// Follow iostream and set x to zero when the token is not a number.
+static void parse_real(std::string_view token, Real &x) {
+    const char *begin = token.data();
+    const char *end = begin + token.size();
+    if (begin < end && *begin == '+') {
+        begin++;
+    }
+    if (std::from_chars(begin, end, x).ec != std::errc()) {
+        x = 0;
+    }
+}
+
+/// Parse a face vertex "v", "v/vt", "v//vn" or "v/vt/vn". Missing entries are zero.
+static bool parse_face_vertex(std::string_view token, ObjVertex &vertex) {
+    int *ids[3] = {&vertex.v, &vertex.vt, &vertex.vn};
+    const char *p = token.data();
+    const char *end = p + token.size();
+    for (int i = 0; i < 3 && p < end; i++) {
+        const char *sep = std::find(p, end, '/');
+        if (sep != p) {
+            const char *begin = (*p == '+') ? p + 1 : p;
+            if (std::from_chars(begin, sep, *ids[i]).ec != std::errc()) {
+                return false;
+            }
         }
+        p = sep == end ? end : sep + 1;
+    }
+    return true;
+}
 
-        std::stringstream ss(line);
-        std::string token;
-        ss >> token;
+static void parse_obj_chunk(const char *p, const char *end, ObjChunk &chunk) {
+    while (p < end) {
+        const char *line_end = std::find(p, end, '\n');
+        const char *q = p;
+        p = line_end == end ? end : line_end + 1;
+
+        std::string_view token = next_token(q, line_end);
+        if (token.empty() || token[0] == '#') { // comment
+            continue;
+        }
         if (token == "v") {  // vertices
-            Real x, y, z, w = 1;
-            ss >> x >> y >> z >> w;
-            pos_pool.push_back(Vector3{x, y, z} / w);
+            Real x = 0, y = 0, z = 0, w = 1;
+            parse_real(next_token(q, line_end), x);
+            parse_real(next_token(q, line_end), y);
+            parse_real(next_token(q, line_end), z);
+            std::string_view w_token = next_token(q, line_end);
+            if (!w_token.empty()) {
+                parse_real(w_token, w);
+            }
+            chunk.pos_pool.push_back(Vector3{x, y, z} / w);
         } else if (token == "vt") {
-            Real s, t, w;
-            ss >> s >> t >> w;
-            st_pool.push_back(Vector2{s, 1 - t});
+            Real s = 0, t = 0;
+            parse_real(next_token(q, line_end), s);
+            parse_real(next_token(q, line_end), t);
+            chunk.st_pool.push_back(Vector2{s, 1 - t});
         } else if (token == "vn") {
-            Real x, y, z;
-            ss >> x >> y >> z;
-            nor_pool.push_back(normalize(Vector3{x, y, z}));
+            Real x = 0, y = 0, z = 0;
+            parse_real(next_token(q, line_end), x);
+            parse_real(next_token(q, line_end), y);
+            parse_real(next_token(q, line_end), z);
+            chunk.nor_pool.push_back(normalize(Vector3{x, y, z}));
         } else if (token == "f") {
-            std::string i0, i1, i2;
-            ss >> i0 >> i1 >> i2;
-            std::vector<int> i0f = split_face_str(i0);
-            std::vector<int> i1f = split_face_str(i1);
-            std::vector<int> i2f = split_face_str(i2);
-
-            ObjVertex v0(i0f), v1(i1f), v2(i2f);
-            size_t v0id = get_vertex_id(v0,
-                                        pos_pool,
-                                        st_pool,
-                                        nor_pool,
-                                        to_world,
-                                        mesh.positions,
-                                        mesh.uvs,
-                                        mesh.normals,
-                                        vertex_map);
-            size_t v1id = get_vertex_id(v1,
-                                        pos_pool,
-                                        st_pool,
-                                        nor_pool,
-                                        to_world,
-                                        mesh.positions,
-                                        mesh.uvs,
-                                        mesh.normals,
-                                        vertex_map);
-            size_t v2id = get_vertex_id(v2,
-                                        pos_pool,
-                                        st_pool,
-                                        nor_pool,
-                                        to_world,
-                                        mesh.positions,
-                                        mesh.uvs,
-                                        mesh.normals,
-                                        vertex_map);
-            mesh.indices.push_back(Vector3i{v0id, v1id, v2id});
-
-            std::string i3;
-            if (ss >> i3) {
-                std::vector<int> i3f = split_face_str(i3);
-                ObjVertex v3(i3f);
-                size_t v3id = get_vertex_id(v3,
-                                            pos_pool,
-                                            st_pool,
-                                            nor_pool,
-	                                        to_world,
-	                                        mesh.positions,
-	                                        mesh.uvs,
-	                                        mesh.normals,
-	                                        vertex_map);
-                mesh.indices.push_back(Vector3i{v0id, v2id, v3id});
+            int ids[4];
+            int num_vertices = 0;
+            for (std::string_view t = next_token(q, line_end); !t.empty();
+                    t = next_token(q, line_end)) {
+                if (num_vertices == 4) {
+                    chunk.error = "The object file contains n-gon (n>4) that we do not support.";
+                    return;
+                }
+                ObjVertex vertex;
+                if (!parse_face_vertex(t, vertex)) {
+                    chunk.error = "Invalid face index " + std::string(t) + " in the obj file.";
+                    return;
+                }
+                size_t num_unique = chunk.vertex_map.size();
+                ids[num_vertices++] = chunk.vertex_map.find_or_insert(vertex);
+                if (chunk.vertex_map.size() > num_unique) {
+                    chunk.pool_sizes.push_back(Vector3i{(int)chunk.pos_pool.size(),
+                                                        (int)chunk.st_pool.size(),
+                                                        (int)chunk.nor_pool.size()});
+                }
             }
-            std::string i4;
-            if (ss >> i4) {
-                Error("The object file contains n-gon (n>4) that we do not support.");
+            if (num_vertices < 3) {
+                chunk.error = "The object file contains a face with less than three vertices.";
+                return;
+            }
+            chunk.indices.push_back(Vector3i{ids[0], ids[1], ids[2]});
+            if (num_vertices == 4) {
+                chunk.indices.push_back(Vector3i{ids[0], ids[2], ids[3]});
             }
         }  // Currently ignore other tokens
     }
+}
+
+ParsedTriangleMesh parse_obj(const fs::path &filename, const Matrix4x4 &to_world) {
+    MappedFile file(filename);
+    const char *data = file.data();
+    const char *data_end = data + file.size();
+
+    // Split the file at line boundaries.
+    std::vector<const char *> chunk_begins{data};
+    while (data_end - chunk_begins.back() > (ptrdiff_t)c_obj_chunk_size) {
+        const char *split = std::find(chunk_begins.back() + c_obj_chunk_size, data_end, '\n');
+        if (split == data_end) {
+            break;
+        }
+        chunk_begins.push_back(split + 1);
+    }
+    chunk_begins.push_back(data_end);
+    int num_chunks = (int)chunk_begins.size() - 1;
+
+    std::vector<ObjChunk> chunks(num_chunks);
+    parallel_for([&](int64_t c) {
+        parse_obj_chunk(chunk_begins[c], chunk_begins[c + 1], chunks[c]);
+    }, num_chunks);
+    for (const ObjChunk &chunk : chunks) {
+        if (!chunk.error.empty()) {
+            Error(chunk.error);
+        }
+    }
+
+    // Concatenate the pools.
+    std::vector<Vector3i> pool_offsets(num_chunks + 1, Vector3i{0, 0, 0});
+    for (int c = 0; c < num_chunks; c++) {
+        pool_offsets[c + 1] = pool_offsets[c] + Vector3i{(int)chunks[c].pos_pool.size(),
+                                                         (int)chunks[c].st_pool.size(),
+                                                         (int)chunks[c].nor_pool.size()};
+    }
+    std::vector<Vector3> pos_pool(pool_offsets[num_chunks].x);
+    std::vector<Vector2> st_pool(pool_offsets[num_chunks].y);
+    std::vector<Vector3> nor_pool(pool_offsets[num_chunks].z);
+    parallel_for([&](int64_t c) {
+        std::copy(chunks[c].pos_pool.begin(), chunks[c].pos_pool.end(),
+                  pos_pool.begin() + pool_offsets[c].x);
+        std::copy(chunks[c].st_pool.begin(), chunks[c].st_pool.end(),
+                  st_pool.begin() + pool_offsets[c].y);
+        std::copy(chunks[c].nor_pool.begin(), chunks[c].nor_pool.end(),
+                  nor_pool.begin() + pool_offsets[c].z);
+    }, num_chunks);
+
+    // Merge the chunk-local vertices in file order. A vertex is resolved
+    // against the pools at its first appearance in the file, and later faces
+    // using the same (v, vt, vn) triplet refer to that vertex.
+    struct ResolvedVertex {
+        int v, vt, vn; // 0-based pool indices, -1 if there is no uv/normal
+    };
+    ObjVertexMap vertex_map;
+    std::vector<ResolvedVertex> vertices;
+    std::vector<std::vector<int>> chunk_to_global(num_chunks);
+    for (int c = 0; c < num_chunks; c++) {
+        const ObjChunk &chunk = chunks[c];
+        chunk_to_global[c].resize(chunk.vertex_map.size());
+        for (int i = 0; i < (int)chunk.vertex_map.size(); i++) {
+            const ObjVertex &vertex = chunk.vertex_map.key(i);
+            int id = vertex_map.find_or_insert(vertex);
+            chunk_to_global[c][i] = id;
+            if (id < (int)vertices.size()) {
+                continue;
+            }
+            // From Wikipedia (https://en.wikipedia.org/wiki/Wavefront_.obj_file):
+            // "If an index is negative then it relatively refers to the end of the vertex list, -1 referring to the last element."
+            Vector3i sizes = pool_offsets[c] + chunk.pool_sizes[i];
+            ResolvedVertex r;
+            // 1-based indexing to 0-based
+            r.v = vertex.v > 0 ? vertex.v - 1 : sizes.x + vertex.v;
+            // Negative uv indices have always been resolved one element before the others;
+            // we keep that so existing scenes load exactly as before.
+            r.vt = vertex.vt > 0 ? vertex.vt - 1 : (vertex.vt < 0 ? sizes.y + vertex.vt - 1 : -1);
+            r.vn = vertex.vn > 0 ? vertex.vn - 1 : (vertex.vn < 0 ? sizes.z + vertex.vn : -1);
+            if (r.v < 0 || r.v >= (int)pos_pool.size() ||
+                    (vertex.vt != 0 && (r.vt < 0 || r.vt >= (int)st_pool.size())) ||
+                    (vertex.vn != 0 && (r.vn < 0 || r.vn >= (int)nor_pool.size()))) {
+                Error("The object file contains an out of range vertex index.");
+            }
+            vertices.push_back(r);
+        }
+    }
+
+    // uvs and normals are only emitted for the vertices that have them.
+    std::vector<int> st_ids(vertices.size()), nor_ids(vertices.size());
+    int num_st = 0, num_nor = 0;
+    for (size_t i = 0; i < vertices.size(); i++) {
+        st_ids[i] = vertices[i].vt >= 0 ? num_st++ : -1;
+        nor_ids[i] = vertices[i].vn >= 0 ? num_nor++ : -1;
+    }
+
+    ParsedTriangleMesh mesh;
+    mesh.positions.resize(vertices.size());
+    mesh.uvs.resize(num_st);
+    mesh.normals.resize(num_nor);
+    Matrix4x4 inv_to_world = inverse(to_world);
+    const int64_t block_size = 16384;
+    parallel_for([&](int64_t block) {
+        size_t begin = block * block_size;
+        size_t end = std::min(begin + block_size, vertices.size());
+        for (size_t i = begin; i < end; i++) {
+            const ResolvedVertex &r = vertices[i];
+            mesh.positions[i] = xform_point(to_world, pos_pool[r.v]);
+            if (st_ids[i] >= 0) {
+                mesh.uvs[st_ids[i]] = st_pool[r.vt];
+            }
+            if (nor_ids[i] >= 0) {
+                mesh.normals[nor_ids[i]] = xform_normal(inv_to_world, nor_pool[r.vn]);
+            }
+        }
+    }, (vertices.size() + block_size - 1) / block_size);
+
+    std::vector<size_t> index_offsets(num_chunks + 1, 0);
+    for (int c = 0; c < num_chunks; c++) {
+        index_offsets[c + 1] = index_offsets[c] + chunks[c].indices.size();
+    }
+    mesh.indices.resize(index_offsets[num_chunks]);
+    parallel_for([&](int64_t c) {
+        const std::vector<int> &to_global = chunk_to_global[c];
+        for (size_t i = 0; i < chunks[c].indices.size(); i++) {
+            const Vector3i &ids = chunks[c].indices[i];
+            mesh.indices[index_offsets[c] + i] =
+                Vector3i{to_global[ids.x], to_global[ids.y], to_global[ids.z]};
+        }
+    }, num_chunks);
 
     return mesh;
 }
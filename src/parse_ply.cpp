@@ -1,12 +1,346 @@
 #include "parse_ply.h"
 #include "flexception.h"
+#include "mmap_file.h"
+#include "parallel.h"
 #include "transform.h"
 #define TINYPLY_IMPLEMENTATION
 #include "3rdparty/tinyply.h"
 
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <sstream>
+
+// Fast path for binary little-endian files: we map the file, read the header ourselves
+// and convert the vertex and face blocks in parallel straight into the mesh arrays.
+// Anything the fast path does not handle falls back to tinyply.
+
+// Number of vertices/faces converted by one parallel task.
+static const int64_t c_ply_block_size = 16384;
+
+enum class PlyType { INVALID, INT8, UINT8, INT16, UINT16, INT32, UINT32, FLOAT32, FLOAT64 };
+
+static PlyType ply_type(const std::string &name) {
+    if (name == "char" || name == "int8") return PlyType::INT8;
+    if (name == "uchar" || name == "uint8") return PlyType::UINT8;
+    if (name == "short" || name == "int16") return PlyType::INT16;
+    if (name == "ushort" || name == "uint16") return PlyType::UINT16;
+    if (name == "int" || name == "int32") return PlyType::INT32;
+    if (name == "uint" || name == "uint32") return PlyType::UINT32;
+    if (name == "float" || name == "float32") return PlyType::FLOAT32;
+    if (name == "double" || name == "float64") return PlyType::FLOAT64;
+    return PlyType::INVALID;
+}
+
+static size_t ply_type_size(PlyType t) {
+    switch (t) {
+        case PlyType::INT8: case PlyType::UINT8: return 1;
+        case PlyType::INT16: case PlyType::UINT16: return 2;
+        case PlyType::INT32: case PlyType::UINT32: case PlyType::FLOAT32: return 4;
+        case PlyType::FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+/// Read a little-endian S at p.
+template <typename S>
+static S ply_load(const char *p) {
+    S v;
+    std::memcpy(&v, p, sizeof(S));
+    return v;
+}
+
+/// Call f with a value of the C++ type stored for t (e.g. float for FLOAT32), so
+/// that the conversion loops switch on the type once instead of once per value.
+template <typename F>
+static void ply_dispatch(PlyType t, F &&f) {
+    switch (t) {
+        case PlyType::INT8: f(int8_t()); break;
+        case PlyType::UINT8: f(uint8_t()); break;
+        case PlyType::INT16: f(int16_t()); break;
+        case PlyType::UINT16: f(uint16_t()); break;
+        case PlyType::INT32: f(int32_t()); break;
+        case PlyType::UINT32: f(uint32_t()); break;
+        case PlyType::FLOAT32: f(float()); break;
+        case PlyType::FLOAT64: f(double()); break;
+        default: break;
+    }
+}
+
+/// Convert N components, stored as S at the given offsets of each record, of the
+/// records [begin, end) to Real: record i goes to dest[i * N, (i + 1) * N).
+template <typename S, int N>
+static void ply_convert(const char *data, size_t stride, const std::vector<size_t> &offsets,
+                        size_t begin, size_t end, Real *dest) {
+    size_t offset[N];
+    for (int k = 0; k < N; k++) {
+        offset[k] = offsets[k];
+    }
+    for (size_t i = begin; i < end; i++) {
+        const char *record = data + i * stride;
+        for (int k = 0; k < N; k++) {
+            dest[i * N + k] = Real(ply_load<S>(record + offset[k]));
+        }
+    }
+}
+
+struct PlyProperty {
+    std::string name;
+    PlyType type = PlyType::INVALID;
+    bool is_list = false;
+    PlyType list_count_type = PlyType::INVALID;
+    size_t offset = 0; // within a vertex record
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+    size_t stride = 0; // record size, for elements without list properties
+};
+
+/// Locate a group of vertex properties that tinyply would read together:
+/// all present with the same floating point type. Return false if the group
+/// is only partially there or has a mixed or integer type.
+static bool find_vertex_properties(const PlyElement &vertex,
+                                   const std::vector<std::string> &names,
+                                   std::vector<size_t> &offsets,
+                                   PlyType &type) {
+    offsets.clear();
+    type = PlyType::INVALID;
+    for (const std::string &name : names) {
+        for (const PlyProperty &p : vertex.properties) {
+            if (p.name == name) {
+                if (offsets.size() > 0 && p.type != type) {
+                    return false;
+                }
+                type = p.type;
+                offsets.push_back(p.offset);
+                break;
+            }
+        }
+    }
+    if (offsets.size() == 0) {
+        return true;
+    }
+    return offsets.size() == names.size() &&
+        (type == PlyType::FLOAT32 || type == PlyType::FLOAT64);
+}
+
+/// Try to load a binary little-endian ply file. Return false if the file should go through tinyply.
+static bool parse_ply_fast(const fs::path &filename,
+                           const Matrix4x4 &to_world,
+                           ParsedTriangleMesh &mesh) {
+    const uint32_t one = 1;
+    char first_byte;
+    std::memcpy(&first_byte, &one, 1);
+    if (first_byte != 1) {
+        // Big-endian host.
+        return false;
+    }
+
+    MappedFile file(filename);
+    const char *data = file.data();
+    const char *end = data + file.size();
+    const char *p = data;
+
+    // Parse the header.
+    std::vector<PlyElement> elements;
+    bool binary_little_endian = false;
+    bool header_done = false;
+    while (p < end && !header_done) {
+        const char *line_end = std::find(p, end, '\n');
+        std::stringstream ss(std::string(p, line_end));
+        p = line_end == end ? end : line_end + 1;
+        std::string token;
+        ss >> token;
+        if (token == "format") {
+            std::string format;
+            ss >> format;
+            binary_little_endian = format == "binary_little_endian";
+        } else if (token == "element") {
+            PlyElement element;
+            ss >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (token == "property") {
+            if (elements.empty()) {
+                return false;
+            }
+            PlyElement &element = elements.back();
+            PlyProperty property;
+            std::string type;
+            ss >> type;
+            if (type == "list") {
+                std::string count_type, item_type;
+                ss >> count_type >> item_type;
+                property.is_list = true;
+                property.list_count_type = ply_type(count_type);
+                property.type = ply_type(item_type);
+            } else {
+                property.type = ply_type(type);
+                property.offset = element.stride;
+                element.stride += ply_type_size(property.type);
+            }
+            ss >> property.name;
+            if (property.type == PlyType::INVALID ||
+                    (property.is_list && property.list_count_type == PlyType::INVALID)) {
+                return false;
+            }
+            element.properties.push_back(property);
+        } else if (token == "end_header") {
+            header_done = true;
+        }
+    }
+    if (!header_done || !binary_little_endian) {
+        return false;
+    }
+
+    // Locate the vertex and face blocks. Faces must be a single triangle list.
+    const char *vertex_data = nullptr;
+    const char *face_data = nullptr;
+    const PlyElement *vertex_element = nullptr;
+    const PlyElement *face_element = nullptr;
+    const PlyProperty *face_property = nullptr;
+    for (const PlyElement &element : elements) {
+        if (element.name == "face") {
+            if (element.properties.size() != 1 ||
+                    !element.properties[0].is_list ||
+                    element.properties[0].name != "vertex_indices") {
+                return false;
+            }
+            face_element = &element;
+            face_property = &element.properties[0];
+            face_data = p;
+            size_t face_size = ply_type_size(face_property->list_count_type) +
+                3 * ply_type_size(face_property->type);
+            if (size_t(end - p) / face_size < element.count) {
+                return false;
+            }
+            p += element.count * face_size;
+        } else {
+            for (const PlyProperty &property : element.properties) {
+                if (property.is_list) {
+                    return false;
+                }
+            }
+            if (element.name == "vertex") {
+                vertex_element = &element;
+                vertex_data = p;
+            }
+            if (element.stride > 0 && size_t(end - p) / element.stride < element.count) {
+                return false;
+            }
+            p += element.count * element.stride;
+        }
+    }
+    if (vertex_element == nullptr) {
+        Error(std::string("Vertex positions not found in ") + filename.string());
+    }
+    if (face_property == nullptr) {
+        Error(std::string("Vertex indices not found in ") + filename.string());
+    }
+
+    std::vector<size_t> pos_offsets, uv_offsets, nor_offsets;
+    PlyType pos_type, uv_type, nor_type;
+    if (!find_vertex_properties(*vertex_element, {"x", "y", "z"}, pos_offsets, pos_type) ||
+            !find_vertex_properties(*vertex_element, {"u", "v"}, uv_offsets, uv_type) ||
+            !find_vertex_properties(*vertex_element, {"nx", "ny", "nz"}, nor_offsets, nor_type)) {
+        return false;
+    }
+    if (pos_offsets.size() == 0) {
+        Error(std::string("Vertex positions not found in ") + filename.string());
+    }
+
+    // Check that every face is a triangle before writing anything.
+    size_t num_faces = face_element->count;
+    size_t count_size = ply_type_size(face_property->list_count_type);
+    size_t index_size = ply_type_size(face_property->type);
+    size_t face_size = count_size + 3 * index_size;
+    int64_t num_face_blocks = (num_faces + c_ply_block_size - 1) / c_ply_block_size;
+    std::vector<char> all_triangles(num_face_blocks, 1);
+    parallel_for([&](int64_t block) {
+        size_t begin = block * c_ply_block_size;
+        size_t block_end = std::min(begin + c_ply_block_size, num_faces);
+        ply_dispatch(face_property->list_count_type, [&](auto count_tag) {
+            using C = decltype(count_tag);
+            for (size_t i = begin; i < block_end; i++) {
+                if (ply_load<C>(face_data + i * face_size) != 3) {
+                    all_triangles[block] = 0;
+                    return;
+                }
+            }
+        });
+    }, num_face_blocks);
+    if (std::find(all_triangles.begin(), all_triangles.end(), 0) != all_triangles.end()) {
+        return false;
+    }
+
+    size_t num_vertices = vertex_element->count;
+    size_t stride = vertex_element->stride;
+    mesh.positions.resize(num_vertices);
+    if (uv_offsets.size() > 0) {
+        mesh.uvs.resize(num_vertices);
+    }
+    if (nor_offsets.size() > 0) {
+        mesh.normals.resize(num_vertices);
+    }
+    mesh.indices.resize(num_faces);
+
+    static_assert(sizeof(Vector3) == 3 * sizeof(Real));
+    static_assert(sizeof(Vector2) == 2 * sizeof(Real));
+    Matrix4x4 inv_to_world = inverse(to_world);
+    int64_t num_vertex_blocks = (num_vertices + c_ply_block_size - 1) / c_ply_block_size;
+    parallel_for([&](int64_t block) {
+        size_t begin = block * c_ply_block_size;
+        size_t block_end = std::min(begin + c_ply_block_size, num_vertices);
+        // One typed pass per attribute, then the transforms.
+        ply_dispatch(pos_type, [&](auto tag) {
+            ply_convert<decltype(tag), 3>(vertex_data, stride, pos_offsets, begin, block_end,
+                                          reinterpret_cast<Real *>(mesh.positions.data()));
+        });
+        for (size_t i = begin; i < block_end; i++) {
+            mesh.positions[i] = xform_point(to_world, mesh.positions[i]);
+        }
+        if (uv_offsets.size() > 0) {
+            ply_dispatch(uv_type, [&](auto tag) {
+                ply_convert<decltype(tag), 2>(vertex_data, stride, uv_offsets, begin, block_end,
+                                              reinterpret_cast<Real *>(mesh.uvs.data()));
+            });
+        }
+        if (nor_offsets.size() > 0) {
+            ply_dispatch(nor_type, [&](auto tag) {
+                ply_convert<decltype(tag), 3>(vertex_data, stride, nor_offsets, begin, block_end,
+                                              reinterpret_cast<Real *>(mesh.normals.data()));
+            });
+            for (size_t i = begin; i < block_end; i++) {
+                mesh.normals[i] = xform_normal(inv_to_world, mesh.normals[i]);
+            }
+        }
+    }, num_vertex_blocks);
+
+    parallel_for([&](int64_t block) {
+        size_t begin = block * c_ply_block_size;
+        size_t block_end = std::min(begin + c_ply_block_size, num_faces);
+        ply_dispatch(face_property->type, [&](auto index_tag) {
+            using S = decltype(index_tag);
+            for (size_t i = begin; i < block_end; i++) {
+                const char *f = face_data + i * face_size + count_size;
+                mesh.indices[i] = Vector3i{int(ply_load<S>(f)),
+                                           int(ply_load<S>(f + sizeof(S))),
+                                           int(ply_load<S>(f + 2 * sizeof(S)))};
+            }
+        });
+    }, num_face_blocks);
+
+    return true;
+}
 
 ParsedTriangleMesh parse_ply(const fs::path &filename, const Matrix4x4 &to_world) {
+    ParsedTriangleMesh mesh;
+    if (parse_ply_fast(filename, to_world, mesh)) {
+        return mesh;
+    }
+
     std::ifstream ifs(filename, std::ios::binary);
     tinyply::PlyFile ply_file;
     ply_file.parse_header(ifs);
@@ -35,7 +369,6 @@ ParsedTriangleMesh parse_ply(const fs::path &filename, const Matrix4x4 &to_world
 
     ply_file.read(ifs);
 
-    ParsedTriangleMesh mesh;
     mesh.positions.resize(vertices->count);
     if (vertices->t == tinyply::Type::FLOAT32) {
         float *data = (float*)vertices->buffer.get();
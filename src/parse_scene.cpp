@@ -4,9 +4,13 @@
 #include "flexception.h"
 #include "parse_obj.h"
 #include "parse_ply.h"
+#include "mesh_cache.h"
+#include "parallel.h"
 #include "parse_serialized.h"
 #include "transform.h"
+#include <functional>
 #include <map>
+#include <memory>
 #include <regex>
 #include <vector>
 
@@ -590,12 +594,39 @@ ParsedLight parse_emitter(pugi::xml_node node,
     }
 }
 
+/// Queue the load of a mesh file into shapes[shape_id].
+/// Mesh files are loaded after the XML walk, in parallel with each other and with
+/// textures, so parse_shape only leaves an empty mesh in place for now.
+void defer_mesh_load(std::vector<ParsedShape> &shapes,
+                     std::vector<std::function<void()>> &load_tasks,
+                     std::function<ParsedTriangleMesh()> load,
+                     bool face_normals) {
+    int shape_id = shapes.size();
+    load_tasks.push_back([&shapes, shape_id, load, face_normals]() {
+        ParsedTriangleMesh loaded = load();
+        // Keep the material and light ids assigned during the XML walk.
+        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shapes[shape_id]);
+        mesh.positions = std::move(loaded.positions);
+        mesh.indices = std::move(loaded.indices);
+        mesh.normals = std::move(loaded.normals);
+        mesh.uvs = std::move(loaded.uvs);
+        if (face_normals) {
+            mesh.normals = std::vector<Vector3>{};
+        } else {
+            if (mesh.normals.size() == 0) {
+                mesh.normals = compute_normals(mesh.positions, mesh.indices);
+            }
+        }
+    });
+}
+
 ParsedShape parse_shape(pugi::xml_node node,
                         std::vector<ParsedMaterial> &materials,
                         std::map<std::string /* name id */, int /* index id */> &material_map,
                         std::map<std::string /* name id */, ParsedColor> &texture_map,
                         std::vector<ParsedLight> &lights,
-                        const std::vector<ParsedShape> &shapes,
+                        std::vector<ParsedShape> &shapes,
+                        std::vector<std::function<void()>> &load_tasks,
                         const std::map<std::string, std::string> &default_map) {
     // First, parse the material inside the shape and get the material ID.
     int material_id = -1;
@@ -645,15 +676,12 @@ ParsedShape parse_shape(pugi::xml_node node,
                     child.attribute("value").value(), default_map);
             }
         }
-        shape = parse_obj(filename, to_world);
-        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shape);
-        if (face_normals) {
-            mesh.normals = std::vector<Vector3>{};
-        } else {
-            if (mesh.normals.size() == 0) {
-                mesh.normals = compute_normals(mesh.positions, mesh.indices);
-            }
-        }
+        defer_mesh_load(shapes, load_tasks, [=]() {
+            return load_mesh_cached(filename, -1, to_world, [&](const Matrix4x4 &xform) {
+                return parse_obj(filename, xform);
+            });
+        }, face_normals);
+        shape = ParsedTriangleMesh{};
     } else if (type == "ply") {
         std::string filename;
         int shape_index = 0;
@@ -674,15 +702,12 @@ ParsedShape parse_shape(pugi::xml_node node,
                     child.attribute("value").value(), default_map);
             }
         }
-        shape = parse_ply(filename, to_world);
-        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shape);
-        if (face_normals) {
-            mesh.normals = std::vector<Vector3>{};
-        } else {
-            if (mesh.normals.size() == 0) {
-                mesh.normals = compute_normals(mesh.positions, mesh.indices);
-            }
-        }
+        defer_mesh_load(shapes, load_tasks, [=]() {
+            return load_mesh_cached(filename, -1, to_world, [&](const Matrix4x4 &xform) {
+                return parse_ply(filename, xform);
+            });
+        }, face_normals);
+        shape = ParsedTriangleMesh{};
     } else if (type == "serialized") {
         std::string filename;
         int shape_index = 0;
@@ -703,15 +728,12 @@ ParsedShape parse_shape(pugi::xml_node node,
                     child.attribute("value").value(), default_map);
             }
         }
-        shape = parse_serialized(filename, shape_index, to_world);
-        ParsedTriangleMesh &mesh = std::get<ParsedTriangleMesh>(shape);
-        if (face_normals) {
-            mesh.normals = std::vector<Vector3>{};
-        } else {
-            if (mesh.normals.size() == 0) {
-                mesh.normals = compute_normals(mesh.positions, mesh.indices);
-            }
-        }
+        defer_mesh_load(shapes, load_tasks, [=]() {
+            return load_mesh_cached(filename, shape_index, to_world, [&](const Matrix4x4 &xform) {
+                return parse_serialized(filename, shape_index, xform);
+            });
+        }, face_normals);
+        shape = ParsedTriangleMesh{};
     } else if (type == "sphere") {
         Vector3 center{0, 0, 0};
         Real radius = 1;
@@ -791,6 +813,24 @@ ParsedShape parse_shape(pugi::xml_node node,
     return shape;
 }
 
+/// Run independent loading tasks on the thread pool.
+/// If some of them fail, report the error of the first one in scene order.
+void run_load_tasks(const std::vector<std::function<void()>> &load_tasks) {
+    std::vector<std::string> errors(load_tasks.size());
+    parallel_for([&](int64_t i) {
+        try {
+            load_tasks[i]();
+        } catch (std::exception &e) {
+            errors[i] = e.what();
+        }
+    }, load_tasks.size());
+    for (const std::string &error : errors) {
+        if (!error.empty()) {
+            Error(error);
+        }
+    }
+}
+
 ParsedScene parse_scene(pugi::xml_node node) {
     ParsedCamera camera{
         Vector3{0, 0,  0},
@@ -799,6 +839,7 @@ ParsedScene parse_scene(pugi::xml_node node) {
         c_default_fov, // FOV
         c_default_res, c_default_res // width/height
     };
+    std::vector<ParsedCamera> cameras;
     std::vector<ParsedMaterial> materials;
     std::vector<ParsedLight> lights;
     std::vector<ParsedShape> shapes;
@@ -810,6 +851,8 @@ ParsedScene parse_scene(pugi::xml_node node) {
     std::map<std::string /* name id */, int /* index id */> material_map;
     Vector3 background_color = Vector3{0.5, 0.5, 0.5};
     int sample_count = 16;
+    // Mesh files and textures are loaded once the XML walk is done, see run_load_tasks.
+    std::vector<std::function<void()>> load_tasks;
 
     for (auto child : node.children()) {
         std::string name = child.name();
@@ -818,6 +861,11 @@ ParsedScene parse_scene(pugi::xml_node node) {
         } else if (name == "sensor") {
             std::tie(camera, filename, sample_count) =
                 parse_sensor(child, default_map);
+            if (!cameras.empty() && (camera.width != cameras[0].width ||
+                                     camera.height != cameras[0].height)) {
+                Error(std::string("All sensors of a scene must have the same resolution."));
+            }
+            cameras.push_back(camera);
         } else if (name == "bsdf") {
             std::string material_name;
             ParsedMaterial m;
@@ -837,6 +885,7 @@ ParsedScene parse_scene(pugi::xml_node node) {
                             texture_map,
                             lights,
                             shapes,
+                            load_tasks,
                             default_map));
         } else if (name == "texture") {
             std::string id = child.attribute("id").value();
@@ -853,7 +902,35 @@ ParsedScene parse_scene(pugi::xml_node node) {
             }
         }
     }
+
+    // Decode every distinct texture file once. Their loads run together with the mesh loads.
+    std::map<fs::path, std::shared_ptr<const Image3>> images;
+    for (ParsedMaterial &m : materials) {
+        std::visit([&](auto &material) {
+            if (auto *texture = std::get_if<ParsedImageTexture>(&material.reflectance)) {
+                images[texture->filename] = nullptr;
+            }
+        }, m);
+    }
+    for (auto &it : images) {
+        load_tasks.push_back([&it]() {
+            it.second = std::make_shared<const Image3>(imread3(it.first));
+        });
+    }
+    run_load_tasks(load_tasks);
+    for (ParsedMaterial &m : materials) {
+        std::visit([&](auto &material) {
+            if (auto *texture = std::get_if<ParsedImageTexture>(&material.reflectance)) {
+                texture->image = images[texture->filename];
+            }
+        }, m);
+    }
+
+    if (cameras.empty()) {
+        cameras.push_back(camera);
+    }
     return ParsedScene{camera,
+                       cameras,
                        materials,
                        lights,
                        shapes,
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "torrey.h"
+#include "image.h"
 #include "vector.h"
 
 #include <filesystem>
+#include <memory>
 #include <variant>
 #include <vector>
 
@@ -19,6 +21,8 @@ struct ParsedImageTexture {
     fs::path filename;
     Real uscale = 1, vscale = 1;
     Real uoffset = 0, voffset = 0;
+    // Decoded by parse_scene; textures sharing a file share the image.
+    std::shared_ptr<const Image3> image;
 };
 
 using ParsedColor = std::variant<Vector3 /* RGB */, ParsedImageTexture>;
@@ -111,6 +115,8 @@ inline bool is_light(const ParsedShape &shape) {
 
 struct ParsedScene {
     ParsedCamera camera;
+    // Every <sensor>, in file order; camera is the last one.
+    std::vector<ParsedCamera> cameras;
     std::vector<ParsedMaterial> materials;
     std::vector<ParsedLight> lights;
     std::vector<ParsedShape> shapes;
@@ -1,9 +1,14 @@
 #include "parse_serialized.h"
 #include "3rdparty/miniz.h"
 #include "flexception.h"
+#include "mmap_file.h"
 #include "transform.h"
-#include <fstream>
-#include <iostream>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define MTS_FILEFORMAT_VERSION_V3 0x0003
 #define MTS_FILEFORMAT_VERSION_V4 0x0004
@@ -22,24 +27,18 @@ enum ETriMeshFlags {
 
 class ZStream {
     public:
-    /// Create a new compression stream
-    ZStream(std::fstream &fs);
+    /// Create a new decompression stream reading from memory
+    ZStream(const char *data, size_t size);
     void read(void *ptr, size_t size);
     virtual ~ZStream();
 
     private:
-    std::fstream &fs;
-    size_t fsize;
+    const char *next;
+    const char *end;
     z_stream m_inflateStream;
-    uint8_t m_inflateBuffer[ZSTREAM_BUFSIZE];
 };
 
-ZStream::ZStream(std::fstream &fs) : fs(fs) {
-    std::streampos pos = fs.tellg();
-    fs.seekg(0, fs.end);
-    fsize = (size_t)fs.tellg();
-    fs.seekg(pos, fs.beg);
-
+ZStream::ZStream(const char *data, size_t size) : next(data), end(data + size) {
     int windowBits = 15;
     m_inflateStream.zalloc = Z_NULL;
     m_inflateStream.zfree = Z_NULL;
@@ -57,18 +56,19 @@ void ZStream::read(void *ptr, size_t size) {
     uint8_t *targetPtr = (uint8_t *)ptr;
     while (size > 0) {
         if (m_inflateStream.avail_in == 0) {
-            size_t remaining = fsize - fs.tellg();
-            m_inflateStream.next_in = m_inflateBuffer;
-            m_inflateStream.avail_in = (uInt)min(remaining, sizeof(m_inflateBuffer));
+            // zlib counts in uInt, so feed very large files in pieces.
+            size_t remaining = end - next;
+            m_inflateStream.next_in = (Bytef *)next;
+            m_inflateStream.avail_in = (uInt)min(remaining, size_t(1) << 30);
             if (m_inflateStream.avail_in == 0) {
                 Error("Read less data than expected");
             }
-
-            fs.read((char *)m_inflateBuffer, m_inflateStream.avail_in);
+            next += m_inflateStream.avail_in;
         }
 
-        m_inflateStream.avail_out = (uInt)size;
+        m_inflateStream.avail_out = (uInt)min(size, size_t(1) << 30);
         m_inflateStream.next_out = targetPtr;
+        size_t requested = m_inflateStream.avail_out;
 
         int retval = inflate(&m_inflateStream, Z_NO_FLUSH);
         switch (retval) {
@@ -86,7 +86,7 @@ void ZStream::read(void *ptr, size_t size) {
             }
         };
 
-        size_t outputSize = size - (size_t)m_inflateStream.avail_out;
+        size_t outputSize = requested - (size_t)m_inflateStream.avail_out;
         targetPtr += outputSize;
         size -= outputSize;
 
@@ -100,90 +100,80 @@ ZStream::~ZStream() {
     inflateEnd(&m_inflateStream);
 }
 
-void skip_to_idx(std::fstream &fs, const short version, const size_t idx) {
+/// Return the offset of the compressed stream of shape idx.
+size_t skip_to_idx(const MappedFile &file, const short version, const size_t idx) {
+    // The shape 0 stream directly follows the file header.
+    if (idx == 0) {
+        return sizeof(short) * 2;
+    }
     // Go to the end of the file to see how many components are there
-    fs.seekg(-sizeof(uint32_t), fs.end);
+    const char *file_end = file.data() + file.size();
     uint32_t count = 0;
-    fs.read((char *)&count, sizeof(uint32_t));
+    std::memcpy(&count, file_end - sizeof(uint32_t), sizeof(uint32_t));
+    if (idx >= count) {
+        Error("parse_serialized: shape index " + std::to_string(idx) + " out of range");
+    }
     size_t offset = 0;
     if (version == MTS_FILEFORMAT_VERSION_V4) {
-        fs.seekg(-sizeof(uint64_t) * (count - idx) - sizeof(uint32_t), fs.end);
-        fs.read((char *)&offset, sizeof(size_t));
+        std::memcpy(&offset, file_end - sizeof(uint64_t) * (count - idx) - sizeof(uint32_t),
+                    sizeof(uint64_t));
     } else {  // V3
-        fs.seekg(-sizeof(uint32_t) * (count - idx + 1), fs.end);
         uint32_t upos = 0;
-        fs.read((char *)&upos, sizeof(unsigned int));
+        std::memcpy(&upos, file_end - sizeof(uint32_t) * (count - idx + 1), sizeof(uint32_t));
         offset = upos;
     }
-    fs.seekg(offset, fs.beg);
     // Skip the header
-    fs.ignore(sizeof(short) * 2);
+    return offset + sizeof(short) * 2;
 }
 
-template <typename Precision>
-std::vector<Vector3> load_position(ZStream &zs, int num_vertices) {
-    std::vector<Vector3> vertices(num_vertices);
-    for (int i = 0; i < (int)num_vertices; i++) {
-        Precision x, y, z;
-        zs.read(&x, sizeof(Precision));
-        zs.read(&y, sizeof(Precision));
-        zs.read(&z, sizeof(Precision));
-        vertices[i] = Vector3{x, y, z};
-    }
-    return vertices;
-}
-
-template <typename Precision>
-std::vector<Vector3> load_normal(ZStream &zs, int num_vertices) {
-    std::vector<Vector3> normals(num_vertices);
-    for (int i = 0; i < (int)normals.size(); i++) {
-        Precision x, y, z;
-        zs.read(&x, sizeof(Precision));
-        zs.read(&y, sizeof(Precision));
-        zs.read(&z, sizeof(Precision));
-        normals[i] = Vector3{x, y, z};
+/// Inflate count * N values of the file precision and convert them to Real.
+/// Each block is inflated with a single read: double data goes straight into the
+/// destination, float data is widened in one pass (four values at a time with SSE2).
+template <typename Precision, int N>
+void load_attribute(ZStream &zs, Real *dest, size_t count) {
+    size_t num_values = count * N;
+    if constexpr (std::is_same_v<Precision, Real>) {
+        zs.read(dest, num_values * sizeof(Real));
+    } else {
+        static_assert(sizeof(Precision) <= sizeof(Real));
+        std::vector<Precision> buffer(num_values);
+        zs.read(buffer.data(), num_values * sizeof(Precision));
+        const Precision *src = buffer.data();
+        size_t i = 0;
+#if defined(__SSE2__)
+        if constexpr (std::is_same_v<Precision, float> && std::is_same_v<Real, double>) {
+            for (; i + 4 <= num_values; i += 4) {
+                __m128 f = _mm_loadu_ps(src + i);
+                _mm_storeu_pd(dest + i, _mm_cvtps_pd(f));
+                _mm_storeu_pd(dest + i + 2, _mm_cvtps_pd(_mm_movehl_ps(f, f)));
+            }
+        }
+#endif
+        for (; i < num_values; i++) {
+            dest[i] = Real(src[i]);
+        }
     }
-    return normals;
 }
 
-template <typename Precision>
-std::vector<Vector2> load_uv(ZStream &zs, int num_vertices) {
-    std::vector<Vector2> uvs(num_vertices);
-    for (int i = 0; i < (int)uvs.size(); i++) {
-        Precision u, v;
-        zs.read(&u, sizeof(Precision));
-        zs.read(&v, sizeof(Precision));
-        uvs[i] = Vector2{u, v};
+/// Inflate and discard size bytes.
+void skip_bytes(ZStream &zs, size_t size) {
+    std::vector<char> buffer(min(size, size_t(ZSTREAM_BUFSIZE)));
+    while (size > 0) {
+        size_t n = min(size, buffer.size());
+        zs.read(buffer.data(), n);
+        size -= n;
     }
-    return uvs;
 }
 
-template <typename Precision>
-std::vector<Vector3> load_color(ZStream &zs, int num_vertices) {
-    std::vector<Vector3> colors(num_vertices);
-    for (int i = 0; i < num_vertices; i++) {
-        Precision r, g, b;
-        zs.read(&r, sizeof(Precision));
-        zs.read(&g, sizeof(Precision));
-        zs.read(&b, sizeof(Precision));
-        colors[i] = Vector3{r, g, b};
+static ParsedTriangleMesh parse_serialized(const MappedFile &file,
+                                           short version,
+                                           int shape_index,
+                                           const Matrix4x4 &to_world) {
+    size_t offset = skip_to_idx(file, version, shape_index);
+    if (offset > file.size()) {
+        Error("parse_serialized: corrupted shape offset");
     }
-    return colors;
-}
-
-ParsedTriangleMesh parse_serialized(const fs::path &filename,
-                                    int shape_index,
-                                    const Matrix4x4 &to_world) {
-    std::fstream fs(filename.c_str(), std::fstream::in | std::fstream::binary);
-    // Format magic number, ignore it
-    fs.ignore(sizeof(short));
-    // Version number
-    short version = 0;
-    fs.read((char *)&version, sizeof(short));
-    if (shape_index > 0) {
-        skip_to_idx(fs, version, shape_index);
-    }
-    ZStream zs(fs);
+    ZStream zs(file.data() + offset, file.size() - offset);
 
     uint32_t flags;
     zs.read((char *)&flags, sizeof(uint32_t));
@@ -205,52 +195,71 @@ ParsedTriangleMesh parse_serialized(const fs::path &filename,
     bool file_double_precision = flags & EDoublePrecision;
     // bool face_normals = flags & EFaceNormals;
 
+    static_assert(sizeof(Vector3) == 3 * sizeof(Real));
+    static_assert(sizeof(Vector2) == 2 * sizeof(Real));
+    static_assert(sizeof(Vector3i) == 3 * sizeof(int));
+
     ParsedTriangleMesh mesh;
+    mesh.positions.resize(vertex_count);
+    // not &data()->x, which dereferences a null pointer for empty meshes
+    Real *positions = reinterpret_cast<Real *>(mesh.positions.data());
     if (file_double_precision) {
-        mesh.positions = load_position<double>(zs, vertex_count);
+        load_attribute<double, 3>(zs, positions, vertex_count);
     } else {
-        mesh.positions = load_position<float>(zs, vertex_count);
+        load_attribute<float, 3>(zs, positions, vertex_count);
     }
     for (auto &p : mesh.positions) {
         p = xform_point(to_world, p);
     }
 
     if (flags & EHasNormals) {
+        mesh.normals.resize(vertex_count);
+        Real *normals = reinterpret_cast<Real *>(mesh.normals.data());
         if (file_double_precision) {
-            mesh.normals = load_normal<double>(zs, vertex_count);
+            load_attribute<double, 3>(zs, normals, vertex_count);
         } else {
-            mesh.normals = load_normal<float>(zs, vertex_count);
+            load_attribute<float, 3>(zs, normals, vertex_count);
         }
+        Matrix4x4 inv_to_world = inverse(to_world);
         for (auto &n : mesh.normals) {
-            n = xform_normal(inverse(to_world), n);
+            n = xform_normal(inv_to_world, n);
         }
     }
 
     if (flags & EHasTexcoords) {
+        mesh.uvs.resize(vertex_count);
+        Real *uvs = reinterpret_cast<Real *>(mesh.uvs.data());
         if (file_double_precision) {
-            mesh.uvs = load_uv<double>(zs, vertex_count);
+            load_attribute<double, 2>(zs, uvs, vertex_count);
         } else {
-            mesh.uvs = load_uv<float>(zs, vertex_count);
+            load_attribute<float, 2>(zs, uvs, vertex_count);
         }
     }
 
     if (flags & EHasColors) {
         // Ignore the color attributes.
-        if (file_double_precision) {
-            load_color<double>(zs, vertex_count);
-        } else {
-            load_color<float>(zs, vertex_count);
-        }
+        skip_bytes(zs, vertex_count * 3 * (file_double_precision ? sizeof(double) : sizeof(float)));
     }
 
     mesh.indices.resize(triangle_count);
-    for (size_t i = 0; i < triangle_count; i++) {
-        int i0, i1, i2;
-        zs.read(&i0, sizeof(int));
-        zs.read(&i1, sizeof(int));
-        zs.read(&i2, sizeof(int));
-        mesh.indices[i] = Vector3i{i0, i1, i2};
-    }
+    zs.read(mesh.indices.data(), triangle_count * sizeof(Vector3i));
 
     return mesh;
 }
+
+static short read_version(const MappedFile &file) {
+    if (file.size() < sizeof(short) * 2) {
+        Error("parse_serialized: file too small");
+    }
+    // Format magic number, ignore it
+    short version = 0;
+    std::memcpy(&version, file.data() + sizeof(short), sizeof(short));
+    return version;
+}
+
+ParsedTriangleMesh parse_serialized(const fs::path &filename,
+                                    int shape_index,
+                                    const Matrix4x4 &to_world) {
+    MappedFile file(filename);
+    return parse_serialized(file, read_version(file), shape_index, to_world);
+}
@@ -0,0 +1,181 @@
+#include "partial_render.h"
+#include "flexception.h"
+#include "mmap_file.h"
+
+#include <cstring>
+#include <fstream>
+#include <numeric>
+
+namespace {
+
+const char c_partial_magic[8] = {'T', 'O', 'R', 'P', 'A', 'R', 'T', '\0'};
+const uint32_t c_partial_version = 2;
+
+struct PartialHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size;
+    int32_t width, height;
+    int32_t x0, y0, x1, y1;
+    int32_t sample_begin, sample_end;
+    int32_t strata;
+};
+
+} // namespace
+
+PartialRender::PartialRender(int width, int height, const Tile &crop,
+                             int sample_begin, int sample_end) :
+        width(width), height(height), crop(crop),
+        sample_begin(sample_begin), sample_end(sample_end) {
+    size_t n = size_t(crop.num_pixels());
+    sum.assign(n, Vector3{0, 0, 0});
+    sum_sq.assign(n, Vector3{0, 0, 0});
+    weight.assign(n, Real(0));
+}
+
+void write_partial_render(const fs::path &filename, const PartialRender &partial) {
+    // Written next to the target and renamed over it, so that a reader (or a resume
+    // after a crash in the middle of a checkpoint) never sees a half-written file.
+    fs::path tmp_filename = filename;
+    tmp_filename += ".tmp";
+    std::ofstream ofs(tmp_filename, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open()) {
+        Error(std::string("Unable to write ") + tmp_filename.string());
+    }
+    PartialHeader header;
+    std::memcpy(header.magic, c_partial_magic, sizeof(c_partial_magic));
+    header.version = c_partial_version;
+    header.real_size = sizeof(Real);
+    header.width = partial.width;
+    header.height = partial.height;
+    header.x0 = partial.crop.x0;
+    header.y0 = partial.crop.y0;
+    header.x1 = partial.crop.x1;
+    header.y1 = partial.crop.y1;
+    header.sample_begin = partial.sample_begin;
+    header.sample_end = partial.sample_end;
+    header.strata = partial.strata;
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)partial.sum.data(), partial.sum.size() * sizeof(Vector3));
+    ofs.write((const char *)partial.sum_sq.data(), partial.sum_sq.size() * sizeof(Vector3));
+    ofs.write((const char *)partial.weight.data(), partial.weight.size() * sizeof(Real));
+    ofs.close();
+    if (!ofs.good()) {
+        Error(std::string("Failed writing partial render ") + tmp_filename.string());
+    }
+    fs::rename(tmp_filename, filename);
+}
+
+PartialRender read_partial_render(const fs::path &filename) {
+    MappedFile file(filename);
+    PartialHeader header;
+    if (file.size() < sizeof(header)) {
+        Error(std::string("Not a partial render: ") + filename.string());
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, c_partial_magic, sizeof(c_partial_magic)) != 0) {
+        Error(std::string("Not a partial render: ") + filename.string());
+    }
+    if (header.version != c_partial_version || header.real_size != sizeof(Real)) {
+        Error(std::string("Partial render ") + filename.string() +
+              " was written by an incompatible build.");
+    }
+    Tile crop{header.x0, header.y0, header.x1, header.y1};
+    if (crop.x0 < 0 || crop.y0 < 0 || crop.x1 > header.width || crop.y1 > header.height ||
+            crop.x0 >= crop.x1 || crop.y0 >= crop.y1) {
+        Error(std::string("Partial render ") + filename.string() + " has an invalid crop window.");
+    }
+    PartialRender partial(header.width, header.height, crop,
+                          header.sample_begin, header.sample_end);
+    partial.strata = header.strata;
+    size_t n = partial.weight.size();
+    if (file.size() != sizeof(header) + n * (2 * sizeof(Vector3) + sizeof(Real))) {
+        Error(std::string("Partial render ") + filename.string() + " is truncated.");
+    }
+    const char *data = file.data() + sizeof(header);
+    std::memcpy(partial.sum.data(), data, n * sizeof(Vector3));
+    data += n * sizeof(Vector3);
+    std::memcpy(partial.sum_sq.data(), data, n * sizeof(Vector3));
+    data += n * sizeof(Vector3);
+    std::memcpy(partial.weight.data(), data, n * sizeof(Real));
+    return partial;
+}
+
+Image3 merge_partial_renders(const std::vector<PartialRender> &partials) {
+    if (partials.empty()) {
+        Error("No partial renders to merge.");
+    }
+    int width = partials[0].width;
+    int height = partials[0].height;
+    for (const PartialRender &partial : partials) {
+        if (partial.width != width || partial.height != height) {
+            Error("Partial renders of different image sizes cannot be merged.");
+        }
+        if (partial.strata != partials[0].strata) {
+            Error("Partial renders of different stratifications (-sampler, -spp) cannot be merged.");
+        }
+    }
+    std::vector<int> order(partials.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return partials[a].sample_begin < partials[b].sample_begin;
+    });
+
+    std::vector<Vector3> sum(size_t(width) * height, Vector3{0, 0, 0});
+    std::vector<Real> weight(size_t(width) * height, Real(0));
+    // Per pixel, the end of the sample ranges merged so far (-1: none yet). In order
+    // of sample_begin, every further range of a pixel has to start right there.
+    std::vector<int> next_sample(size_t(width) * height, -1);
+    for (int i : order) {
+        const PartialRender &partial = partials[i];
+        for (int y = partial.crop.y0; y < partial.crop.y1; y++) {
+            for (int x = partial.crop.x0; x < partial.crop.x1; x++) {
+                size_t p = partial.index(x, y);
+                size_t q = size_t(y) * width + x;
+                if (next_sample[q] >= 0 && next_sample[q] != partial.sample_begin) {
+                    const char *problem =
+                        next_sample[q] > partial.sample_begin ? "overlap" : "leave a gap";
+                    Error(std::string("Partial renders ") + problem + " at pixel (" + std::to_string(x) + ", " + std::to_string(y) +
+                          "): samples up to " + std::to_string(next_sample[q]) +
+                          " are merged, the next partial starts at sample " +
+                          std::to_string(partial.sample_begin) + ".");
+                }
+                next_sample[q] = partial.sample_end;
+                sum[q] += partial.sum[p];
+                weight[q] += partial.weight[p];
+            }
+        }
+    }
+
+    Image3 img(width, height);
+    uint64_t uncovered = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Real w = weight[size_t(y) * width + x];
+            if (w > 0) {
+                // the same reciprocal multiply as the renderer
+                img(x, y) = sum[size_t(y) * width + x] * (Real(1) / w);
+            } else {
+                uncovered++;
+            }
+        }
+    }
+    if (uncovered > 0) {
+        std::cerr << "Warning: " << uncovered << " pixels are not covered by any partial render "
+            "and are left black." << std::endl;
+    }
+    return img;
+}
+
+void merge_partial_render_files(const std::vector<std::string> &params) {
+    if (params.size() < 2) {
+        Error("Usage: -hw merge <output image> <partial render> ...");
+    }
+    std::vector<PartialRender> partials;
+    for (size_t i = 1; i < params.size(); i++) {
+        partials.push_back(read_partial_render(params[i]));
+    }
+    imwrite(params[0], merge_partial_renders(partials));
+    std::cout << "Merged " << partials.size() << " partial renders into " <<
+        params[0] << "." << std::endl;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "image.h"
+#include "tile_scheduler.h"
+
+#include <string>
+#include <vector>
+
+/// The accumulation buffers of one share of a distributed render: the samples
+/// [sample_begin, sample_end) of the pixels inside crop. Coordinates are those of
+/// the output image (row 0 at the top); crop is half-open like a Tile.
+/// Per pixel it stores the sum of the sample values, their number (weight) and the
+/// sum of their squares, so that partial renders of any crops and sample ranges
+/// can be added up and still give means and variances.
+struct PartialRender {
+    int width = 0, height = 0;  // of the whole image
+    Tile crop = {0, 0, 0, 0};
+    int sample_begin = 0, sample_end = 0;
+    // The strata of a stratified render (samples per pixel of the whole render), or 0.
+    // Only partials of the same stratification make up one render.
+    int strata = 0;
+    std::vector<Vector3> sum;
+    std::vector<Vector3> sum_sq;
+    std::vector<Real> weight;
+
+    PartialRender() {}
+    PartialRender(int width, int height, const Tile &crop, int sample_begin, int sample_end);
+
+    /// Index of image pixel (x, y), which must lie inside crop.
+    size_t index(int x, int y) const {
+        return size_t(y - crop.y0) * (crop.x1 - crop.x0) + (x - crop.x0);
+    }
+};
+
+/// Partial renders are raw binary files: a versioned header and the three buffers
+/// in double precision, so that merging loses nothing. The file is replaced
+/// atomically.
+void write_partial_render(const fs::path &filename, const PartialRender &partial);
+PartialRender read_partial_render(const fs::path &filename);
+
+/// Add up partial renders of the same image and divide by the weights. Partials are
+/// added in order of their sample ranges, whatever order they are given in.
+/// The sample ranges covering a pixel have to be contiguous: partials that overlap
+/// or leave a gap between them are rejected, as are partials of different strata.
+/// A merge of crops reproduces a single-process render exactly; splitting the
+/// sample range changes the order of the floating point additions, so the result
+/// can differ from it by rounding.
+Image3 merge_partial_renders(const std::vector<PartialRender> &partials);
+
+/// Command line entry: "-hw merge <output image> <partial render> ..."
+void merge_partial_render_files(const std::vector<std::string> &params);
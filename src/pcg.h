@@ -8,11 +8,20 @@
 // given a seed, we can initialize many different streams of RNGs 
 // that have different independent random numbers.
 
+class Sampler;
+
 struct pcg32_state {
     uint64_t state;
     uint64_t inc;
+    // When set, next_pcg32_real returns the next dimension of the sampler's
+    // current sample instead of the next random number (see sampler.h), so every
+    // random decision of an integrator follows the sampler.
+    Sampler *sampler = nullptr;
 };
 
+// Defined in sampler.cpp.
+double next_sampler_dimension(Sampler &sampler);
+
 // http://www.pcg-random.org/download.html
 inline uint32_t next_pcg32(pcg32_state &rng) {
     uint64_t oldstate = rng.state;
@@ -35,6 +44,29 @@ inline pcg32_state init_pcg32(uint64_t stream_id = 1, uint64_t seed = 0x853c49e6
     return s;
 }
 
+// The splitmix64 finalizer: every input bit affects every output bit.
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return v;
+}
+
+// The random numbers of sample sample_index of pixel pixel_index (y * width + x).
+// The stream depends on nothing else -- not on the tiles, the threads or the other
+// samples -- so any subset of the samples can be rendered anywhere and draws the same
+// random numbers as in a complete render. Every sample value is therefore reproduced;
+// pixel sums of separately rendered sample ranges are added in a different order, so
+// they match a complete render only up to floating point rounding.
+// Each pixel gets its own PCG stream; the samples start at hashed, far-apart
+// positions in it.
+inline pcg32_state init_sample_pcg32(uint64_t pixel_index, uint64_t sample_index,
+                                     uint64_t seed = 0x853c49e6748fea9bULL) {
+    return init_pcg32(pixel_index, mix_bits(seed ^ mix_bits(sample_index)));
+}
+
 template <typename T>
 T next_pcg32_real(pcg32_state &rng) {
     return T(0);
@@ -43,6 +75,9 @@ T next_pcg32_real(pcg32_state &rng) {
 // https://github.com/wjakob/pcg32/blob/master/pcg32.h
 template <>
 inline float next_pcg32_real(pcg32_state &rng) {
+    if (rng.sampler) {
+        return std::min(float(next_sampler_dimension(*rng.sampler)), 0x1.fffffep-1f);
+    }
     union {
         uint32_t u;
         float f;
@@ -54,6 +89,9 @@ inline float next_pcg32_real(pcg32_state &rng) {
 // https://github.com/wjakob/pcg32/blob/master/pcg32.h
 template <>
 inline double next_pcg32_real(pcg32_state &rng) {
+    if (rng.sampler) {
+        return next_sampler_dimension(*rng.sampler);
+    }
     union {
         uint64_t u;
         double d;
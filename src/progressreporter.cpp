@@ -0,0 +1,127 @@
+#include "progressreporter.h"
+
+#include <cstdio>
+
+namespace {
+
+ProgressFormat progress_format = ProgressFormat::Text;
+Real progress_interval = 0.5;
+
+/// s as the contents of a JSON string literal.
+std::string json_escape(const std::string &s) {
+    std::string escaped;
+    for (char c : s) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", (unsigned)(unsigned char)c);
+                    escaped += code;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+} // namespace
+
+void set_progress_format(ProgressFormat format, Real interval_seconds) {
+    progress_format = format;
+    progress_interval = std::max(interval_seconds, Real(0.01));
+}
+
+ProgressReporter::ProgressReporter(uint64_t total_work, const std::string &name) :
+        total_work(total_work), name(name), start(std::chrono::steady_clock::now()) {
+    if (progress_format != ProgressFormat::None) {
+        monitor_thread = std::thread([this] { monitor(); });
+    }
+}
+
+ProgressReporter::~ProgressReporter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_condition.notify_one();
+    if (monitor_thread.joinable()) {
+        monitor_thread.join();
+    }
+}
+
+void ProgressReporter::done() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (finished) {
+            return;
+        }
+        stopping = true;
+        finished = true;
+    }
+    stop_condition.notify_one();
+    if (monitor_thread.joinable()) {
+        monitor_thread.join();
+    }
+    work_done = total_work;
+    report(true);
+}
+
+void ProgressReporter::monitor() {
+    auto interval = std::chrono::duration<double>(progress_interval);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop_condition.wait_for(lock, interval, [this] { return stopping; })) {
+        report(false);
+    }
+}
+
+void ProgressReporter::report(bool final) {
+    if (progress_format == ProgressFormat::None) {
+        return;
+    }
+    uint64_t work = work_done.load(std::memory_order_relaxed);
+    uint64_t samples = samples_done.load(std::memory_order_relaxed);
+    uint64_t rays = rays_done.load(std::memory_order_relaxed);
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    double ratio = total_work > 0 ? double(work) / double(total_work) : 1.0;
+    // linear extrapolation of the time so far; unknown until some work is done
+    double eta = ratio > 0 ? elapsed * (1 - ratio) / ratio : -1;
+    double samples_per_sec = elapsed > 0 ? samples / elapsed : 0;
+    double rays_per_sec = elapsed > 0 ? rays / elapsed : 0;
+
+    if (progress_format == ProgressFormat::Json) {
+        fprintf(stdout,
+                "{\"event\": \"%s\", \"name\": \"%s\", \"done\": %llu, \"total\": %llu, "
+                "\"percent\": %.2f, \"elapsed\": %.3f, \"eta\": %.3f, "
+                "\"samples\": %llu, \"samples_per_sec\": %.1f, "
+                "\"rays\": %llu, \"rays_per_sec\": %.1f}\n",
+                final ? "done" : "progress", json_escape(name).c_str(),
+                (unsigned long long)work, (unsigned long long)total_work,
+                ratio * 100.0, elapsed, final ? 0.0 : eta,
+                (unsigned long long)samples, samples_per_sec,
+                (unsigned long long)rays, rays_per_sec);
+    } else {
+        fprintf(stdout, "\r %.2f Percent Done (%llu / %llu)",
+                ratio * 100.0, (unsigned long long)work, (unsigned long long)total_work);
+        if (final) {
+            fprintf(stdout, ", took %.1f s", elapsed);
+        } else if (eta >= 0) {
+            fprintf(stdout, ", ETA %.1f s", eta);
+        }
+        if (samples > 0) {
+            fprintf(stdout, ", %.2f Msamples/s", samples_per_sec * 1e-6);
+        }
+        if (rays > 0) {
+            fprintf(stdout, ", %.2f Mrays/s", rays_per_sec * 1e-6);
+        }
+        // pad over the remains of a longer previous line
+        fprintf(stdout, final ? "        \n" : "        ");
+    }
+    fflush(stdout);
+}
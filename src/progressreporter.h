@@ -1,58 +1,96 @@
 #pragma once
 
 #include "torrey.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <string>
+#include <thread>
+
+/// How progress reports are printed.
+///   Text: one status line, overwritten in place with '\r'.
+///   Json: one JSON object per line, for job schedulers and other tools.
+///   None: nothing.
+enum class ProgressFormat {
+    Text,
+    Json,
+    None
+};
+
+/// Select the format of all progress reports and how often they are printed.
+void set_progress_format(ProgressFormat format, Real interval_seconds = 0.5);
 
 /// For printing how much work is done for an operation.
-/// The operations are thread-safe so we can safely use this in multi-thread environment.
+/// update() is a few relaxed atomic additions, so worker threads never wait on each
+/// other or on the output. A monitor thread samples the counters every interval
+/// and prints percent done, the estimated time left and, when the workers report
+/// them, samples and rays per second.
 class ProgressReporter {
 public:
-    ProgressReporter(uint64_t total_work) : total_work(total_work), work_done(0) {
-    }
-    void update(uint64_t num) {
-        std::lock_guard<std::mutex> lock(mutex);
-        work_done += num;
-        Real work_ratio = (Real)work_done / (Real)total_work;
-        fprintf(stdout,
-                "\r %.2f Percent Done (%llu / %llu)",
-                work_ratio * Real(100.0),
-                (unsigned long long)work_done,
-                (unsigned long long)total_work);
-    }
-    void done() {
-        work_done = total_work;
-        fprintf(stdout,
-                "\r %.2f Percent Done (%llu / %llu)\n",
-                Real(100.0),
-                (unsigned long long)work_done,
-                (unsigned long long)total_work);
+    ProgressReporter(uint64_t total_work, const std::string &name = "render");
+    ~ProgressReporter();
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+    void update(uint64_t num, uint64_t samples = 0, uint64_t rays = 0) {
+        work_done.fetch_add(num, std::memory_order_relaxed);
+        if (samples > 0) {
+            samples_done.fetch_add(samples, std::memory_order_relaxed);
+        }
+        if (rays > 0) {
+            rays_done.fetch_add(rays, std::memory_order_relaxed);
+        }
     }
+    /// Stop the monitor and print the final report.
+    void done();
     uint64_t get_work_done() const {
-        return work_done;
+        return work_done.load(std::memory_order_relaxed);
     }
 
 private:
+    void monitor();
+    void report(bool final);
+
     const uint64_t total_work;
-    uint64_t work_done;
+    const std::string name;
+    std::atomic<uint64_t> work_done{0};
+    std::atomic<uint64_t> samples_done{0};
+    std::atomic<uint64_t> rays_done{0};
+    std::chrono::steady_clock::time_point start;
+
+    // only the monitor and the owner touch these
     std::mutex mutex;
+    std::condition_variable stop_condition;
+    bool stopping = false;
+    bool finished = false;
+    std::thread monitor_thread;
 };
 
 /*
 Example usage:
-ProgressReporter reporter(num_tiles_x * num_tiles_y);
+ProgressReporter reporter(uint64_t(w) * h, "render");
 parallel_for([&](const Vector2i &tile) {
-    // Use a different rng stream for each thread.
-    pcg32_state rng = init_pcg32(tile[1] * num_tiles_x + tile[0]);
+    uint64_t rays_before = RaysTraced;
+    uint64_t samples = 0;
     int x0 = tile[0] * tile_size;
     int x1 = min(x0 + tile_size, w);
     int y0 = tile[1] * tile_size;
     int y1 = min(y0 + tile_size, h);
     for (int y = y0; y < y1; y++) {
         for (int x = x0; x < x1; x++) {
-            ...
+            for (int s = 0; s < spp; s++) {
+                // The random numbers depend on the pixel and sample only.
+                pcg32_state rng = init_sample_pcg32(uint64_t(y) * w + x, s);
+                ...
+            }
+            samples += spp;
         }
     }
-    reporter.update(1);
+    // Once per tile: pixels done, samples taken, rays traced by this thread.
+    reporter.update(uint64_t(x1 - x0) * (y1 - y0), samples, RaysTraced - rays_before);
 }, Vector2i(num_tiles_x, num_tiles_y));
 reporter.done();
 */
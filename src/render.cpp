@@ -0,0 +1,1117 @@
+#include "render.h"
+#include "aov.h"
+#include "checkpoint.h"
+#include "denoise.h"
+#include "numa.h"
+#include "paged_bvh.h"
+#include "partial_render.h"
+#include "parse_scene.h"
+#include "scene_snapshot.h"
+#include "tile_scheduler.h"
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+// Tiles start at tile_size x tile_size; expensive ones are split down to min_tile_size.
+constexpr int tile_size = 16;
+constexpr int min_tile_size = 4;
+// The cost pre-pass traces one sample every prepass_stride pixels in x and y.
+constexpr int prepass_stride = 4;
+// Seed of the pre-pass random streams, so that they never coincide with the real ones.
+constexpr uint64_t prepass_seed = 0x5eed0f7c0a57ULL;
+
+/// Parse the scene and build its BVH, or load both from a snapshot if one is given.
+RenderScene load_single_render_scene(const RenderOptions &options) {
+    if (!options.page_file.empty()) {
+        return build_paged_render_scene(options.filename, options.page_file,
+                                        options.cache_mb * 1024 * 1024);
+    }
+    if (options.snapshot.empty()) {
+        return build_render_scene(options.filename);
+    }
+    Timer timer;
+    tick(timer);
+    RenderScene render_scene = read_scene_snapshot(options.snapshot);
+    std::cout << "Scene snapshot loaded. Took " << tick(timer) << " seconds." << std::endl;
+    return render_scene;
+}
+
+/// Time a sparse one-sample render of every tile. The samples are thrown away.
+std::vector<Real> estimate_tile_costs(const std::vector<Tile> &tiles,
+                                      const RenderScene &render_scene,
+                                      const std::vector<RenderScene> &replicas,
+                                      const Camera &cam,
+                                      Integrator integrator, int max_depth) {
+    std::vector<Real> costs(tiles.size());
+    bool paged = render_scene.pages != nullptr;
+    parallel_for([&](int64_t i) {
+        const RenderScene &local = local_render_scene(render_scene, replicas);
+        Scene &scene = *local.scene;
+        BVH_node &root = *local.bvh;
+        const Tile &tile = tiles[i];
+        Timer timer;
+        tick(timer);
+        for (int y = tile.y0 + prepass_stride / 2; y < tile.y1; y += prepass_stride) {
+            for (int x = tile.x0 + prepass_stride / 2; x < tile.x1; x += prepass_stride) {
+                pcg32_state rng = init_sample_pcg32(uint64_t(y) * scene.width + x, 0, prepass_seed);
+                Real u = Real(x + next_pcg32_real<double>(rng)) / (scene.width - 1);
+                Real v = Real(y + next_pcg32_real<double>(rng)) / (scene.height - 1);
+                ray localRay = cam.get_ray(u, v);
+                integrator(scene, localRay, root, rng, max_depth);
+                if (paged) {
+                    PagedGeometry::release_hits();
+                }
+            }
+        }
+        costs[i] = tick(timer);
+    }, tiles.size());
+    return costs;
+}
+
+/// The three numbers following params[i]; advances i past them.
+Vector3 parse_vector3(const std::vector<std::string> &params, int &i) {
+    if (i + 3 >= (int)params.size()) {
+        Error(params[i] + " needs three numbers.");
+    }
+    Vector3 v;
+    v.x = std::stod(params[++i]);
+    v.y = std::stod(params[++i]);
+    v.z = std::stod(params[++i]);
+    return v;
+}
+
+/// Relative standard error of the mean of n samples with the given mean and
+/// variance (averaged over the channels). The constant keeps black pixels from
+/// dominating.
+Real relative_error(Real n, const Vector3 &mean, const Vector3 &variance) {
+    Real std_error = sqrt(std::max(average(variance), Real(0)) / n);
+    return std_error / (average(mean) + Real(1e-3));
+}
+
+/// Mean and variance of the samples of a pixel, kept as the sum and sum of squares
+/// of the samples like the film, so it continues from the film's sums of earlier
+/// passes. The variance is (sum_sq - sum * mean) / (n - 1), which cancels when the
+/// spread is tiny next to the mean; in doubles that only blurs relative errors far
+/// below any useful threshold, so it does not change which pixels stop.
+struct RunningVariance {
+    Real n = 0;
+    Vector3 sum = {0, 0, 0};
+    Vector3 sum_sq = {0, 0, 0};
+
+    RunningVariance(Real n, const Vector3 &sum, const Vector3 &sum_sq) :
+        n(n), sum(sum), sum_sq(sum_sq) {}
+
+    void add(const Vector3 &x) {
+        n += 1;
+        sum += x;
+        sum_sq += x * x;
+    }
+
+    Real relative_error() const {
+        if (n < 2) {
+            return infinity<Real>();
+        }
+        Vector3 mean = sum / n;
+        // unbiased sample variance
+        Vector3 variance = max(sum_sq - sum * mean, Vector3{0, 0, 0}) / (n - 1);
+        return ::relative_error(n, mean, variance);
+    }
+};
+
+/// One image being rendered: its camera, its share of the work, its tiles and its
+/// buffers. The buffers are allocated separately (allocate_film), so that a batch
+/// can hold many frames but only the ones in flight take memory.
+struct Frame {
+    Camera cam;
+    int width = 0, height = 0;
+    Tile crop = {0, 0, 0, 0};
+    int sample_begin = 0, sample_end = 0;
+    // Adaptive sampling (threshold > 0): a pixel gets no more samples once it has
+    // adaptive_min_spp and its relative error is below adaptive_threshold.
+    Real adaptive_threshold = 0;
+    int adaptive_min_spp = 0;
+    SamplerType sampler = SamplerType::Independent;
+    // Stratified sampling: the strata per dimension, the samples per pixel of the
+    // whole render (0 for the other samplers).
+    int strata = 0;
+    // The AOVs collected, for -aovs and the denoiser.
+    AovSet aovs;
+    std::vector<Tile> schedule;
+    Image3f img;
+    PartialRender film;
+    AovFilm aov_film;
+    // Held shared while tiles store their pixels, exclusively to copy the film.
+    std::shared_mutex film_mutex;
+    // batch rendering: tiles not rendered yet, and the lazy allocation of the buffers
+    std::atomic<int> tiles_left{0};
+    std::once_flag allocated;
+
+    Frame() {}
+    Frame(Frame &&other) :
+        cam(other.cam), width(other.width), height(other.height), crop(other.crop),
+        sample_begin(other.sample_begin), sample_end(other.sample_end),
+        adaptive_threshold(other.adaptive_threshold), adaptive_min_spp(other.adaptive_min_spp),
+        sampler(other.sampler), strata(other.strata), aovs(other.aovs),
+        schedule(std::move(other.schedule)), img(std::move(other.img)),
+        film(std::move(other.film)), aov_film(std::move(other.aov_film)) {}
+};
+
+/// The camera and the share of the work given by the options.
+Frame setup_frame(const Scene &scene, const RenderOptions &options) {
+    Frame frame;
+    frame.width = scene.width;
+    frame.height = scene.height;
+    frame.cam = scene.camera;
+    if (options.lookfrom || options.lookat || options.up || options.vfov) {
+        frame.cam = Camera(options.lookfrom.value_or(frame.cam.origin),
+                           options.lookat.value_or(frame.cam.lookat),
+                           options.up.value_or(frame.cam.up),
+                           options.vfov.value_or(frame.cam.vfov),
+                           frame.width, frame.height);
+    }
+    // The share of the work assigned to this process: the whole image and all
+    // samples unless -crop or -samples say otherwise.
+    frame.crop = options.crop.num_pixels() > 0 ?
+        options.crop : Tile{0, 0, frame.width, frame.height};
+    frame.sample_begin = options.sample_begin;
+    // With a time budget or a noise target the scene's samples per pixel is no
+    // limit, only -spp or -samples are.
+    bool open_ended = options.time_budget > 0 || options.target_error > 0;
+    frame.sample_end = options.sample_end >= 0 ? options.sample_end :
+        options.spp > 0 ? options.spp :
+        open_ended ? std::numeric_limits<int>::max() : scene.samples_per_pixel;
+    const Tile &crop = frame.crop;
+    if (crop.x0 < 0 || crop.y0 < 0 || crop.x1 > frame.width || crop.y1 > frame.height ||
+            crop.x0 >= crop.x1 || crop.y0 >= crop.y1) {
+        Error("The -crop window lies outside the image.");
+    }
+    if (frame.sample_begin < 0 || frame.sample_begin >= frame.sample_end) {
+        Error("The -samples range is empty.");
+    }
+    frame.adaptive_threshold = options.adaptive_threshold;
+    frame.adaptive_min_spp = std::max(options.adaptive_min_spp, 2);
+    frame.sampler = options.sampler;
+    if (frame.sampler == SamplerType::Stratified) {
+        // The strata span the samples of the whole render, not just this process's
+        // share, so that the shares of a split render are stratified together.
+        frame.strata = options.spp > 0 ? options.spp : scene.samples_per_pixel;
+        if (frame.sample_end > frame.strata) {
+            if (open_ended && options.spp <= 0) {
+                Error("-sampler stratified needs -spp with -time or -target_error.");
+            }
+            Error("-sampler stratified: the -samples range ends past the " +
+                  std::to_string(frame.strata) + " samples per pixel of the render; "
+                  "give the whole render's samples per pixel with -spp.");
+        }
+    }
+    frame.aovs = options.aovs;
+    if (options.denoise) {
+        // the denoiser's inputs
+        frame.aovs.set(int(Aov::Albedo));
+        frame.aovs.set(int(Aov::Normal));
+        frame.aovs.set(int(Aov::Variance));
+    }
+    if (options.denoise && (crop.x0 != 0 || crop.y0 != 0 ||
+                            crop.x1 != frame.width || crop.y1 != frame.height)) {
+        Error("-denoise needs the whole image, not a -crop window.");
+    }
+    return frame;
+}
+
+void allocate_film(Frame &frame) {
+    frame.img = Image3f(frame.width, frame.height);
+    frame.film = PartialRender(frame.width, frame.height, frame.crop,
+                               frame.sample_begin, frame.sample_end);
+    frame.film.strata = frame.strata;
+    frame.aov_film = AovFilm(frame.aovs, frame.film.weight.size());
+}
+
+/// Take over the pixels of an earlier, interrupted render of the same frame.
+/// A checkpoint only holds whole tiles of whole passes, and render_tile only renders
+/// the samples a pixel lacks. These are the ones an uninterrupted render would
+/// compute, so the image comes out the same.
+void resume_from_checkpoint(Frame &frame, const fs::path &filename) {
+    if (!fs::exists(filename)) {
+        std::cout << "No checkpoint at " << filename.string() << " yet, starting afresh." << std::endl;
+        return;
+    }
+    PartialRender saved = read_partial_render(filename);
+    const Tile &crop = frame.film.crop;
+    if (saved.width != frame.width || saved.height != frame.height ||
+            saved.crop.x0 != crop.x0 || saved.crop.y0 != crop.y0 ||
+            saved.crop.x1 != crop.x1 || saved.crop.y1 != crop.y1 ||
+            saved.sample_begin != frame.sample_begin || saved.sample_end != frame.sample_end ||
+            saved.strata != frame.strata) {
+        Error(std::string("Checkpoint ") + filename.string() +
+              " is of a different image size, crop window, sample range or stratification.");
+    }
+    frame.film = std::move(saved);
+    size_t done = 0;
+    for (Real w : frame.film.weight) {
+        done += w > 0;
+    }
+    std::cout << "Resuming from " << filename.string() << ": " << done << " of " <<
+        frame.film.weight.size() << " pixels done." << std::endl;
+}
+
+/// Mean over the pixels of the relative standard error of their estimates, from the
+/// per-pixel sample variances. It falls as 1 / sqrt(samples per pixel).
+Real estimate_relative_error(const PartialRender &film) {
+    Real total = 0;
+    size_t count = 0;
+    for (size_t p = 0; p < film.weight.size(); p++) {
+        Real w = film.weight[p];
+        if (w < 2) {
+            continue;
+        }
+        total += RunningVariance(w, film.sum[p], film.sum_sq[p]).relative_error();
+        count++;
+    }
+    // unknown until pixels have two samples
+    return count > 0 ? total / count : infinity<Real>();
+}
+
+/// The tiles of the frame's crop window, in rendering order.
+std::vector<Tile> schedule_tiles(const LoadedScene &loaded, const Frame &frame,
+                                 const RenderOptions &options, Integrator integrator) {
+    // Tiles follow a Hilbert curve: the tiles in flight at any time form a compact
+    // region of the image, so the threads share most of the geometry they touch
+    // (this is also what keeps the out-of-core working set small).
+    // Tiles are in render coordinates, where y runs bottom-up (image row height-1-y).
+    const Tile &crop = frame.crop;
+    std::vector<Tile> schedule = hilbert_tiles(crop.x1 - crop.x0, crop.y1 - crop.y0, tile_size);
+    for (Tile &tile : schedule) {
+        int dx = crop.x0;
+        int dy = frame.height - crop.y1;
+        tile = Tile{tile.x0 + dx, tile.y0 + dy, tile.x1 + dx, tile.y1 + dy};
+    }
+    if (options.adaptive_tiles && schedule.size() > 1) {
+        Timer timer;
+        tick(timer);
+        std::vector<Real> costs = estimate_tile_costs(schedule, loaded.render_scene,
+            loaded.replicas, frame.cam, integrator, options.max_depth);
+        size_t num_tiles = schedule.size();
+        schedule = cost_adaptive_schedule(schedule, costs, min_tile_size);
+        std::cout << "Tile cost pre-pass: " << schedule.size() - num_tiles <<
+            " extra tiles from splitting. Took " << tick(timer) << " seconds." << std::endl;
+    }
+    return schedule;
+}
+
+/// The max depth at which the integrator returns the light that reached the camera
+/// after at most one bounce.
+unsigned int direct_lighting_depth(Integrator integrator) {
+    // radiance spends a level of recursion on the camera ray's own hit
+    return integrator == radiance ? 2 : 1;
+}
+
+/// Render the samples [pass_begin, pass_end) of one tile of the frame and add them
+/// to its film, then update the tile in the image. A pixel of the film holds the
+/// samples [sample_begin, sample_begin + weight), so the samples it already has --
+/// from an earlier pass or a checkpoint -- are not rendered again. Under adaptive
+/// sampling a pixel stops early once converged. Tiles of a frame may be rendered
+/// concurrently: they write disjoint pixels.
+void render_tile(const LoadedScene &loaded, Frame &frame, const Tile &tile,
+                 int pass_begin, int pass_end,
+                 Integrator integrator, int max_depth, ProgressReporter &reporter) {
+    // BEGIN: rewrite hw_1_8() code
+    // almost 100% copy from https://github.com/BachiLi/lajolla_public/blob/b8ca4d02e2c7629db672d50a113c9dd04c54c906/src/render.cpp#L80
+    const RenderScene &local = local_render_scene(loaded.render_scene, loaded.replicas);
+    Scene &localScene = *local.scene;
+    BVH_node &root = *local.bvh;
+    bool paged = loaded.render_scene.pages != nullptr;
+    const Camera &cam = frame.cam;
+    int width = frame.width, height = frame.height;
+    PartialRender &film = frame.film;
+    bool adaptive = frame.adaptive_threshold > 0;
+    // The samples of a pixel are distributed together up to the sample budget.
+    Sampler sampler(frame.sampler, frame.strata);
+    // Scratch memory of the tile, released when it is done. The arena keeps its
+    // blocks, so after the first few tiles rendering does not allocate at all.
+    Arena &arena = thread_arena();
+    ArenaScope tile_scratch(arena);
+    // The tile is rendered into buffers in the thread's arena, which are allocated
+    // (and so, under NUMA pinning, placed) on the thread's node, and added
+    // into the film once complete.
+    Vector3 *tile_sum = arena.allocate_array<Vector3>(tile.num_pixels());
+    Vector3 *tile_sum_sq = arena.allocate_array<Vector3>(tile.num_pixels());
+    int *tile_count = arena.allocate_array<int>(tile.num_pixels());
+    // AOVs that are not collected cost neither rays nor memory.
+    bool first_hit_aovs = aov_needs_first_hit(frame.aovs);
+    bool direct_aovs = aov_needs_direct(frame.aovs);
+    AovPixel *tile_aov = first_hit_aovs || direct_aovs ?
+        arena.allocate_array<AovPixel>(tile.num_pixels()) : nullptr;
+    unsigned int direct_depth = std::min(direct_lighting_depth(integrator), unsigned(max_depth));
+    int tile_width = tile.x1 - tile.x0;
+    uint64_t rays_before = RaysTraced;
+    uint64_t samples = 0;
+    // use scene.camera
+    ray localRay;
+    Real u, v;
+    // cannot directly store color now
+    Vector3 pixel_color, pixel_sq;
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            int i = (y - tile.y0) * tile_width + (x - tile.x0);
+            size_t p = film.index(x, height-1 - y);
+            // Vector3 does not initialize itself, and skipped pixels add nothing.
+            tile_sum[i] = tile_sum_sq[i] = Vector3{0, 0, 0};
+            tile_count[i] = 0;
+            if (tile_aov) {
+                tile_aov[i] = AovPixel();
+            }
+            int first = std::max(pass_begin, film.sample_begin + int(film.weight[p]));
+            if (first >= pass_end) {
+                continue;
+            }
+            RunningVariance variance(film.weight[p], film.sum[p], film.sum_sq[p]);
+            auto converged = [&] {
+                return adaptive && variance.n >= frame.adaptive_min_spp &&
+                    variance.relative_error() <= frame.adaptive_threshold;
+            };
+            if (converged()) {
+                continue;
+            }
+            // for each pixel, shoot may random rays thru
+            pixel_color = {0.0, 0.0, 0.0};
+            pixel_sq = {0.0, 0.0, 0.0};
+            // samples [first, last) are rendered
+            int last = pass_end;
+            for (int s=first; s<pass_end; ++s) {
+                // One random stream per sample, so the image depends neither on
+                // how the pixels are grouped into tiles nor on where (or whether)
+                // the other samples of the pixel are rendered.
+                auto start_sample = [&] {
+                    pcg32_state rng = init_sample_pcg32(uint64_t(y) * width + x, s);
+                    if (frame.sampler != SamplerType::Independent) {
+                        sampler.start_sample(uint64_t(y) * width + x, s, rng);
+                        rng.sampler = &sampler;
+                    }
+                    return rng;
+                };
+                pcg32_state rng = start_sample();
+                // shoot a ray
+                u = Real(x + next_pcg32_real<double>(rng)) / (width - 1);
+                v = Real(y + next_pcg32_real<double>(rng)) / (height - 1);
+                localRay = cam.get_ray(u, v);
+                ray primaryRay = localRay;
+
+                // CHANGE: call computePixelColor() which deal with hit & no-hit
+                Vector3 sample = integrator(localScene, localRay, root, rng, max_depth);
+                if (tile_aov) {
+                    AovPixel &aov = tile_aov[i];
+                    if (first_hit_aovs) {
+                        Hit_Record rec;
+                        Shape* hitObj = nullptr;
+                        root.trace(primaryRay, EPSILON, infinity<Real>(), localScene, rec, hitObj);
+                        if (rec.dist > 1e9) {  // no hit
+                            aov.albedo += localScene.background_color;
+                        } else {
+                            aov.hits++;
+                            aov.depth += rec.dist;
+                            aov.normal += rec.normal;
+                            aov.albedo += material_albedo(localScene.materials[rec.mat_id], rec);
+                            if (aov.samples == 0) {
+                                aov.material_id = rec.mat_id;
+                            }
+                        }
+                    }
+                    if (direct_aovs) {
+                        // The same random numbers with the path cut after its first
+                        // bounce: the sample's own direct lighting.
+                        pcg32_state direct_rng = start_sample();
+                        next_pcg32_real<double>(direct_rng);
+                        next_pcg32_real<double>(direct_rng);
+                        ray directRay = primaryRay;
+                        aov.direct += integrator(localScene, directRay, root, direct_rng, direct_depth);
+                    }
+                    aov.samples++;
+                }
+                pixel_color += sample;
+                pixel_sq += sample * sample;
+                if (adaptive) {
+                    variance.add(sample);
+                    if (converged()) {
+                        last = s + 1;
+                        break;
+                    }
+                }
+            }
+            tile_sum[i] = pixel_color;
+            tile_sum_sq[i] = pixel_sq;
+            tile_count[i] = last - first;
+            samples += last - first;
+            if (paged) {
+                PagedGeometry::release_hits();
+            }
+        }
+    }
+    std::shared_lock<std::shared_mutex> film_lock(frame.film_mutex);
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            int i = (y - tile.y0) * tile_width + (x - tile.x0);
+            size_t p = film.index(x, height-1 - y);
+            film.sum[p] += tile_sum[i];
+            film.sum_sq[p] += tile_sum_sq[i];
+            film.weight[p] += tile_count[i];
+            if (tile_aov) {
+                frame.aov_film.add(p, tile_aov[i]);
+            }
+            // average and write color
+            if (film.weight[p] > 0) {
+                // averaged in double, stored in float
+                frame.img(x, height-1 - y) = Vector3f(film.sum[p] * (Real(1) / film.weight[p]));
+            }
+        }
+    }
+    reporter.update(tile.num_pixels(), samples, RaysTraced - rays_before);
+    // END: rewrite hw_1_8() code
+}
+
+/// Render the samples [pass_begin, pass_end) of every tile of the frame, in
+/// schedule order. Once skip_tile() returns true the remaining tiles are skipped;
+/// after_tile(), if given, runs after each tile rendered.
+void render_pass(const LoadedScene &loaded, Frame &frame, int pass_begin, int pass_end,
+                 Integrator integrator, int max_depth, const std::string &name,
+                 const std::function<bool()> &skip_tile,
+                 const std::function<void()> &after_tile = nullptr) {
+    ProgressReporter reporter(uint64_t(frame.crop.num_pixels()), name);
+    std::atomic<size_t> next_tile{0};
+    parallel_for([&](int64_t) {
+        // Every call renders exactly one tile, always the next one of the schedule:
+        // the thread pool decides when a tile starts, the schedule decides which.
+        const Tile &tile = frame.schedule[next_tile++];
+        if (skip_tile()) {
+            return;
+        }
+        render_tile(loaded, frame, tile, pass_begin, pass_end, integrator, max_depth, reporter);
+        if (after_tile) {
+            after_tile();
+        }
+    }, frame.schedule.size());
+    reporter.done();
+}
+
+/// The frame at 1/scale of its resolution in x and y, same view and samples.
+Frame scaled_frame(const Frame &full, int scale) {
+    Frame frame;
+    // render_tile needs two pixels in each direction
+    frame.width = std::max(full.width / scale, 2);
+    frame.height = std::max(full.height / scale, 2);
+    frame.cam = Camera(full.cam.origin, full.cam.lookat, full.cam.up, full.cam.vfov,
+                       frame.width, frame.height);
+    frame.crop = Tile{0, 0, frame.width, frame.height};
+    frame.sample_begin = full.sample_begin;
+    frame.sample_end = full.sample_end;
+    frame.adaptive_threshold = full.adaptive_threshold;
+    frame.adaptive_min_spp = full.adaptive_min_spp;
+    frame.sampler = full.sampler;
+    frame.strata = full.strata;
+    frame.aovs = full.aovs;
+    return frame;
+}
+
+/// Write an image next to the target and rename it over it, so that viewers
+/// never see half of it.
+void write_image_atomically(const fs::path &filename, const Image3f &img) {
+    fs::path tmp_filename = filename;
+    tmp_filename.replace_filename(".tmp_" + filename.filename().string());
+    imwrite(tmp_filename, img);
+    fs::rename(tmp_filename, filename);
+}
+
+/// The frame's image denoised with its albedo and normal AOVs.
+Image3f denoise_frame(const Frame &frame, const RenderOptions &options) {
+    Timer timer;
+    tick(timer);
+    auto layer = [&](Aov aov) {
+        return std::get<Image3f>(aov_layer(aov, frame.aov_film, frame.film).image);
+    };
+    Image3f color_variance = layer(Aov::Variance);
+    Image1f variance(frame.width, frame.height);
+    for (size_t i = 0; i < variance.data.size(); i++) {
+        variance.data[i] = average(color_variance.data[i]);
+    }
+    DenoiseOptions denoise_options;
+    denoise_options.radius = options.denoise_radius;
+    Image3f img = denoise(frame.img, variance, layer(Aov::Albedo), layer(Aov::Normal),
+                         denoise_options);
+    std::cout << "Denoising took " << tick(timer) << " seconds." << std::endl;
+    return img;
+}
+
+/// Write the color and the AOVs the options ask for to one multi-part EXR file,
+/// before any denoising.
+void write_aovs(const Frame &frame, const RenderOptions &options, const fs::path &filename) {
+    std::vector<ImageLayer> layers;
+    layers.push_back({"color", frame.img});
+    for (int a = 0; a < num_aovs; a++) {
+        if (options.aovs[a]) {
+            layers.push_back(aov_layer(Aov(a), frame.aov_film, frame.film));
+        }
+    }
+    imwrite_layers(filename, layers);
+}
+
+/// The number of samples of each pixel of the frame, as an image (zero outside the
+/// crop window).
+Image3f sample_count_map(const Frame &frame) {
+    Image3f map(frame.width, frame.height);
+    const PartialRender &film = frame.film;
+    for (int y = film.crop.y0; y < film.crop.y1; y++) {
+        for (int x = film.crop.x0; x < film.crop.x1; x++) {
+            Real w = film.weight[film.index(x, y)];
+            map(x, y) = Vector3f{float(w), float(w), float(w)};
+        }
+    }
+    return map;
+}
+
+/// Write the image as it is now, e.g. to watch a progressive render.
+void write_intermediate(Frame &frame, const fs::path &filename) {
+    Image3f img;
+    {
+        std::unique_lock<std::shared_mutex> lock(frame.film_mutex);
+        img = frame.img;
+    }
+    write_image_atomically(filename, img);
+}
+
+/// Interactive mode: render the view coarse to fine -- 1/16 and 1/4 of the pixels,
+/// then the full image with passes of doubling samples per pixel up to the sample
+/// budget -- writing every stage to the frame buffer file. Returns as soon as
+/// restart is set, within a tile.
+void interactive_preview(const LoadedScene &loaded, const RenderOptions &options,
+                         Integrator integrator, const fs::path &framebuffer,
+                         const std::atomic<bool> &restart) {
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&] {
+        return std::chrono::duration<Real, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto stopped = [&] { return restart.load(std::memory_order_relaxed); };
+    PinnedPagesScope pinned(loaded.render_scene.pages.get());
+    Frame full = setup_frame(*loaded.render_scene.scene, options);
+    Image3f display(full.width, full.height);
+    for (int scale : {4, 2}) {
+        Frame frame = scaled_frame(full, scale);
+        frame.schedule = schedule_tiles(loaded, frame, options, integrator);
+        allocate_film(frame);
+        render_pass(loaded, frame, frame.sample_begin, frame.sample_begin + 1,
+                    integrator, options.max_depth, "1/" + std::to_string(scale * scale), stopped);
+        if (stopped()) {
+            return;
+        }
+        for (int y = 0; y < display.height; y++) {
+            for (int x = 0; x < display.width; x++) {
+                display(x, y) = frame.img(std::min(x / scale, frame.width - 1),
+                                          std::min(y / scale, frame.height - 1));
+            }
+        }
+        write_image_atomically(framebuffer, display);
+        std::cout << "1/" << scale * scale << " resolution at " << elapsed_ms() <<
+            " ms." << std::endl;
+    }
+    full.schedule = schedule_tiles(loaded, full, options, integrator);
+    allocate_film(full);
+    int pass_begin = full.sample_begin;
+    for (int pass = 0; pass_begin < full.sample_end; pass++) {
+        int pass_spp = std::max(pass_begin - full.sample_begin, 1);
+        int pass_end = int(std::min(int64_t(pass_begin) + pass_spp, int64_t(full.sample_end)));
+        render_pass(loaded, full, pass_begin, pass_end, integrator, options.max_depth,
+                    "pass " + std::to_string(pass), stopped);
+        if (stopped()) {
+            return;
+        }
+        pass_begin = pass_end;
+        write_image_atomically(framebuffer, full.img);
+        std::cout << pass_begin - full.sample_begin << " samples per pixel at " <<
+            elapsed_ms() << " ms." << std::endl;
+    }
+}
+
+/// pattern with its one integer conversion (%d with optional flags and width, as in
+/// frame_%04d.exr) replaced by frame; "%%" stands for '%'. The pattern comes from the
+/// command line, so only the conversion itself is handed to snprintf.
+std::string frame_filename(const std::string &pattern, int frame) {
+    const std::string flags = "-+ 0#";
+    std::string filename;
+    int conversions = 0;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') {
+            filename += pattern[i];
+            continue;
+        }
+        if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+            filename += '%';
+            i++;
+            continue;
+        }
+        size_t end = i + 1;
+        while (end < pattern.size() && flags.find(pattern[end]) != std::string::npos) {
+            end++;
+        }
+        size_t width_begin = end;
+        while (end < pattern.size() && std::isdigit((unsigned char)pattern[end])) {
+            end++;
+        }
+        if (end >= pattern.size() || pattern[end] != 'd' || end - width_begin > 2 ||
+                ++conversions > 1) {
+            break;
+        }
+        char number[128];
+        snprintf(number, sizeof(number), pattern.substr(i, end + 1 - i).c_str(), frame);
+        filename += number;
+        i = end;
+    }
+    if (conversions != 1) {
+        Error("Bad frame file name pattern " + pattern +
+              ": it needs exactly one %d, optionally with flags and width, e.g. frame_%04d.exr.");
+    }
+    return filename;
+}
+
+} // namespace
+
+RenderOptions parse_render_options(const std::vector<std::string> &params) {
+    RenderOptions options;
+    for (int i = 0; i < (int)params.size(); i++) {
+        if (params[i] == "-max_depth") {
+            options.max_depth = std::stoi(params[++i]);
+        } else if (params[i] == "-snapshot") {
+            options.snapshot = params[++i];
+        } else if (params[i] == "-out_of_core") {
+            options.page_file = params[++i];
+        } else if (params[i] == "-cache_mb") {
+            options.cache_mb = std::stoul(params[++i]);
+        } else if (params[i] == "-no_adaptive_tiles") {
+            options.adaptive_tiles = false;
+        } else if (params[i] == "-crop") {
+            options.crop.x0 = std::stoi(params[++i]);
+            options.crop.y0 = std::stoi(params[++i]);
+            options.crop.x1 = std::stoi(params[++i]);
+            options.crop.y1 = std::stoi(params[++i]);
+        } else if (params[i] == "-samples") {
+            options.sample_begin = std::stoi(params[++i]);
+            options.sample_end = std::stoi(params[++i]);
+        } else if (params[i] == "-partial") {
+            options.partial = params[++i];
+        } else if (params[i] == "-checkpoint") {
+            options.checkpoint = params[++i];
+        } else if (params[i] == "-checkpoint_interval") {
+            options.checkpoint_interval = std::stod(params[++i]);
+        } else if (params[i] == "-resume") {
+            options.resume = true;
+        } else if (params[i] == "-progressive") {
+            options.progressive = true;
+        } else if (params[i] == "-time") {
+            options.time_budget = std::stod(params[++i]);
+        } else if (params[i] == "-target_error") {
+            options.target_error = std::stod(params[++i]);
+        } else if (params[i] == "-intermediate") {
+            options.intermediate = params[++i];
+        } else if (params[i] == "-intermediate_interval") {
+            options.intermediate_interval = std::stod(params[++i]);
+        } else if (params[i] == "-adaptive") {
+            options.adaptive_threshold = std::stod(params[++i]);
+        } else if (params[i] == "-adaptive_min_spp") {
+            options.adaptive_min_spp = std::stoi(params[++i]);
+        } else if (params[i] == "-sample_map") {
+            options.sample_map = params[++i];
+        } else if (params[i] == "-sampler") {
+            options.sampler = parse_sampler_type(params[++i]);
+        } else if (params[i] == "-denoise") {
+            options.denoise = true;
+        } else if (params[i] == "-denoise_radius") {
+            options.denoise_radius = std::stoi(params[++i]);
+        } else if (params[i] == "-aovs") {
+            options.aov_file = params[++i];
+            options.aovs = parse_aovs(params[++i]);
+        } else if (params[i] == "-spp") {
+            options.spp = std::stoi(params[++i]);
+        } else if (params[i] == "-lookfrom") {
+            options.lookfrom = parse_vector3(params, i);
+        } else if (params[i] == "-lookat") {
+            options.lookat = parse_vector3(params, i);
+        } else if (params[i] == "-up") {
+            options.up = parse_vector3(params, i);
+        } else if (params[i] == "-fov") {
+            options.vfov = std::stod(params[++i]);
+        } else if (options.filename.empty()) {
+            options.filename = params[i];
+        }
+    }
+    if (!options.snapshot.empty() && !options.page_file.empty()) {
+        Error("-snapshot and -out_of_core cannot be combined.");
+    }
+    if (options.resume && options.checkpoint.empty()) {
+        Error("-resume needs a -checkpoint file.");
+    }
+    return options;
+}
+
+LoadedScene load_scene(const RenderOptions &options) {
+    LoadedScene loaded;
+    {
+        NumaInterleaveScope interleave;
+        loaded.render_scene = load_single_render_scene(options);
+    }
+    // Under NUMA replication every node other than node 0 renders from its own copy.
+    loaded.replicas = replicate_render_scene(loaded.render_scene);
+    return loaded;
+}
+
+Image3f render(const std::vector<std::string> &params, Integrator integrator) {
+    RenderOptions options = parse_render_options(params);
+    LoadedScene loaded = load_scene(options);
+    return render(loaded, options, integrator);
+}
+
+Image3f render(const LoadedScene &loaded, const RenderOptions &options, Integrator integrator,
+              const std::atomic<bool> *cancel) {
+    Timer timer;
+    tick(timer);
+    auto start = std::chrono::steady_clock::now();
+    const RenderScene &render_scene = loaded.render_scene;
+    PinnedPagesScope pinned(render_scene.pages.get());
+    Frame frame = setup_frame(*render_scene.scene, options);
+    frame.schedule = schedule_tiles(loaded, frame, options, integrator);
+    allocate_film(frame);
+    std::cout << "Tile schedule ready. Took " << tick(timer) << " seconds." << std::endl;
+    if (options.resume) {
+        resume_from_checkpoint(frame, options.checkpoint);
+    }
+    std::optional<Checkpointer> checkpointer;
+    if (!options.checkpoint.empty()) {
+        checkpointer.emplace(options.checkpoint, options.checkpoint_interval,
+                             frame.film, frame.film_mutex);
+    }
+
+    // Progressive rendering: passes over the whole image, each adding as many
+    // samples per pixel as all earlier passes together (1, 1, 2, 4, ...), until
+    // the sample budget, the time budget or the noise target is reached.
+    // Otherwise a single pass renders all the samples.
+    bool progressive = options.progressive || options.time_budget > 0 ||
+        options.target_error > 0;
+    auto elapsed = [&] {
+        return std::chrono::duration<Real>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto out_of_time = [&] {
+        return options.time_budget > 0 && elapsed() >= options.time_budget;
+    };
+    std::mutex intermediate_mutex;
+    Real next_intermediate = options.intermediate_interval;
+
+    int pass_begin = frame.sample_begin;
+    for (int pass = 0; pass_begin < frame.sample_end; pass++) {
+        int pass_end = frame.sample_end;
+        if (progressive) {
+            int64_t pass_spp = std::max(pass_begin - frame.sample_begin, 1);
+            if (options.time_budget > 0 && pass > 0) {
+                // Shrink the pass to what the time left allows at the speed so far,
+                // so that it likely ends before the deadline with the same number of
+                // samples in every pixel.
+                Real seconds_per_spp = elapsed() / (pass_begin - frame.sample_begin);
+                Real time_left = options.time_budget - elapsed();
+                pass_spp = std::clamp(int64_t(time_left / seconds_per_spp), int64_t(1), pass_spp);
+            }
+            pass_end = int(std::min(int64_t(pass_begin) + pass_spp, int64_t(frame.sample_end)));
+        }
+        // Past the deadline the rest of the pass is skipped; its pixels keep
+        // fewer samples, which the film's per-pixel weights account for. The
+        // first pass always completes, so that every pixel has a sample.
+        auto skip_tile = [&] {
+            return (cancel && cancel->load(std::memory_order_relaxed)) ||
+                (pass > 0 && out_of_time());
+        };
+        auto after_tile = [&] {
+            std::unique_lock<std::mutex> lock(intermediate_mutex, std::try_to_lock);
+            if (lock.owns_lock() && elapsed() >= next_intermediate) {
+                next_intermediate = elapsed() + options.intermediate_interval;
+                write_intermediate(frame, options.intermediate);
+            }
+        };
+        render_pass(loaded, frame, pass_begin, pass_end, integrator, options.max_depth,
+                    progressive ? "pass " + std::to_string(pass) : "render", skip_tile,
+                    options.intermediate.empty() ? std::function<void()>() : after_tile);
+        if (cancel && cancel->load()) {
+            break;
+        }
+        pass_begin = pass_end;
+        if (!progressive || pass_begin >= frame.sample_end) {
+            break;
+        }
+        if (out_of_time()) {
+            std::cout << "Time budget of " << options.time_budget << " seconds reached after " <<
+                pass_begin - frame.sample_begin << " samples per pixel." << std::endl;
+            break;
+        }
+        if (options.target_error > 0) {
+            Real error = estimate_relative_error(frame.film);
+            std::cout << "Relative error after " << pass_begin - frame.sample_begin <<
+                " samples per pixel: " << error << std::endl;
+            if (error <= options.target_error) {
+                break;
+            }
+        }
+    }
+    if (checkpointer) {
+        // also after a cancel: the finished tiles need not be rendered again
+        checkpointer->finish();
+    }
+    if (cancel && cancel->load()) {
+        std::cout << "Render cancelled." << std::endl;
+        return frame.img;
+    }
+    std::cout << "Parallel Raytracing takes: " << tick(timer) << " seconds.\n ";
+    if (!options.aov_file.empty()) {
+        write_aovs(frame, options, options.aov_file);
+        std::cout << "AOVs written to " << options.aov_file << "." << std::endl;
+    }
+    if (options.denoise) {
+        frame.img = denoise_frame(frame, options);
+    }
+    if (render_scene.pages) {
+        render_scene.pages->print_stats(std::cout);
+    }
+    if (!options.partial.empty()) {
+        write_partial_render(options.partial, frame.film);
+        std::cout << "Partial render written to " << options.partial << "." << std::endl;
+    }
+    if (frame.adaptive_threshold > 0) {
+        Real samples = std::accumulate(frame.film.weight.begin(), frame.film.weight.end(), Real(0));
+        std::cout << "Adaptive sampling: " << samples / frame.film.weight.size() <<
+            " samples per pixel on average, at most " << pass_begin - frame.sample_begin <<
+            "." << std::endl;
+    }
+    if (!options.sample_map.empty()) {
+        write_image_atomically(options.sample_map, sample_count_map(frame));
+        std::cout << "Sample count map written to " << options.sample_map << "." << std::endl;
+    }
+    return frame.img;
+}
+
+Integrator find_integrator(const std::string &name) {
+    if (name == "4_1" || name == "4_2") {
+        return BVH_PixelColor;
+    } else if (name == "4_3") {
+        return radiance;
+    } else if (name == "4_4") {
+        return radiance_iterative;
+    }
+    Error("Unknown integrator " + name + " (4_1, 4_2, 4_3 or 4_4).");
+}
+
+void render_batch(const std::vector<std::string> &params) {
+    // Batch options; everything else applies to every frame.
+    std::string cameras_file;
+    std::string output_pattern = "frame_%04d.exr";
+    Integrator integrator = radiance;
+    std::vector<std::string> base_params;
+    for (size_t i = 0; i < params.size(); i++) {
+        if (params[i] == "-cameras" && i + 1 < params.size()) {
+            cameras_file = params[++i];
+        } else if (params[i] == "-output" && i + 1 < params.size()) {
+            output_pattern = params[++i];
+        } else if (params[i] == "-integrator" && i + 1 < params.size()) {
+            integrator = find_integrator(params[++i]);
+        } else {
+            base_params.push_back(params[i]);
+        }
+    }
+    RenderOptions base_options = parse_render_options(base_params);
+    if (!base_options.partial.empty() || !base_options.checkpoint.empty()) {
+        Error("Batch renders do not write partial renders or checkpoints.");
+    }
+    frame_filename(output_pattern, 0);  // check the pattern before loading the scene
+    LoadedScene loaded = load_scene(base_options);
+    const Scene &scene = *loaded.render_scene.scene;
+
+    // One set of options per frame: the base options plus the frame's own.
+    std::vector<RenderOptions> frame_options;
+    if (!cameras_file.empty()) {
+        std::ifstream ifs(cameras_file);
+        if (!ifs.is_open()) {
+            Error("Unable to read " + cameras_file);
+        }
+        std::string line;
+        while (std::getline(ifs, line)) {
+            std::vector<std::string> frame_params = base_params;
+            std::istringstream iss(line);
+            std::string word;
+            while (iss >> word) {
+                if (word[0] == '#') {
+                    break;
+                }
+                frame_params.push_back(word);
+            }
+            if (frame_params.size() > base_params.size()) {
+                frame_options.push_back(parse_render_options(frame_params));
+            }
+        }
+    } else {
+        for (const Camera &camera : scene.cameras) {
+            RenderOptions options = base_options;
+            options.lookfrom = camera.origin;
+            options.lookat = camera.lookat;
+            options.up = camera.up;
+            options.vfov = camera.vfov;
+            frame_options.push_back(options);
+        }
+    }
+    if (frame_options.empty()) {
+        Error("No frames to render: give -cameras or a scene with <sensor> elements.");
+    }
+    for (const RenderOptions &options : frame_options) {
+        if (!options.aov_file.empty()) {
+            frame_filename(options.aov_file, 0);
+        }
+    }
+
+    Timer timer;
+    tick(timer);
+    std::vector<std::unique_ptr<Frame>> frames;
+    // (frame, tile) pairs, frame by frame: there is no barrier between frames, so the
+    // tiles of one frame and the next are rendered side by side and no core idles
+    // while a frame finishes. Frames still complete roughly in order, so each can be
+    // written (and its memory released) as soon as its last tile is done.
+    std::vector<std::pair<int, int>> schedule;
+    uint64_t total_pixels = 0;
+    for (const RenderOptions &options : frame_options) {
+        int f = (int)frames.size();
+        frames.push_back(std::make_unique<Frame>(setup_frame(scene, options)));
+        Frame &frame = *frames.back();
+        frame.schedule = schedule_tiles(loaded, frame, options, integrator);
+        frame.tiles_left = (int)frame.schedule.size();
+        for (int t = 0; t < (int)frame.schedule.size(); t++) {
+            schedule.push_back({f, t});
+        }
+        total_pixels += frame.crop.num_pixels();
+    }
+    std::cout << "Batch of " << frames.size() << " frames, " << schedule.size() <<
+        " tiles. Scheduling took " << tick(timer) << " seconds." << std::endl;
+
+    PinnedPagesScope pinned(loaded.render_scene.pages.get());
+    ProgressReporter reporter(total_pixels, "batch");
+    std::atomic<size_t> next_tile{0};
+    parallel_for([&](int64_t) {
+        auto [f, t] = schedule[next_tile++];
+        Frame &frame = *frames[f];
+        std::call_once(frame.allocated, [&] { allocate_film(frame); });
+        render_tile(loaded, frame, frame.schedule[t], frame.sample_begin, frame.sample_end,
+                    integrator, frame_options[f].max_depth, reporter);
+        if (--frame.tiles_left == 0) {
+            const RenderOptions &options = frame_options[f];
+            if (!options.aov_file.empty()) {
+                // -aovs takes a frame file name pattern here too
+                write_aovs(frame, options, frame_filename(options.aov_file, f));
+            }
+            if (options.denoise) {
+                frame.img = denoise_frame(frame, options);
+            }
+            imwrite(frame_filename(output_pattern, f), frame.img);
+            // release the pixels; "= {}" would keep the vector's capacity
+            frame.img.data.clear();
+            frame.img.data.shrink_to_fit();
+            frame.film = PartialRender();
+            frame.aov_film = AovFilm();
+        }
+    }, schedule.size());
+    reporter.done();
+    std::cout << "Batch rendering takes: " << tick(timer) << " seconds." << std::endl;
+}
+
+void render_interactive(const std::vector<std::string> &params) {
+    std::string framebuffer = "preview.pfm";
+    Integrator integrator = radiance;
+    std::vector<std::string> base_params;
+    for (size_t i = 0; i < params.size(); i++) {
+        if (params[i] == "-framebuffer" && i + 1 < params.size()) {
+            framebuffer = params[++i];
+        } else if (params[i] == "-integrator" && i + 1 < params.size()) {
+            integrator = find_integrator(params[++i]);
+        } else {
+            base_params.push_back(params[i]);
+        }
+    }
+    RenderOptions base_options = parse_render_options(base_params);
+    LoadedScene loaded = load_scene(base_options);
+
+    // Views requested on stdin. Only the latest one matters: a new request stops
+    // the render of the previous one.
+    std::mutex request_mutex;
+    std::condition_variable request_condition;
+    std::optional<RenderOptions> request = base_options;
+    bool quit = false;
+    std::atomic<bool> restart{false};
+    std::thread reader([&] {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            std::vector<std::string> view_params = base_params;
+            std::istringstream iss(line);
+            std::string word;
+            while (iss >> word) {
+                view_params.push_back(word);
+            }
+            if (view_params.size() == base_params.size()) {
+                continue;
+            }
+            if (view_params[base_params.size()] == "quit") {
+                break;
+            }
+            try {
+                RenderOptions options = parse_render_options(view_params);
+                std::lock_guard<std::mutex> lock(request_mutex);
+                request = options;
+                restart = true;
+            } catch (const std::exception &e) {
+                std::cerr << "Ignored view: " << e.what() << std::endl;
+                continue;
+            }
+            request_condition.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(request_mutex);
+        quit = true;
+        restart = true;
+        request_condition.notify_one();
+    });
+
+    // parallel_for is started from the main thread, so the views are rendered here.
+    for (;;) {
+        RenderOptions options;
+        {
+            std::unique_lock<std::mutex> lock(request_mutex);
+            request_condition.wait(lock, [&] { return quit || request; });
+            if (quit) {
+                break;
+            }
+            options = *request;
+            request.reset();
+            restart = false;
+        }
+        // Every view is rendered whole; the cost pre-pass would only add latency.
+        options.crop = Tile{0, 0, 0, 0};
+        options.adaptive_tiles = false;
+        options.denoise = false;
+        options.aovs.reset();
+        options.aov_file.clear();
+        try {
+            interactive_preview(loaded, options, integrator, framebuffer, restart);
+        } catch (const std::exception &e) {
+            std::cerr << "Preview failed: " << e.what() << std::endl;
+        }
+    }
+    reader.join();
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "aov.h"
+#include "compute_radiance.h"
+#include "image.h"
+#include "tile_scheduler.h"
+
+#include "sampler.h"
+#include "scene_snapshot.h"
+
+#include <atomic>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// Command line options shared by the hw4 renderers.
+struct RenderOptions {
+    std::string filename;
+    std::string snapshot;
+    int max_depth = MAX_DEPTH;
+    // Out-of-core mode: page file for the bottom-level subtrees and the cache budget.
+    std::string page_file;
+    size_t cache_mb = 1024;
+    // Estimate tile costs with a sparse pre-pass and split the expensive tiles.
+    bool adaptive_tiles = true;
+    // Distributed rendering: the share of the image this process renders, in output
+    // image coordinates (empty: the whole image), and its samples [sample_begin,
+    // sample_end) (sample_end < 0: up to the scene's samples per pixel).
+    Tile crop = {0, 0, 0, 0};
+    int sample_begin = 0;
+    int sample_end = -1;
+    // Write the accumulation buffers of the share here, for "-hw merge".
+    std::string partial;
+    // Save the accumulation buffers to this partial render file every
+    // checkpoint_interval seconds; with resume, start from the pixels it holds.
+    std::string checkpoint;
+    Real checkpoint_interval = 300;
+    bool resume = false;
+    // Progressive rendering: passes of doubling samples per pixel over the whole
+    // image, stopping after time_budget seconds (> 0) or once the mean relative
+    // error of the pixels is below target_error (> 0). The image so far is written
+    // to intermediate every intermediate_interval seconds.
+    bool progressive = false;
+    Real time_budget = 0;
+    Real target_error = 0;
+    std::string intermediate;
+    Real intermediate_interval = 30;
+    // Adaptive sampling: after adaptive_min_spp samples, a pixel gets more only
+    // while the relative standard error of its estimate exceeds adaptive_threshold
+    // (> 0). The samples of each pixel can be written to sample_map.
+    Real adaptive_threshold = 0;
+    int adaptive_min_spp = 16;
+    std::string sample_map;
+    // Where the random numbers of the samples come from.
+    SamplerType sampler = SamplerType::Independent;
+    // Denoise the image with first-hit albedo and normal buffers, using a filter
+    // window of 2 denoise_radius + 1 pixels.
+    bool denoise = false;
+    int denoise_radius = 7;
+    // Collect these AOVs during the render and write them, after the color, to
+    // aov_file as one multi-part EXR.
+    AovSet aovs;
+    std::string aov_file;
+    // Overrides of the scene's samples per pixel (if > 0) and camera.
+    int spp = -1;
+    std::optional<Vector3> lookfrom, lookat, up;
+    std::optional<Real> vfov;
+};
+
+RenderOptions parse_render_options(const std::vector<std::string> &params);
+
+/// A path tracer entry point: the radiance arriving along localRay.
+using Integrator = Vector3 (*)(Scene&, ray&, BVH_node&, pcg32_state&, unsigned int);
+
+/// A scene ready to render, with its per-node copies under NUMA replication.
+struct LoadedScene {
+    RenderScene render_scene;
+    std::vector<RenderScene> replicas;
+};
+
+/// Load the scene options names (from options.snapshot or options.filename).
+LoadedScene load_scene(const RenderOptions &options);
+
+/// Load the scene named by params and render it with integrator.
+Image3f render(const std::vector<std::string> &params, Integrator integrator);
+
+/// Render a loaded scene. Only the per-image options are used (the share of the
+/// image, samples, camera, max depth and partial output); the scene is not changed,
+/// so it can be rendered again. Once *cancel becomes true the remaining tiles are
+/// skipped and the image returned is incomplete.
+Image3f render(const LoadedScene &loaded, const RenderOptions &options, Integrator integrator,
+              const std::atomic<bool> *cancel = nullptr);
+
+/// The hw4 integrator called name: 4_1, 4_2, 4_3 or 4_4.
+Integrator find_integrator(const std::string &name);
+
+/// Command line entry: "-hw batch <scene file> [options]". Renders many frames of
+/// one loaded scene, one per line of "-cameras <file>" (each line holds the
+/// per-image options of that frame, e.g. "-lookfrom x y z -lookat x y z -fov 40";
+/// # starts a comment), or else one per <sensor> of the scene file.
+/// Other options: -integrator 4_1|4_2|4_3|4_4 (default 4_3) and
+/// -output <printf pattern of the frame number> (default frame_%04d.exr); the
+/// remaining options apply to every frame (the file of -aovs is a pattern too).
+/// The tiles of all frames are rendered as one stream, and each frame is written
+/// as soon as its last tile is done.
+void render_batch(const std::vector<std::string> &params);
+
+/// Command line entry: "-hw interactive <scene file> [options]", for look-dev.
+/// Loads the scene once and renders views requested on stdin, one per line: the
+/// per-image options of the view (e.g. "-lookfrom x y z -lookat x y z -fov 40")
+/// on top of the command line ones; "quit" or the end of the input stops.
+/// A view is rendered at 1/16 and 1/4 of the pixels, then in full with passes of
+/// doubling samples per pixel up to -spp (default: the scene's), and every stage
+/// is written to "-framebuffer <file>" (default preview.pfm; any format imwrite
+/// knows; put it in /dev/shm to keep it in memory). A new view stops the
+/// current one within a tile. Other options: -integrator 4_1|4_2|4_3|4_4.
+void render_interactive(const std::vector<std::string> &params);
@@ -0,0 +1,376 @@
+#include "render_server.h"
+#include "flexception.h"
+#include "render.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifndef _WINDOWS
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WINDOWS
+
+namespace {
+
+/// One client. Replies come from the client's own thread and from the render loop,
+/// so writes are serialized.
+class Connection {
+public:
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() {
+        close(fd);
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    void send_line(const std::string &line) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        std::string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                // the client is gone; its jobs still run to completion
+                return;
+            }
+            sent += n;
+        }
+    }
+
+    /// The next request line; false once the client has closed the connection.
+    bool read_line(std::string &line) {
+        for (;;) {
+            size_t end = buffer.find('\n');
+            if (end != std::string::npos) {
+                line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
+            }
+            char data[4096];
+            ssize_t n = ::recv(fd, data, sizeof(data), 0);
+            if (n <= 0) {
+                return false;
+            }
+            buffer.append(data, n);
+        }
+    }
+
+    /// Wake up a read_line blocked on this connection.
+    void hang_up() {
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+private:
+    int fd;
+    std::string buffer;
+    std::mutex write_mutex;
+};
+
+struct Job {
+    uint64_t id;
+    std::string output;
+    Integrator integrator;
+    RenderOptions options;
+    std::atomic<bool> cancel{false};
+    std::shared_ptr<Connection> client;
+};
+
+std::vector<std::string> split_words(const std::string &line) {
+    std::vector<std::string> words;
+    std::istringstream iss(line);
+    std::string word;
+    while (iss >> word) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+class RenderServer {
+public:
+    /// Serve the requests of one client until it disconnects (one thread per client).
+    void handle_client(std::shared_ptr<Connection> client);
+    /// Accept clients until shutdown.
+    void accept_clients(int listen_fd);
+    /// Run the queued jobs until shutdown. Must be called on the main thread, which
+    /// is the one allowed to start parallel_for loops from outside the pool.
+    void run_jobs(const LoadedScene &loaded);
+    /// Disconnect all clients and wait for their threads.
+    void close_clients();
+
+private:
+    std::shared_ptr<Job> parse_job(const std::vector<std::string> &words);
+    void cancel_job(Connection &client, uint64_t id);
+    void shutdown();
+    /// Join the threads of clients that have disconnected. Called with mutex held.
+    void reap_clients();
+
+    std::mutex mutex;
+    std::condition_variable job_condition;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::shared_ptr<Job> running;
+    bool stopping = false;
+    uint64_t next_id = 1;
+    std::vector<std::weak_ptr<Connection>> clients;
+    struct ClientThread {
+        std::thread thread;
+        // set by the thread once it is done with its client
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<ClientThread> client_threads;
+};
+
+std::shared_ptr<Job> RenderServer::parse_job(const std::vector<std::string> &words) {
+    if (words.size() < 2) {
+        Error("Usage: render <output.exr> [options]");
+    }
+    auto job = std::make_shared<Job>();
+    job->output = words[1];
+    job->integrator = radiance;
+    std::vector<std::string> params;
+    for (size_t i = 2; i < words.size(); i++) {
+        if (words[i] == "-integrator" && i + 1 < words.size()) {
+            job->integrator = find_integrator(words[++i]);
+        } else {
+            params.push_back(words[i]);
+        }
+    }
+    job->options = parse_render_options(params);
+    if (!job->options.filename.empty() || !job->options.snapshot.empty() ||
+            !job->options.page_file.empty()) {
+        Error("The scene is fixed when the server starts.");
+    }
+    return job;
+}
+
+void RenderServer::cancel_job(Connection &client, uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+        if ((*it)->id == id) {
+            client.send_line("ok");
+            (*it)->client->send_line("cancelled " + std::to_string(id));
+            queue.erase(it);
+            return;
+        }
+    }
+    if (running && running->id == id) {
+        // run_jobs reports it once the render has stopped
+        running->cancel = true;
+        client.send_line("ok");
+        return;
+    }
+    client.send_line("unknown " + std::to_string(id));
+}
+
+void RenderServer::shutdown() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    for (const std::shared_ptr<Job> &job : queue) {
+        job->client->send_line("cancelled " + std::to_string(job->id));
+    }
+    queue.clear();
+    if (running) {
+        running->cancel = true;
+    }
+    job_condition.notify_all();
+}
+
+void RenderServer::handle_client(std::shared_ptr<Connection> client) {
+    std::string line;
+    while (client->read_line(line)) {
+        std::vector<std::string> words = split_words(line);
+        if (words.empty()) {
+            continue;
+        }
+        try {
+            if (words[0] == "render") {
+                std::shared_ptr<Job> job = parse_job(words);
+                job->client = client;
+                // Reply while holding the lock, so that "queued" always comes
+                // before the job's final reply.
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) {
+                    Error("The server is shutting down.");
+                }
+                job->id = next_id++;
+                queue.push_back(job);
+                client->send_line("queued " + std::to_string(job->id));
+                job_condition.notify_all();
+            } else if (words[0] == "cancel" && words.size() == 2) {
+                cancel_job(*client, std::stoull(words[1]));
+            } else if (words[0] == "status") {
+                std::lock_guard<std::mutex> lock(mutex);
+                client->send_line("status " +
+                    (running ? std::to_string(running->id) : std::string("-")) + " " +
+                    std::to_string(queue.size()));
+            } else if (words[0] == "shutdown") {
+                client->send_line("ok");
+                shutdown();
+            } else {
+                client->send_line("error unknown request: " + line);
+            }
+        } catch (const std::exception &e) {
+            client->send_line(std::string("error ") + e.what());
+        }
+    }
+}
+
+void RenderServer::accept_clients(int listen_fd) {
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                return;
+            }
+            reap_clients();
+        }
+        // wake up now and then to notice a shutdown
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        auto client = std::make_shared<Connection>(fd);
+        std::lock_guard<std::mutex> lock(mutex);
+        clients.push_back(client);
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        std::thread thread([this, client, done] {
+            handle_client(client);
+            *done = true;
+        });
+        client_threads.push_back(ClientThread{std::move(thread), done});
+    }
+}
+
+void RenderServer::reap_clients() {
+    for (size_t i = 0; i < client_threads.size();) {
+        if (*client_threads[i].done) {
+            // about to exit, and it does not take the mutex anymore
+            client_threads[i].thread.join();
+            client_threads[i] = std::move(client_threads.back());
+            client_threads.pop_back();
+        } else {
+            i++;
+        }
+    }
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+        [](const std::weak_ptr<Connection> &client) { return client.expired(); }), clients.end());
+}
+
+void RenderServer::run_jobs(const LoadedScene &loaded) {
+    for (;;) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_condition.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+            running = job;
+        }
+        std::string id = std::to_string(job->id);
+        std::string reply;
+        try {
+            std::cout << "Job " << id << ": rendering " << job->output << std::endl;
+            Timer timer;
+            tick(timer);
+            Image3f img = render(loaded, job->options, job->integrator, &job->cancel);
+            if (job->cancel) {
+                reply = "cancelled " + id;
+            } else {
+                imwrite(job->output, img);
+                reply = "done " + id + " " + std::to_string(tick(timer));
+            }
+        } catch (const std::exception &e) {
+            reply = "failed " + id + " " + e.what();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = nullptr;
+        }
+        job->client->send_line(reply);
+    }
+}
+
+void RenderServer::close_clients() {
+    std::vector<ClientThread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::weak_ptr<Connection> &weak : clients) {
+            if (std::shared_ptr<Connection> client = weak.lock()) {
+                client->hang_up();
+            }
+        }
+        threads.swap(client_threads);
+    }
+    for (ClientThread &thread : threads) {
+        thread.thread.join();
+    }
+}
+
+} // namespace
+
+void serve_renders(const std::vector<std::string> &params) {
+    if (params.size() < 2) {
+        Error("Usage: -hw serve <socket path> <scene file> [scene options]");
+    }
+    std::string socket_path = params[0];
+    RenderOptions options =
+        parse_render_options(std::vector<std::string>(params.begin() + 1, params.end()));
+    LoadedScene loaded = load_scene(options);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        Error("Socket path is too long: " + socket_path);
+    }
+    std::copy(socket_path.begin(), socket_path.end(), addr.sun_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        Error("Unable to create a socket.");
+    }
+    // a socket file left behind by an earlier server
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, (const sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 16) != 0) {
+        close(listen_fd);
+        Error("Unable to listen on " + socket_path);
+    }
+    std::cout << "Serving renders on " << socket_path << "." << std::endl;
+
+    RenderServer server;
+    std::thread acceptor([&] { server.accept_clients(listen_fd); });
+    server.run_jobs(loaded);
+    acceptor.join();
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    server.close_clients();
+    std::cout << "Render server stopped." << std::endl;
+}
+
+#else
+
+void serve_renders(const std::vector<std::string> &params) {
+    Error("The render server needs Unix domain sockets, which this platform lacks.");
+}
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/// Command line entry: "-hw serve <socket path> <scene file> [scene options]".
+/// Loads the scene once (the scene options are those of the hw4 renderers, e.g.
+/// -snapshot or -out_of_core) and serves render jobs on a Unix domain socket until
+/// told to shut down. POSIX only.
+///
+/// The protocol is line based. Each request line gets one reply line right away;
+/// render jobs get a second one when they end.
+///   render <output.exr> [options]  ->  queued <id>
+///       and later                  ->  done <id> <seconds> | cancelled <id> | failed <id> <error>
+///     options: -integrator 4_1|4_2|4_3|4_4 (default 4_3), -spp n, -max_depth n,
+///              -crop x0 y0 x1 y1, -samples b e, -partial <file>,
+///              -lookfrom x y z, -lookat x y z, -up x y z, -fov degrees
+///              -time seconds, -target_error e (progressive rendering)
+///              -adaptive e, -adaptive_min_spp n (adaptive sampling),
+///              -sampler independent|stratified|halton|sobol, -denoise,
+///              -aovs <file.exr> depth,normal,albedo,material_id,direct,indirect,samples,variance
+///   cancel <id>                    ->  ok | unknown <id>
+///   status                         ->  status <running id or -> <number of queued jobs>
+///   shutdown                       ->  ok (queued jobs are cancelled, the running one stops)
+/// Jobs run one at a time, in order, each using the whole thread pool.
+void serve_renders(const std::vector<std::string> &params);
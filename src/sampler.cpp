@@ -0,0 +1,189 @@
+#include "sampler.h"
+#include "flexception.h"
+
+#include <vector>
+
+namespace {
+
+// Dimensions beyond these come from the independent stream.
+constexpr int c_max_halton_dimension = 256;
+constexpr int c_max_sobol_dimension = 1 << 16;
+
+constexpr double c_one_minus_epsilon = 0x1.fffffffffffffp-1;
+
+uint32_t reverse_bits32(uint32_t v) {
+    v = (v << 16) | (v >> 16);
+    v = ((v & 0x00ff00ff) << 8) | ((v & 0xff00ff00) >> 8);
+    v = ((v & 0x0f0f0f0f) << 4) | ((v & 0xf0f0f0f0) >> 4);
+    v = ((v & 0x33333333) << 2) | ((v & 0xcccccccc) >> 2);
+    v = ((v & 0x55555555) << 1) | ((v & 0xaaaaaaaa) >> 1);
+    return v;
+}
+
+/// A random permutation of [0, n), n <= 2^32, evaluated one element at a time.
+/// Kensler, "Correlated Multi-Jittered Sampling", 2013: every step is a bijection
+/// on the bits below the mask, and cycle walking skips the values >= n.
+uint32_t permutation_element(uint32_t i, uint32_t n, uint32_t p) {
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + p) % n;
+}
+
+/// Owen scrambling of a base-2 fraction stored in the bits of v (most significant
+/// bit first): each bit is flipped depending on the seed and the bits above it.
+/// Burley, "Practical Hash-based Owen Scrambling", 2020 -- the hash only lets a bit
+/// depend on the lower bits, so it is applied to the reversed bits.
+uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+    v = reverse_bits32(v);
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return reverse_bits32(v);
+}
+
+/// The first two dimensions of the Sobol sequence, as 32-bit fractions. The first is
+/// the van der Corput sequence; the generator matrix of the second is Pascal's
+/// triangle mod 2.
+uint32_t sobol_sample(uint32_t index, int dimension) {
+    if (dimension == 0) {
+        return reverse_bits32(index);
+    }
+    uint32_t v = 0;
+    for (uint32_t direction = 0x80000000u; index != 0; index >>= 1, direction ^= direction >> 1) {
+        if (index & 1) {
+            v ^= direction;
+        }
+    }
+    return v;
+}
+
+const std::vector<int> &primes() {
+    static const std::vector<int> table = [] {
+        std::vector<int> p;
+        for (int n = 2; (int)p.size() < c_max_halton_dimension; n++) {
+            bool prime = true;
+            for (int q : p) {
+                if (q * q > n) {
+                    break;
+                }
+                if (n % q == 0) {
+                    prime = false;
+                    break;
+                }
+            }
+            if (prime) {
+                p.push_back(n);
+            }
+        }
+        return p;
+    }();
+    return table;
+}
+
+/// The radical inverse of index in the given base with the digits Owen scrambled:
+/// each digit is permuted depending on the seed and the digits before it. Digits
+/// are produced until they no longer change the double, so the zero digits past the
+/// end of index are scrambled too.
+double owen_scrambled_radical_inverse(uint64_t index, int base, uint64_t seed) {
+    double inv_base = 1.0 / base;
+    double inv_base_m = 1;
+    uint64_t reversed = 0;
+    for (int digit_index = 0; 1 - (base - 1) * inv_base_m < 1; digit_index++) {
+        uint64_t next = index / base;
+        int digit = int(index - next * base);
+        uint32_t digit_seed = uint32_t(mix_bits(seed ^ (reversed * 0x9e3779b97f4a7c15ULL) ^ digit_index));
+        digit = (int)permutation_element(digit, base, digit_seed);
+        reversed = reversed * base + digit;
+        inv_base_m *= inv_base;
+        index = next;
+    }
+    return std::min(reversed * inv_base_m, c_one_minus_epsilon);
+}
+
+} // namespace
+
+SamplerType parse_sampler_type(const std::string &name) {
+    if (name == "independent") {
+        return SamplerType::Independent;
+    } else if (name == "stratified") {
+        return SamplerType::Stratified;
+    } else if (name == "halton") {
+        return SamplerType::Halton;
+    } else if (name == "sobol") {
+        return SamplerType::Sobol;
+    }
+    Error("Unknown sampler " + name + " (independent, stratified, halton or sobol).");
+}
+
+Sampler::Sampler(SamplerType type, int samples_per_pixel, uint64_t seed) :
+        type(type), samples_per_pixel(std::max(samples_per_pixel, 1)), seed(seed) {}
+
+void Sampler::start_sample(uint64_t pixel_index, int sample_index, const pcg32_state &rng) {
+    this->pixel_index = pixel_index;
+    this->sample_index = sample_index;
+    this->rng = rng;
+    this->rng.sampler = nullptr;
+    dimension = 0;
+}
+
+double Sampler::next_1d() {
+    int d = dimension++;
+    // One hash per pixel and dimension seeds the scrambling.
+    uint64_t hash = mix_bits(seed ^ mix_bits(pixel_index ^ (uint64_t(d) << 40)));
+    switch (type) {
+    case SamplerType::Stratified: {
+        uint32_t stratum = permutation_element(
+            uint32_t(sample_index % samples_per_pixel), uint32_t(samples_per_pixel), uint32_t(hash));
+        return std::min((stratum + next_pcg32_real<double>(rng)) / samples_per_pixel,
+                        c_one_minus_epsilon);
+    }
+    case SamplerType::Halton:
+        if (d < c_max_halton_dimension) {
+            return owen_scrambled_radical_inverse(sample_index, primes()[d], hash);
+        }
+        break;
+    case SamplerType::Sobol:
+        if (d < c_max_sobol_dimension) {
+            // Both dimensions of a pair use the same shuffled index, so that each
+            // pair is a 2D (0,2)-sequence; the pairs are decorrelated by shuffling.
+            uint64_t pair_hash = mix_bits(seed ^ mix_bits(pixel_index ^ (uint64_t(d / 2) << 40)));
+            uint32_t index = owen_scramble(uint32_t(sample_index), uint32_t(pair_hash >> 32));
+            uint32_t v = owen_scramble(sobol_sample(index, d % 2), uint32_t(hash));
+            return std::min(v * 0x1p-32, c_one_minus_epsilon);
+        }
+        break;
+    case SamplerType::Independent:
+        break;
+    }
+    return next_pcg32_real<double>(rng);
+}
+
+double next_sampler_dimension(Sampler &sampler) {
+    return sampler.next_1d();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "pcg.h"
+
+#include <string>
+
+/// How the random numbers of a pixel sample are generated.
+///   Independent: the sample's own PCG stream (init_sample_pcg32).
+///   Stratified:  every dimension is split into one stratum per sample of the pixel,
+///                shuffled independently per dimension, and jittered within it.
+///   Halton:      the Halton sequence (dimension d in the d-th prime base), Owen
+///                scrambled per pixel.
+///   Sobol:       pairs of dimensions take the 2D Sobol (0,2)-sequence, with the
+///                sample order shuffled per pair and Owen scrambled per pixel.
+enum class SamplerType {
+    Independent,
+    Stratified,
+    Halton,
+    Sobol
+};
+
+SamplerType parse_sampler_type(const std::string &name);
+
+/// Per-dimension sample values for one sample of one pixel at a time.
+/// Attach it to the sample's pcg32 stream (rng.sampler) and every next_pcg32_real
+/// of the integrator draws the next dimension; start_sample resets the dimension.
+/// Like the independent streams, the values only depend on the pixel, the sample
+/// index and the dimension, so a render does not depend on tiles or threads.
+/// Samples [0, samples_per_pixel) of a pixel are well distributed together, so
+/// samples_per_pixel is that of the whole render, however it is split up;
+/// stratification works best when it is a power of two (Sobol) or when all of
+/// them are rendered.
+class Sampler {
+public:
+    Sampler(SamplerType type, int samples_per_pixel, uint64_t seed = 0x5a3b1e5d0c4f2a17ULL);
+
+    /// Start sample sample_index of pixel pixel_index (y * width + x). rng is the
+    /// sample's independent stream, for dimensions the sampler has no values for.
+    void start_sample(uint64_t pixel_index, int sample_index, const pcg32_state &rng);
+
+    /// The next dimension of the current sample, in [0, 1).
+    double next_1d();
+
+private:
+    SamplerType type;
+    int samples_per_pixel;
+    uint64_t seed;
+    uint64_t pixel_index = 0;
+    int sample_index = 0;
+    int dimension = 0;
+    pcg32_state rng;
+};
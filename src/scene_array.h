@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/// The storage of a large Scene array (shapes, mesh attributes). It either owns its
+/// elements like a std::vector or views count elements owned elsewhere, e.g. in a
+/// mapped scene snapshot, which then has to outlive it (see view()).
+/// Copies always own their elements, so a copy no longer depends on the mapping;
+/// moves keep the view. Changing the size of a view first makes it an owned copy.
+template <typename T>
+class SceneArray {
+public:
+    using value_type = T;
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    SceneArray() {}
+    SceneArray(std::vector<T> elements) : owned(std::move(elements)) {
+        point_at_owned();
+    }
+    SceneArray(size_t count, const T &value) : owned(count, value) {
+        point_at_owned();
+    }
+    SceneArray(const SceneArray &other) : owned(other.begin(), other.end()) {
+        point_at_owned();
+    }
+    // A moved std::vector keeps its buffer, so ptr stays valid.
+    SceneArray(SceneArray &&other) noexcept :
+        owned(std::move(other.owned)), ptr(other.ptr), count(other.count) {
+        other.ptr = nullptr;
+        other.count = 0;
+    }
+    SceneArray &operator=(SceneArray other) noexcept {
+        owned.swap(other.owned);
+        std::swap(ptr, other.ptr);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    /// The count elements at data, without copying them.
+    static SceneArray view(T *data, size_t count) {
+        SceneArray array;
+        array.ptr = data;
+        array.count = count;
+        return array;
+    }
+    bool is_view() const {
+        return ptr != owned.data();
+    }
+
+    size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+    T *data() {
+        return ptr;
+    }
+    const T *data() const {
+        return ptr;
+    }
+    T &operator[](size_t i) {
+        return ptr[i];
+    }
+    const T &operator[](size_t i) const {
+        return ptr[i];
+    }
+    T *begin() {
+        return ptr;
+    }
+    T *end() {
+        return ptr + count;
+    }
+    const T *begin() const {
+        return ptr;
+    }
+    const T *end() const {
+        return ptr + count;
+    }
+
+    void push_back(const T &value) {
+        make_owned();
+        owned.push_back(value);
+        point_at_owned();
+    }
+    void resize(size_t new_size) {
+        make_owned();
+        owned.resize(new_size);
+        point_at_owned();
+    }
+    void reserve(size_t capacity) {
+        make_owned();
+        owned.reserve(capacity);
+        point_at_owned();
+    }
+
+private:
+    void make_owned() {
+        if (is_view()) {
+            owned.assign(ptr, ptr + count);
+        }
+    }
+    void point_at_owned() {
+        ptr = owned.data();
+        count = owned.size();
+    }
+
+    std::vector<T> owned;
+    T *ptr = nullptr;
+    size_t count = 0;
+};
@@ -0,0 +1,383 @@
+#include "scene_snapshot.h"
+#include "mmap_file.h"
+#include "parse_scene.h"
+
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+namespace {
+
+const char c_snapshot_magic[8] = {'T', 'O', 'R', 'S', 'N', 'A', 'P', '\0'};
+// Bump this whenever the layout below or any of the raw-copied structs change.
+const uint32_t c_snapshot_version = 3;
+// The large arrays are used in place, so they start at a multiple of this.
+const uint64_t c_array_alignment = 64;
+
+// Shapes, lights, the camera and the BVH nodes are stored as raw bytes.
+static_assert(std::is_trivially_copyable_v<Shape>);
+static_assert(std::is_trivially_copyable_v<Light>);
+static_assert(std::is_trivially_copyable_v<Camera>);
+static_assert(std::is_trivially_copyable_v<FlatBVHNode>);
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    // Layout checks: a snapshot only loads into a build with the same struct sizes.
+    uint32_t real_size;
+    uint32_t shape_size;
+    uint32_t light_size;
+    uint32_t bvh_node_size;
+};
+
+class SnapshotWriter {
+public:
+    SnapshotWriter(const fs::path &filename) : ofs(filename, std::ios::binary | std::ios::trunc) {
+        if (!ofs.is_open()) {
+            Error(std::string("Unable to write ") + filename.string());
+        }
+    }
+
+    void write_bytes(const void *data, size_t size) {
+        ofs.write((const char *)data, size);
+        offset += size;
+    }
+
+    template <typename T>
+    void write(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write_bytes(&value, sizeof(T));
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T> &v) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write<uint64_t>(v.size());
+        write_bytes(v.data(), v.size() * sizeof(T));
+    }
+
+    /// An array the reader uses in place (see SnapshotReader::view_array):
+    /// the elements start at a multiple of c_array_alignment.
+    template <typename T>
+    void write_array(const T *data, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        static const char zeros[c_array_alignment] = {};
+        write<uint64_t>(count);
+        write_bytes(zeros, (c_array_alignment - offset % c_array_alignment) % c_array_alignment);
+        write_bytes(data, count * sizeof(T));
+    }
+
+    template <typename T>
+    void write_array(const SceneArray<T> &array) {
+        write_array(array.data(), array.size());
+    }
+
+    bool good() const {
+        return ofs.good();
+    }
+
+private:
+    std::ofstream ofs;
+    uint64_t offset = 0;
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(MappedFile &file) : file(file) {}
+
+    void read_bytes(void *data, size_t size) {
+        if (size > file.size() - offset) {
+            Error("Scene snapshot is truncated.");
+        }
+        if (size > 0) {
+            std::memcpy(data, file.data() + offset, size);
+        }
+        offset += size;
+    }
+
+    template <typename T>
+    T read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        read_bytes(&value, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    std::vector<T> read_vector() {
+        std::vector<T> v(read_vector_size<T>());
+        read_bytes(v.data(), v.size() * sizeof(T));
+        return v;
+    }
+
+    /// An array written by SnapshotWriter::write_array, viewed in the mapping.
+    template <typename T>
+    SceneArray<T> view_array() {
+        uint64_t size = read<uint64_t>();
+        offset = std::min<size_t>(file.size(),
+            (offset + c_array_alignment - 1) / c_array_alignment * c_array_alignment);
+        if (size > (file.size() - offset) / sizeof(T)) {
+            Error("Scene snapshot is truncated.");
+        }
+        T *data = (T *)(file.mutable_data() + offset);
+        offset += size * sizeof(T);
+        return SceneArray<T>::view(data, size);
+    }
+
+private:
+    template <typename T>
+    size_t read_vector_size() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        uint64_t size = read<uint64_t>();
+        if (size > (file.size() - offset) / sizeof(T)) {
+            Error("Scene snapshot is truncated.");
+        }
+        return size;
+    }
+
+    MappedFile &file;
+    size_t offset = 0;
+};
+
+void write_color(SnapshotWriter &w, const Color &color) {
+    if (auto *rgb = std::get_if<Vector3>(&color)) {
+        w.write<int32_t>(0);
+        w.write(*rgb);
+    } else {
+        const ImageTexture &texture = std::get<ImageTexture>(color);
+        w.write<int32_t>(1);
+        w.write(texture.uscale);
+        w.write(texture.vscale);
+        w.write(texture.uoffset);
+        w.write(texture.voffset);
+        w.write<int32_t>(texture.img3.width);
+        w.write<int32_t>(texture.img3.height);
+        w.write_vector(texture.img3.data);
+    }
+}
+
+Color read_color(SnapshotReader &r) {
+    int32_t type = r.read<int32_t>();
+    if (type == 0) {
+        return r.read<Vector3>();
+    }
+    // Go through ParsedImageTexture with a pre-decoded image, like parse_scene does.
+    ParsedImageTexture parsed;
+    parsed.uscale = r.read<Real>();
+    parsed.vscale = r.read<Real>();
+    parsed.uoffset = r.read<Real>();
+    parsed.voffset = r.read<Real>();
+    auto image = std::make_shared<Image3>();
+    image->width = r.read<int32_t>();
+    image->height = r.read<int32_t>();
+    image->data = r.read_vector<Vector3>();
+    parsed.image = image;
+    return ImageTexture(parsed);
+}
+
+void write_material(SnapshotWriter &w, const Material &material) {
+    w.write<int32_t>(material.index());
+    std::visit([&](const auto &m) {
+        using T = std::decay_t<decltype(m)>;
+        if constexpr (std::is_same_v<T, Plastic>) {
+            w.write(m.eta);
+        }
+        write_color(w, m.reflectance);
+        if constexpr (std::is_same_v<T, Phong> ||
+                      std::is_same_v<T, BlinnPhong> ||
+                      std::is_same_v<T, Microfacet>) {
+            w.write(m.exponent);
+        }
+    }, material);
+}
+
+Material read_material(SnapshotReader &r) {
+    int32_t type = r.read<int32_t>();
+    switch (type) {
+        case 0: return Diffuse{read_color(r)};
+        case 1: return Mirror{read_color(r)};
+        case 2: {
+            Real eta = r.read<Real>();
+            return Plastic{eta, read_color(r)};
+        }
+        case 3: {
+            Color reflectance = read_color(r);
+            return Phong{reflectance, r.read<Real>()};
+        }
+        case 4: {
+            Color reflectance = read_color(r);
+            return BlinnPhong{reflectance, r.read<Real>()};
+        }
+        case 5: {
+            Color reflectance = read_color(r);
+            return Microfacet{reflectance, r.read<Real>()};
+        }
+    }
+    Error("Scene snapshot contains an unknown material.");
+}
+
+} // namespace
+
+RenderScene build_render_scene(const fs::path &filename) {
+    Timer timer;
+    tick(timer);
+    ParsedScene scene = parse_scene(filename);
+    std::cout << "Scene parsing done. Took " << tick(timer) << " seconds." << std::endl;
+
+    RenderScene render_scene;
+    render_scene.scene = std::make_unique<Scene>(scene);
+    Scene &myScene = *render_scene.scene;
+    std::cout << "ParsedScene Copied to myScene. Took " <<
+            tick(timer) << " seconds." << std::endl;
+
+    // construct BVH tree
+    pcg32_state rng_BVH = init_pcg32();
+    // The BVH sorts pointers to the shapes; the leaves point straight into myScene.shapes
+    // (non-owning, myScene outlives the tree).
+    std::vector<std::shared_ptr<Shape>> shape_ptrs;
+    for (size_t i = 0; i < myScene.shapes.size(); ++i) {
+        shape_ptrs.push_back(std::shared_ptr<Shape>(std::shared_ptr<Shape>(), &myScene.shapes[i]));
+    }
+    // manually construct BVH for each mesh
+    render_scene.bvh = std::make_shared<BVH_node>(shape_ptrs, myScene, rng_BVH);
+    std::cout << "BVH tree built. Took " <<
+            tick(timer) << " seconds." << std::endl;
+    return render_scene;
+}
+
+void write_scene_snapshot(const fs::path &filename, const RenderScene &render_scene) {
+    const Scene &scene = *render_scene.scene;
+    fs::path tmp_filename = filename;
+    tmp_filename += ".tmp";
+    {
+        SnapshotWriter w(tmp_filename);
+        SnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, c_snapshot_magic, sizeof(c_snapshot_magic));
+        header.version = c_snapshot_version;
+        header.real_size = sizeof(Real);
+        header.shape_size = sizeof(Shape);
+        header.light_size = sizeof(Light);
+        header.bvh_node_size = sizeof(FlatBVHNode);
+        w.write(header);
+
+        w.write(scene.camera);
+        w.write_vector(scene.cameras);
+        w.write<int32_t>(scene.width);
+        w.write<int32_t>(scene.height);
+        w.write(scene.background_color);
+        w.write<int32_t>(scene.samples_per_pixel);
+
+        w.write<uint64_t>(scene.meshes.size());
+        for (const TriangleMesh &mesh : scene.meshes) {
+            w.write<int32_t>(mesh.material_id);
+            w.write<int32_t>(mesh.area_light_id);
+            w.write_array(mesh.positions);
+            w.write_array(mesh.indices);
+            w.write_array(mesh.normals);
+            w.write_array(mesh.uvs);
+            w.write<int32_t>(mesh.size);
+            w.write(mesh.totalArea);
+            w.write_array(mesh.areaCDF);
+        }
+        w.write_array(scene.shapes);
+        w.write_vector(scene.lights);
+        w.write<uint64_t>(scene.materials.size());
+        for (const Material &material : scene.materials) {
+            write_material(w, material);
+        }
+
+        if (render_scene.pages) {
+            Error("Out-of-core scenes cannot be written to a snapshot.");
+        }
+        std::vector<FlatBVHNode> nodes;
+        flatten_bvh(*render_scene.bvh, scene.shapes.data(), scene.shapes.size(), nodes);
+        w.write_array(nodes.data(), nodes.size());
+
+        if (!w.good()) {
+            Error(std::string("Failed writing ") + tmp_filename.string());
+        }
+    }
+    fs::rename(tmp_filename, filename);
+}
+
+RenderScene read_scene_snapshot(const fs::path &filename) {
+    RenderScene render_scene;
+    render_scene.snapshot = std::make_shared<MappedFile>(filename, MapMode::InPlace);
+    SnapshotReader r(*render_scene.snapshot);
+    SnapshotHeader header = r.read<SnapshotHeader>();
+    if (std::memcmp(header.magic, c_snapshot_magic, sizeof(c_snapshot_magic)) != 0) {
+        Error(std::string("Not a scene snapshot: ") + filename.string());
+    }
+    if (header.version != c_snapshot_version ||
+            header.real_size != sizeof(Real) ||
+            header.shape_size != sizeof(Shape) ||
+            header.light_size != sizeof(Light) ||
+            header.bvh_node_size != sizeof(FlatBVHNode)) {
+        Error(std::string("Scene snapshot was written by an incompatible build: ") + filename.string());
+    }
+
+    render_scene.scene = std::make_unique<Scene>();
+    Scene &scene = *render_scene.scene;
+    scene.camera = r.read<Camera>();
+    scene.cameras = r.read_vector<Camera>();
+    scene.width = r.read<int32_t>();
+    scene.height = r.read<int32_t>();
+    scene.background_color = r.read<Vector3>();
+    scene.samples_per_pixel = r.read<int32_t>();
+
+    scene.meshes.resize(r.read<uint64_t>());
+    for (TriangleMesh &mesh : scene.meshes) {
+        mesh.material_id = r.read<int32_t>();
+        mesh.area_light_id = r.read<int32_t>();
+        mesh.positions = r.view_array<PackedPosition>();
+        mesh.indices = r.view_array<Vector3i>();
+        mesh.normals = r.view_array<PackedNormal>();
+        mesh.uvs = r.view_array<PackedUV>();
+        mesh.size = r.read<int32_t>();
+        mesh.totalArea = r.read<Real>();
+        mesh.areaCDF = r.view_array<Real>();
+    }
+    scene.shapes = r.view_array<Shape>();
+    scene.lights = r.read_vector<Light>();
+    uint64_t num_materials = r.read<uint64_t>();
+    for (uint64_t i = 0; i < num_materials; i++) {
+        scene.materials.push_back(read_material(r));
+    }
+
+    // The BVH is traversed straight from the mapping. Check the indices once, so that
+    // a damaged file fails here instead of in the middle of the render.
+    SceneArray<FlatBVHNode> nodes = r.view_array<FlatBVHNode>();
+    if (nodes.empty()) {
+        Error("Scene snapshot has no BVH.");
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const FlatBVHNode &node = nodes[i];
+        if (node.shape >= 0) {
+            if (node.shape >= (int32_t)scene.shapes.size()) {
+                Error("Scene snapshot has an invalid BVH leaf.");
+            }
+        } else if (node.left <= (int32_t)i || node.left >= (int32_t)nodes.size() ||
+                   node.right <= (int32_t)i || node.right >= (int32_t)nodes.size()) {
+            Error("Scene snapshot has an invalid BVH node.");
+        }
+    }
+    auto flat = std::make_shared<FlatBVH>();
+    flat->nodes = nodes.data();
+    flat->num_nodes = nodes.size();
+    flat->shapes = scene.shapes.data();
+    render_scene.bvh = std::make_shared<BVH_node>(flat);
+    return render_scene;
+}
+
+void make_scene_snapshot(const std::vector<std::string> &params) {
+    if (params.size() < 2) {
+        Error("Usage: -hw snapshot <scene file> <snapshot file>");
+    }
+    RenderScene render_scene = build_render_scene(params[0]);
+    Timer timer;
+    tick(timer);
+    write_scene_snapshot(params[1], render_scene);
+    std::cout << "Scene snapshot written to " << params[1] << ". Took " <<
+            tick(timer) << " seconds." << std::endl;
+}
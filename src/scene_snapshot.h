@@ -0,0 +1,39 @@
+#pragma once
+
+#include "BVH_node.h"
+#include "mmap_file.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class PagedGeometry;
+
+/// A fully constructed Scene together with its BVH.
+/// The BVH leaves point into scene->shapes and, for out-of-core scenes, into pages,
+/// so both have to outlive the BVH (members are destroyed in reverse order, so bvh goes first).
+/// A scene read from a snapshot uses its arrays and BVH nodes in place, so the
+/// snapshot mapping is declared first and unmapped last.
+struct RenderScene {
+    std::shared_ptr<MappedFile> snapshot;  // nullptr unless read from a snapshot
+    std::unique_ptr<Scene> scene;
+    std::shared_ptr<PagedGeometry> pages;  // nullptr unless built out-of-core
+    std::shared_ptr<BVH_node> bvh;
+};
+
+/// Parse a scene file, construct the Scene and build its BVH.
+RenderScene build_render_scene(const fs::path &filename);
+
+/// A snapshot stores everything build_render_scene produces -- meshes, primitives,
+/// materials with decoded textures, lights and the BVH topology -- in one versioned binary file.
+/// The file only contains indices, never pointers, so it can be moved or shared freely.
+void write_scene_snapshot(const fs::path &filename, const RenderScene &render_scene);
+
+/// Map a snapshot written by write_scene_snapshot and return the RenderScene in it.
+/// Meshes, shapes and the BVH are not copied but used straight from the mapping;
+/// only the small parts (cameras, lights, materials and their textures) are read into memory.
+RenderScene read_scene_snapshot(const fs::path &filename);
+
+/// Command line entry: "-hw snapshot <scene file> <snapshot file>"
+/// builds the scene and writes its snapshot.
+void make_scene_snapshot(const std::vector<std::string> &params);
@@ -0,0 +1,109 @@
+#include "tile_scheduler.h"
+
+#include <numeric>
+
+// From https://en.wikipedia.org/wiki/Hilbert_curve (xy2d)
+uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += uint64_t(s) * uint64_t(s) * ((3 * rx) ^ ry);
+        // rotate the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+std::vector<Tile> hilbert_tiles(int width, int height, int tile_size) {
+    int num_tiles_x = (width + tile_size - 1) / tile_size;
+    int num_tiles_y = (height + tile_size - 1) / tile_size;
+    uint32_t n = 1;
+    while (n < (uint32_t)std::max(num_tiles_x, num_tiles_y)) {
+        n *= 2;
+    }
+    std::vector<std::pair<uint64_t, Tile>> keyed;
+    for (int ty = 0; ty < num_tiles_y; ty++) {
+        for (int tx = 0; tx < num_tiles_x; tx++) {
+            Tile tile{tx * tile_size, ty * tile_size,
+                      std::min((tx + 1) * tile_size, width),
+                      std::min((ty + 1) * tile_size, height)};
+            keyed.push_back({hilbert_index(n, tx, ty), tile});
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+    std::vector<Tile> tiles;
+    for (const auto &k : keyed) {
+        tiles.push_back(k.second);
+    }
+    return tiles;
+}
+
+/// Append the quarters of tile to out, recursing while they are still expensive.
+/// The quarters are visited in Hilbert order (upper left, lower left, lower right, upper right).
+static void split_tile(const Tile &tile, Real cost, Real limit, int min_tile_size,
+                       std::vector<Tile> &out) {
+    int w = tile.x1 - tile.x0;
+    int h = tile.y1 - tile.y0;
+    if (cost <= limit || (w / 2 < min_tile_size && h / 2 < min_tile_size)) {
+        out.push_back(tile);
+        return;
+    }
+    int xm = w / 2 >= min_tile_size ? tile.x0 + w / 2 : tile.x1;
+    int ym = h / 2 >= min_tile_size ? tile.y0 + h / 2 : tile.y1;
+    const Tile parts[4] = {
+        {tile.x0, tile.y0, xm, ym},
+        {tile.x0, ym, xm, tile.y1},
+        {xm, ym, tile.x1, tile.y1},
+        {xm, tile.y0, tile.x1, ym},
+    };
+    for (const Tile &part : parts) {
+        if (part.num_pixels() > 0) {
+            split_tile(part, cost * part.num_pixels() / tile.num_pixels(), limit,
+                       min_tile_size, out);
+        }
+    }
+}
+
+std::vector<Tile> cost_adaptive_schedule(const std::vector<Tile> &tiles,
+                                         const std::vector<Real> &costs,
+                                         int min_tile_size) {
+    assert(tiles.size() == costs.size());
+    if (tiles.empty()) {
+        return {};
+    }
+    std::vector<Real> sorted_costs = costs;
+    std::nth_element(sorted_costs.begin(),
+                     sorted_costs.begin() + sorted_costs.size() / 2,
+                     sorted_costs.end());
+    Real limit = 2 * sorted_costs[sorted_costs.size() / 2];
+
+    std::vector<int> expensive;
+    for (int i = 0; i < (int)tiles.size(); i++) {
+        if (costs[i] > limit) {
+            expensive.push_back(i);
+        }
+    }
+    std::stable_sort(expensive.begin(), expensive.end(), [&](int a, int b) {
+        return costs[a] > costs[b];
+    });
+
+    std::vector<Tile> schedule;
+    for (int i : expensive) {
+        split_tile(tiles[i], costs[i], limit, min_tile_size, schedule);
+    }
+    for (int i = 0; i < (int)tiles.size(); i++) {
+        if (costs[i] <= limit) {
+            schedule.push_back(tiles[i]);
+        }
+    }
+    return schedule;
+}
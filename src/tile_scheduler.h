@@ -0,0 +1,30 @@
+#pragma once
+
+#include "torrey.h"
+
+#include <vector>
+
+/// A rectangle of pixels [x0, x1) x [y0, y1).
+struct Tile {
+    int x0, y0, x1, y1;
+
+    int num_pixels() const {
+        return (x1 - x0) * (y1 - y0);
+    }
+};
+
+/// Index of (x, y) along the Hilbert curve filling an n x n grid (n a power of two).
+uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y);
+
+/// Cover a width x height image with tile_size x tile_size tiles (clipped at the
+/// borders), ordered along a Hilbert curve so that consecutive tiles are neighbors.
+std::vector<Tile> hilbert_tiles(int width, int height, int tile_size);
+
+/// Turn per-tile cost estimates into a schedule. A tile that costs more than twice
+/// the median is split into quarters, recursively until its parts are estimated at
+/// no more than twice the median or reach min_tile_size. Split tiles are handed out
+/// first, most expensive first, so that the slow regions do not end up in the tail;
+/// everything else follows in the order of tiles.
+std::vector<Tile> cost_adaptive_schedule(const std::vector<Tile> &tiles,
+                                         const std::vector<Real> &costs,
+                                         int min_tile_size);
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "vector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// Storage of mesh vertex attributes (TriangleMesh arrays and the per-Triangle shading
+/// normals and uvs). By default everything is kept at full precision.
+/// Building with -DCOMPACT_ATTRIBUTES=ON defines TORREY_COMPACT_ATTRIBUTES, which stores
+///   - positions as 32-bit floats (12 bytes instead of 24),
+///   - normals octahedral-encoded in 2x16 bits (4 bytes instead of 24),
+///   - uvs as two half floats (4 bytes instead of 16). We use half rather than
+///     16-bit unorm because tiled textures routinely have uvs outside of [0, 1].
+/// Triangles decode their shading normals and uvs at hit time.
+/// Only the shading attributes are packed: every Triangle still keeps its intersection
+/// geometry (vertices, edges, face normal, area and box -- 200 bytes) in Real. Per vertex
+/// the mesh arrays shrink from 64 to 20 bytes, but per triangle sizeof(Shape) only goes
+/// from 352 to 256 bytes, and the Shapes dominate the memory of a triangle scene.
+/// Render the same scene with both builds and compare with "-hw imgdiff" to measure the error.
+
+/// Round to nearest even, with overflow to infinity.
+/// From https://gist.github.com/rygorous/2156668 (float_to_half_fast3_rtne)
+inline uint16_t float_to_half(float f) {
+    const uint32_t f32_infinity = 255u << 23;
+    const uint32_t f16_max = (127u + 16u) << 23;
+    const uint32_t denorm_magic_bits = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint16_t h;
+    if (bits >= f16_max) {
+        // Inf or NaN (all exponent bits set)
+        h = bits > f32_infinity ? 0x7e00 : 0x7c00;
+    } else if (bits < (113u << 23)) {
+        // (De)normalized number or zero: let the FPU do the rounding.
+        float denorm_magic, g;
+        std::memcpy(&denorm_magic, &denorm_magic_bits, sizeof(float));
+        std::memcpy(&g, &bits, sizeof(float));
+        g += denorm_magic;
+        std::memcpy(&bits, &g, sizeof(float));
+        h = uint16_t(bits - denorm_magic_bits);
+    } else {
+        uint32_t mantissa_odd = (bits >> 13) & 1;
+        bits += ((15u - 127u) << 23) + 0xfff;
+        bits += mantissa_odd;
+        h = uint16_t(bits >> 13);
+    }
+    return h | uint16_t(sign >> 16);
+}
+
+inline float half_to_float(uint16_t h) {
+    const uint32_t shifted_exponent = 0x7c00u << 13;
+    uint32_t bits = uint32_t(h & 0x7fff) << 13;
+    uint32_t exponent = shifted_exponent & bits;
+    bits += (127u - 15u) << 23;
+    if (exponent == shifted_exponent) {
+        // Inf/NaN
+        bits += (128u - 16u) << 23;
+    } else if (exponent == 0) {
+        // Zero/denormal: renormalize
+        const uint32_t magic_bits = 113u << 23;
+        float f, magic;
+        bits += 1u << 23;
+        std::memcpy(&f, &bits, sizeof(float));
+        std::memcpy(&magic, &magic_bits, sizeof(float));
+        f -= magic;
+        std::memcpy(&bits, &f, sizeof(float));
+    }
+    bits |= uint32_t(h & 0x8000) << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+/// Octahedral normal encoding, see "A Survey of Efficient Representations for
+/// Independent Unit Vectors" (Cigolle et al. 2014). The two coordinates of the
+/// octahedron unfolded onto [-1, 1]^2 are stored as 16-bit snorms.
+inline uint32_t encode_octahedral(const Vector3 &n) {
+    Real l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (l1 <= 0) {
+        return encode_octahedral(Vector3{0, 0, 1});
+    }
+    Real u = n.x / l1, v = n.y / l1;
+    if (n.z < 0) {
+        Real fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+        Real fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+        u = fu;
+        v = fv;
+    }
+    auto quantize = [](Real x) {
+        return uint32_t(std::round((std::clamp(x, Real(-1), Real(1)) * Real(0.5) + Real(0.5)) * 65535));
+    };
+    return quantize(u) | (quantize(v) << 16);
+}
+
+inline Vector3 decode_octahedral(uint32_t packed) {
+    Real u = Real(packed & 0xffff) / 65535 * 2 - 1;
+    Real v = Real(packed >> 16) / 65535 * 2 - 1;
+    Real z = 1 - std::abs(u) - std::abs(v);
+    if (z < 0) {
+        Real fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+        Real fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+        u = fu;
+        v = fv;
+    }
+    return normalize(Vector3{u, v, z});
+}
+
+#ifdef TORREY_COMPACT_ATTRIBUTES
+
+using PackedPosition = Vector3f;
+using PackedNormal = uint32_t;
+using PackedUV = uint32_t;
+
+inline PackedPosition pack_position(const Vector3 &p) {
+    return Vector3f(p);
+}
+inline Vector3 unpack_position(const PackedPosition &p) {
+    return Vector3(p);
+}
+inline PackedNormal pack_normal(const Vector3 &n) {
+    return encode_octahedral(n);
+}
+inline Vector3 unpack_normal(PackedNormal n) {
+    return decode_octahedral(n);
+}
+inline PackedUV pack_uv(const Vector2 &uv) {
+    return uint32_t(float_to_half(float(uv.x))) | (uint32_t(float_to_half(float(uv.y))) << 16);
+}
+inline Vector2 unpack_uv(PackedUV uv) {
+    return Vector2{half_to_float(uint16_t(uv & 0xffff)), half_to_float(uint16_t(uv >> 16))};
+}
+
+template <typename Packed, typename T, typename Pack>
+std::vector<Packed> pack_all(const std::vector<T> &values, Pack pack) {
+    std::vector<Packed> packed(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        packed[i] = pack(values[i]);
+    }
+    return packed;
+}
+inline std::vector<PackedPosition> pack_positions(std::vector<Vector3> positions) {
+    return pack_all<PackedPosition>(positions, pack_position);
+}
+inline std::vector<PackedNormal> pack_normals(std::vector<Vector3> normals) {
+    return pack_all<PackedNormal>(normals, pack_normal);
+}
+inline std::vector<PackedUV> pack_uvs(std::vector<Vector2> uvs) {
+    return pack_all<PackedUV>(uvs, pack_uv);
+}
+
+#else
+
+using PackedPosition = Vector3;
+using PackedNormal = Vector3;
+using PackedUV = Vector2;
+
+inline const Vector3 &pack_position(const Vector3 &p) {
+    return p;
+}
+inline const Vector3 &unpack_position(const PackedPosition &p) {
+    return p;
+}
+inline const Vector3 &pack_normal(const Vector3 &n) {
+    return n;
+}
+inline const Vector3 &unpack_normal(const PackedNormal &n) {
+    return n;
+}
+inline const Vector2 &pack_uv(const Vector2 &uv) {
+    return uv;
+}
+inline const Vector2 &unpack_uv(const PackedUV &uv) {
+    return uv;
+}
+inline std::vector<PackedPosition> pack_positions(std::vector<Vector3> positions) {
+    return positions;
+}
+inline std::vector<PackedNormal> pack_normals(std::vector<Vector3> normals) {
+    return normals;
+}
+inline std::vector<PackedUV> pack_uvs(std::vector<Vector2> uvs) {
+    return uvs;
+}
+
+#endif